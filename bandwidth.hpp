@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// Token bucket that never blocks: take() spends the bytes, going into debt
+// if there are not enough tokens, and says how long the caller should wait
+// before spending more so that the average stays at the rate. Bursts of up
+// to a tenth of a second's worth go through without waiting.
+class TokenBucket {
+    public:
+        using clock = std::chrono::steady_clock;
+
+    private:
+        std::mutex mutex_;
+        double rate_;
+        double burst_;
+        double tokens_;
+        clock::time_point last_ = clock::now();
+
+    public:
+        explicit TokenBucket(std::uint64_t bytes_per_second)
+            : rate_(static_cast<double>(bytes_per_second)), burst_(rate_ / 10), tokens_(burst_) {}
+
+        clock::duration take(std::size_t bytes) {
+            std::lock_guard lock(mutex_);
+            clock::time_point now = clock::now();
+            tokens_ = std::min(burst_, tokens_ + std::chrono::duration<double>(now - last_).count() * rate_);
+            last_ = now;
+            tokens_ -= static_cast<double>(bytes);
+            if (tokens_ >= 0) {
+                return clock::duration::zero();
+            }
+            return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(-tokens_ / rate_));
+        }
+
+        // True once the bucket has refilled, i.e. nothing was taken lately
+        bool idle() {
+            std::lock_guard lock(mutex_);
+            double elapsed = std::chrono::duration<double>(clock::now() - last_).count();
+            return tokens_ + elapsed * rate_ >= burst_;
+        }
+};
+
+struct ShapingOptions {
+    // Bytes per second, 0 for no limit. File transfers are held to both
+    // the global rate and their user's.
+    std::uint64_t upload_rate = 0;
+    std::uint64_t download_rate = 0;
+    std::uint64_t user_upload_rate = 0;
+    std::uint64_t user_download_rate = 0;
+};
+
+// Paces file uploads and downloads through a two-level hierarchy of token
+// buckets: one per direction for the whole server, and below it one per
+// direction for each user. A transfer charges both and waits for the
+// slower, so one user cannot take more than their share and all users
+// together cannot take more than the server's, which leaves the disk and
+// the io_context threads to the JSON API. Callers charge after each read
+// or write and wait the returned time before the next.
+class BandwidthShaper {
+    public:
+        enum class Direction { upload, download };
+
+    private:
+        struct UserBuckets {
+            std::unique_ptr<TokenBucket> upload;
+            std::unique_ptr<TokenBucket> download;
+        };
+
+        ShapingOptions options_;
+        std::unique_ptr<TokenBucket> upload_;
+        std::unique_ptr<TokenBucket> download_;
+        std::mutex mutex_;
+        std::unordered_map<std::uint64_t, UserBuckets> users_;
+        std::size_t next_sweep_ = 1024;
+
+        static std::unique_ptr<TokenBucket> bucket(std::uint64_t rate) {
+            return rate ? std::make_unique<TokenBucket>(rate) : nullptr;
+        }
+
+        // Drops the buckets of users that have gone quiet; a full bucket
+        // is the same as a new one. Runs whenever the map has doubled.
+        void sweep() {
+            for (auto it = users_.begin(); it != users_.end();) {
+                bool idle = (!it->second.upload || it->second.upload->idle())
+                            && (!it->second.download || it->second.download->idle());
+                it = idle ? users_.erase(it) : std::next(it);
+            }
+            next_sweep_ = std::max<std::size_t>(1024, users_.size() * 2);
+        }
+
+    public:
+        explicit BandwidthShaper(ShapingOptions const& options)
+            : options_(options), upload_(bucket(options.upload_rate)), download_(bucket(options.download_rate)) {}
+
+        BandwidthShaper(BandwidthShaper const&) = delete;
+        BandwidthShaper& operator=(BandwidthShaper const&) = delete;
+
+        ShapingOptions const& options() const {
+            return options_;
+        }
+
+        bool shaped(Direction direction) const {
+            if (direction == Direction::upload) {
+                return options_.upload_rate || options_.user_upload_rate;
+            }
+            return options_.download_rate || options_.user_download_rate;
+        }
+
+        // Bytes to move at a time in direction: small enough that pauses
+        // are short and frequent rather than long and bursty
+        std::size_t slice(Direction direction, std::size_t largest) const {
+            std::uint64_t global = direction == Direction::upload ? options_.upload_rate : options_.download_rate;
+            std::uint64_t user = direction == Direction::upload ? options_.user_upload_rate : options_.user_download_rate;
+            std::uint64_t rate = std::min(global ? global : UINT64_MAX, user ? user : UINT64_MAX);
+            return static_cast<std::size_t>(std::clamp<std::uint64_t>(rate / 20, 16 * 1024, largest));
+        }
+
+        // Spends bytes moved for user; returns how long to wait before
+        // moving more
+        TokenBucket::clock::duration charge(Direction direction, std::uint64_t user, std::size_t bytes) {
+            bool up = direction == Direction::upload;
+            TokenBucket::clock::duration wait = TokenBucket::clock::duration::zero();
+            if (TokenBucket* global = up ? upload_.get() : download_.get()) {
+                wait = global->take(bytes);
+            }
+            std::uint64_t user_rate = up ? options_.user_upload_rate : options_.user_download_rate;
+            if (user_rate == 0) {
+                return wait;
+            }
+
+            std::lock_guard lock(mutex_);
+            auto [it, created] = users_.try_emplace(user);
+            if (created) {
+                it->second = {bucket(options_.user_upload_rate), bucket(options_.user_download_rate)};
+                if (users_.size() >= next_sweep_) {
+                    sweep();
+                    it = users_.try_emplace(user, UserBuckets{bucket(options_.user_upload_rate),
+                                                              bucket(options_.user_download_rate)}).first;
+                }
+            }
+            TokenBucket& own = up ? *it->second.upload : *it->second.download;
+            return std::max(wait, own.take(bytes));
+        }
+};
@@ -0,0 +1,181 @@
+// Upload-shaped writes and download-shaped reads: plain pwrite/pread
+// against DiskIo, buffered and with O_DIRECT. Each upload keeps two 1 MiB
+// buffers in flight as the session does, and ends with an fdatasync.
+//
+//   make bench/disk_io && bench/disk_io [MiB per file] [files at once] [dir]
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "disk_io.hpp"
+
+namespace {
+
+constexpr std::size_t kChunk = DiskIo::kBufferSize;
+
+int open_file(std::filesystem::path const& path, int flags) {
+    int fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("open " + path.string() + ": " + std::strerror(errno));
+    }
+    return fd;
+}
+
+// One file through DiskIo, two buffers at a time
+struct Transfer {
+    DiskIo& io;
+    boost::asio::io_context& ioc;
+    int fd;
+    bool write;
+    std::uint64_t chunks;
+    unsigned& remaining;  // Transfers not finished yet
+    std::uint64_t next = 0;
+    unsigned in_flight = 0;
+
+    void finish() {
+        if (--remaining == 0) {
+            ioc.stop();
+        }
+    }
+
+    void start() {
+        for (int i = 0; i < 2; ++i) {
+            io.acquire(ioc.get_executor(), [this](DiskIo::Buffer buffer) {
+                issue(buffer);
+            });
+        }
+    }
+
+    void issue(DiskIo::Buffer buffer) {
+        if (next == chunks) {
+            io.release(buffer);
+            if (in_flight > 0) {
+                return;
+            }
+            if (!write) {
+                finish();
+                return;
+            }
+            io.sync(ioc.get_executor(), fd, [this](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    std::abort();
+                }
+                finish();
+            });
+            return;
+        }
+        std::uint64_t offset = next++ * kChunk;
+        ++in_flight;
+        auto done = [this, buffer](boost::system::error_code ec, std::size_t) {
+            if (ec) {
+                std::abort();
+            }
+            --in_flight;
+            issue(buffer);
+        };
+        if (write) {
+            std::memset(buffer.data, static_cast<int>(offset >> 20), kChunk);
+            io.write(ioc.get_executor(), fd, buffer, kChunk, offset, done);
+        } else {
+            io.read(ioc.get_executor(), fd, buffer, kChunk, offset, done);
+        }
+    }
+};
+
+double ring(std::vector<std::filesystem::path> const& paths, std::uint64_t chunks, bool write, bool direct) {
+    boost::asio::io_context ioc;
+    DiskIoOptions options;
+    options.direct = direct;
+    DiskIo io(ioc, options);
+    int flags = (write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY) | (direct ? O_DIRECT : 0);
+    unsigned remaining = static_cast<unsigned>(paths.size());
+    auto work = boost::asio::make_work_guard(ioc);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<Transfer>> transfers;
+    for (auto const& path : paths) {
+        transfers.push_back(std::make_unique<Transfer>(Transfer{io, ioc, open_file(path, flags), write, chunks, remaining}));
+        transfers.back()->start();
+    }
+    ioc.run();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    for (auto& transfer : transfers) {
+        ::close(transfer->fd);
+    }
+    return elapsed.count();
+}
+
+double plain(std::vector<std::filesystem::path> const& paths, std::uint64_t chunks, bool write) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (auto const& path : paths) {
+        threads.emplace_back([&path, chunks, write] {
+            std::vector<char> buffer(kChunk);
+            int fd = open_file(path, write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY);
+            for (std::uint64_t i = 0; i < chunks; ++i) {
+                std::memset(buffer.data(), static_cast<int>(i), kChunk);
+                ssize_t n = write ? ::pwrite(fd, buffer.data(), kChunk, i * kChunk)
+                                  : ::pread(fd, buffer.data(), kChunk, i * kChunk);
+                if (n != static_cast<ssize_t>(kChunk)) {
+                    std::abort();
+                }
+            }
+            if (write && ::fdatasync(fd) != 0) {
+                std::abort();
+            }
+            ::close(fd);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::uint64_t chunks = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1024;
+    unsigned files = argc > 2 ? std::atoi(argv[2]) : 4;
+    std::filesystem::path dir = argc > 3 ? argv[3] : std::filesystem::temp_directory_path() / "user_store_disk_bench";
+
+    std::filesystem::create_directories(dir);
+    std::vector<std::filesystem::path> paths;
+    for (unsigned i = 0; i < files; ++i) {
+        paths.push_back(dir / ("file" + std::to_string(i)));
+    }
+
+    boost::asio::io_context probe;
+    bool uring = DiskIo(probe, {}).uring();
+    std::printf("%u files of %llu MiB in %s, %s\n", files, static_cast<unsigned long long>(chunks), dir.c_str(),
+                uring ? "io_uring" : "fallback thread pool");
+    std::printf("%-18s %10s %10s\n", "", "write s", "read s");
+
+    double w = plain(paths, chunks, true);
+    double r = plain(paths, chunks, false);
+    std::printf("%-18s %10.2f %10.2f\n", "pwrite/pread", w, r);
+    w = ring(paths, chunks, true, false);
+    r = ring(paths, chunks, false, false);
+    std::printf("%-18s %10.2f %10.2f\n", "DiskIo buffered", w, r);
+    w = ring(paths, chunks, true, true);
+    r = ring(paths, chunks, false, true);
+    std::printf("%-18s %10.2f %10.2f\n", "DiskIo O_DIRECT", w, r);
+
+    std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,26 @@
+#!/bin/sh
+# The same GETs over one multiplexed HTTP/2 connection (nghttp) and over
+# parallel HTTP/1.1 connections (curl), against a running server.
+#
+#   bench/http2.sh [requests] [concurrency] [base URL]
+set -e
+
+requests=${1:-20000}
+streams=${2:-100}
+base=${3:-http://localhost:8080}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+curl -sf -X POST -H 'Content-Type: application/json' -d '{"name":"bench"}' "$base/api/users" -o /dev/null
+seq "$requests" | sed "s|.*|url = \"$base/api/users/1\"\noutput = /dev/null|" > "$work/curl.conf"
+yes "$base/api/users/1" | head -n "$requests" > "$work/urls"
+
+elapsed() {
+    start=$(date +%s%N)
+    "$@" > /dev/null 2>&1
+    echo "$(( ($(date +%s%N) - start) / 1000000 )) ms"
+}
+
+echo "$requests GET /api/users/1, $streams at a time"
+echo "HTTP/2, one connection (nghttp -m):    $(elapsed nghttp -n -m "$streams" $(cat "$work/urls"))"
+echo "HTTP/1.1, parallel connections (curl): $(elapsed curl -s --parallel --parallel-max "$streams" -K "$work/curl.conf")"
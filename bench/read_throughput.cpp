@@ -0,0 +1,89 @@
+// Lock-free read throughput of UserStore::find under an Epoch::Guard, from
+// 1 to 64 threads, with and without a writer replacing records alongside.
+//
+//   make bench/read_throughput && bench/read_throughput [users] [ms per run]
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+#include "epoch.hpp"
+#include "user_store.hpp"
+
+namespace {
+
+double run(UserStore& store, std::uint64_t users, unsigned threads, bool writer, std::chrono::milliseconds duration) {
+    std::atomic<bool> stop{false};
+    std::atomic<std::uint64_t> reads{0};
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; ++t) {
+        pool.emplace_back([&, t] {
+            std::uint64_t done = 0;
+            std::uint64_t x = 0x9e3779b97f4a7c15ull * (t + 1);
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (int i = 0; i < 256; ++i) {
+                    x ^= x << 13;
+                    x ^= x >> 7;
+                    x ^= x << 17;
+                    Epoch::Guard guard;
+                    if (!store.find(1 + x % users)) {
+                        std::abort();
+                    }
+                }
+                done += 256;
+            }
+            reads.fetch_add(done);
+        });
+    }
+    if (writer) {
+        pool.emplace_back([&] {
+            for (std::uint64_t i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+                Epoch::Guard guard;
+                store.replace(1 + i % users, {{"name", "bench"}, {"n", i}}, std::nullopt);
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(duration);
+    stop.store(true);
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return reads.load() / elapsed.count();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::uint64_t users = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    std::chrono::milliseconds duration(argc > 2 ? std::atoi(argv[2]) : 1000);
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "user_store_read_bench";
+    std::filesystem::remove_all(dir);
+    {
+        StoreOptions options;
+        options.data_dir = dir;
+        UserStore store(options);
+        for (std::uint64_t i = 0; i < users; ++i) {
+            Epoch::Guard guard;
+            store.create({{"name", "bench"}, {"n", i}});
+        }
+
+        std::printf("%u hardware threads, %llu users\n", std::thread::hardware_concurrency(),
+                    static_cast<unsigned long long>(users));
+        std::printf("%8s %16s %16s\n", "threads", "reads/s", "with writer");
+        for (unsigned threads = 1; threads <= 64; threads *= 2) {
+            double alone = run(store, users, threads, false, duration);
+            double shared = run(store, users, threads, true, duration);
+            std::printf("%8u %16.0f %16.0f\n", threads, alone, shared);
+        }
+    }
+    std::filesystem::remove_all(dir);
+}
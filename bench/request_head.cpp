@@ -0,0 +1,83 @@
+// Request head parsing: Beast's request_parser against the in-place
+// parser of request_head.hpp, for the requests of a few typical clients.
+//
+//   make bench/request_head && bench/request_head [iterations]
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/http.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+
+#include "request_head.hpp"
+
+namespace http = boost::beast::http;
+
+namespace {
+
+struct Sample {
+    char const* name;
+    std::string_view request;
+};
+
+constexpr Sample kSamples[] = {
+    {"wrk-style GET", "GET /api/users/1 HTTP/1.1\r\nHost: localhost:8080\r\n\r\n"},
+    {"curl GET",
+     "GET /api/users/1 HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n"},
+    {"browser GET",
+     "GET /api/users/1 HTTP/1.1\r\n"
+     "Host: localhost:8080\r\n"
+     "Connection: keep-alive\r\n"
+     "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+     "sec-ch-ua-mobile: ?0\r\n"
+     "sec-ch-ua-platform: \"Linux\"\r\n"
+     "Upgrade-Insecure-Requests: 1\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+     "Chrome/124.0.0.0 Safari/537.36\r\n"
+     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,"
+     "image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+     "Sec-Fetch-Site: none\r\n"
+     "Sec-Fetch-Mode: navigate\r\n"
+     "Sec-Fetch-User: ?1\r\n"
+     "Sec-Fetch-Dest: document\r\n"
+     "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+     "Accept-Language: en-US,en;q=0.9\r\n"
+     "\r\n"},
+};
+
+template <class F>
+double ns_per(long iterations, F f) {
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; ++i) {
+        f();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? std::atol(argv[1]) : 1000000;
+
+    std::printf("%-16s %6s %10s %10s\n", "request", "bytes", "Beast ns", "in place");
+    for (Sample const& sample : kSamples) {
+        double beast = ns_per(iterations, [&] {
+            http::request_parser<http::empty_body> parser;
+            boost::beast::error_code ec;
+            parser.put(boost::asio::buffer(sample.request.data(), sample.request.size()), ec);
+            if (ec || !parser.is_header_done()) {
+                std::abort();
+            }
+        });
+        double in_place = ns_per(iterations, [&] {
+            RequestHead head;
+            if (!parse_request_head(sample.request, head)) {
+                std::abort();
+            }
+            asm volatile("" : : "r"(head.size) : "memory");
+        });
+        std::printf("%-16s %6zu %10.0f %10.0f\n", sample.name, sample.request.size(), beast, in_place);
+    }
+}
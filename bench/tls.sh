@@ -0,0 +1,26 @@
+#!/bin/sh
+# Full against resumed TLS handshakes, and one large download over plain
+# HTTP and over TLS, against a server started with USER_STORE_TLS_CERT and
+# USER_STORE_TLS_KEY (and USER_STORE_KTLS=1 to compare kernel TLS).
+#
+#   bench/tls.sh [MiB to download] [TLS host:port] [plain base URL]
+set -e
+
+size=${1:-500}
+tls=${2:-localhost:8443}
+base=${3:-http://localhost:8080}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+echo "handshakes, TLS 1.2, 10 s each:"
+openssl s_time -connect "$tls" -tls1_2 -new -time 10 2>/dev/null | grep 'connections/user sec' | sed 's/^/  full:    /'
+openssl s_time -connect "$tls" -tls1_2 -reuse -time 10 2>/dev/null | grep 'connections/user sec' | sed 's/^/  resumed: /'
+
+user=$(curl -sf -X POST -H 'Content-Type: application/json' -d '{"name":"bench"}' "$base/api/users" |
+       sed 's/.*"id":\([0-9]*\).*/\1/')
+head -c "${size}M" /dev/urandom > "$work/source"
+curl -sf -T "$work/source" "$base/api/users/$user/files/bench" -o /dev/null
+
+echo "$size MiB download:"
+echo "  plain: $(curl -s -w '%{speed_download}' -o /dev/null "$base/api/users/$user/files/bench") B/s"
+echo "  TLS:   $(curl -sk -w '%{speed_download}' -o /dev/null "https://$tls/api/users/$user/files/bench") B/s"
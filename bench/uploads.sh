@@ -0,0 +1,52 @@
+#!/bin/sh
+# Concurrent large uploads and downloads against a running server, with
+# its resident set size and page cache growth. Start the server first,
+# once per configuration to compare, e.g.
+#
+#   ./communication                          (buffered writes)
+#   USER_STORE_DIRECT_IO=1 ./communication   (O_DIRECT)
+#
+#   bench/uploads.sh [MiB per upload] [uploads at once] [base URL]
+set -e
+
+size=${1:-1024}
+count=${2:-4}
+base=${3:-http://localhost:8080}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+pid=$(pgrep -xo communication || true)
+rss() {
+    [ -n "$pid" ] && awk '/VmRSS/ { print $2 " kB" }' /proc/"$pid"/status || echo "?"
+}
+cached() {
+    awk '/^Cached:/ { print $2 }' /proc/meminfo
+}
+ms() {
+    echo "$(( ($(date +%s%N) - $1) / 1000000 )) ms"
+}
+
+user=$(curl -sf -X POST -H 'Content-Type: application/json' -d '{"name":"bench"}' "$base/api/users" |
+       sed 's/.*"id":\([0-9]*\).*/\1/')
+head -c "${size}M" /dev/urandom > "$work/source"
+expected=$(sha256sum < "$work/source")
+
+echo "$count uploads of $size MiB to user $user, server RSS $(rss)"
+before=$(cached)
+start=$(date +%s%N)
+for i in $(seq "$count"); do
+    curl -sf -T "$work/source" "$base/api/users/$user/files/bench$i" -o /dev/null &
+done
+wait
+echo "upload:   $(ms "$start"), server RSS $(rss), page cache +$(( ($(cached) - before) / 1024 )) MiB"
+
+start=$(date +%s%N)
+for i in $(seq "$count"); do
+    curl -sf "$base/api/users/$user/files/bench$i" -o "$work/copy$i" &
+done
+wait
+echo "download: $(ms "$start"), server RSS $(rss)"
+
+for i in $(seq "$count"); do
+    [ "$(sha256sum < "$work/copy$i")" = "$expected" ] || { echo "copy $i differs"; exit 1; }
+done
@@ -2,10 +2,52 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/json.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bandwidth.hpp"
+#include "compactor.hpp"
+#include "content_hash.hpp"
+#include "cpu_pool.hpp"
+#include "disk_io.hpp"
+#include "file_store.hpp"
+#include "http2_session.hpp"
+#include "http_range.hpp"
+#include "json_api.hpp"
+#include "object_backend.hpp"
+#include "request_head.hpp"
+#include "response_head.hpp"
+#include "s3_backend.hpp"
+#include "thread_per_core.hpp"
+#include "tls.hpp"
+#include "uploads.hpp"
+#include "user_partitions.hpp"
+#include "user_store.hpp"
 
 namespace beast = boost::beast;
 namespace http = beast::http;
@@ -13,163 +55,1607 @@ namespace net = boost::asio;
 namespace json = boost::json;
 using tcp = net::ip::tcp;
 
-// Simple HTTP session
-class Session : public std::enable_shared_from_this<Session> {
+// Simple HTTP session, over a beast::tcp_stream or a TlsStream
+template <class Stream>
+class Session : public std::enable_shared_from_this<Session<Stream>> {
     private:
-        beast::tcp_stream stream_;
+        static constexpr bool kTls = std::is_same_v<Stream, TlsStream>;
+
+        Stream stream_;
         beast::flat_buffer buffer_;
-        http::request<http::string_body> req_;
+        http::request<http::empty_body> req_;  // Headers of a JSON API request read by Beast
+        UserPartitions& users_;
+        unsigned home_;  // Partition that users created here go to
+        JsonApi api_;
+        FileStore& files_;
+        UploadRegistry& uploads_;
+        ObjectBackend* backend_;  // Null when local disk is the only copy
+        DiskIo& disk_;
+        BandwidthShaper& shaper_;
+        net::steady_timer pace_timer_;
+        bool fast_parse_;
+        CoreSet* cores_;  // With thread-per-core, else null
+        CpuPool* pool_;   // For CPU-heavy work, if any
 
-        // Simple in-memory data store
-        static inline json::object users_ = {
-            {"1", {{"echo", "HelloWorld"}}}
-        };
+        // What the JSON API looks at in a request, taken from req_ or
+        // parsed in place from buffer_. It owns its strings: work handed to
+        // other threads reads them after buffer_ has moved on.
+        struct Head {
+            http::verb method;
+            std::string target;
+            unsigned version;
+            bool keep_alive;
+            std::optional<std::string> if_match;
 
-        json::object handle_get_users() {
-            json::object response;
-            response["users"] = json::array();
-            
-            for (auto& [id, user] : users_) {
-                response["users"].as_array().push_back(user);
+            // Copies the strings, reusing what they hold already
+            void set(http::verb verb, std::string_view path, unsigned http_version, bool persistent,
+                     std::optional<std::string_view> tag) {
+                method = verb;
+                target.assign(path);
+                version = http_version;
+                keep_alive = persistent;
+                if_match = tag;
             }
-            
-            return response;
+        };
+        Head head_;
+
+        // Headers are read first and the body is handled by route: uploads
+        // stream to disk, JSON bodies are parsed as they arrive through
+        // chunk_, limited to kBodyLimit, and requests without a body read
+        // nothing more
+        static constexpr std::uint64_t kBodyLimit = 1024 * 1024;
+        std::optional<http::request_parser<http::empty_body>> header_parser_;
+        std::optional<http::request_parser<http::buffer_body>> body_parser_;
+        std::array<char, 8192> chunk_;
+        std::optional<json::stream_parser> json_parser_;  // Null for routes that take no body
+        json::error_code json_error_;
+        std::optional<json::value> body_;  // Null if missing or not valid JSON
+
+        // A body being written to disk: the parser fills a pool buffer, which
+        // is written asynchronously while the next one fills
+        struct BodySink {
+            std::uint64_t user = 0;      // Charged for the bandwidth
+            int fd = -1;                 // -1 only hashes the body
+            std::uint64_t start = 0;     // File offset of the body
+            std::uint64_t written = 0;   // Bytes received so far
+            Sha256* hash = nullptr;
+            bool pad = false;            // O_DIRECT: round the last write up to DiskIo::kAlignment
+            DiskIo::Buffer buffer;
+            std::size_t filled = 0;      // Bytes of buffer filled
+            unsigned writes = 0;         // In flight
+            bool done = false;
+            beast::error_code error;
+            std::function<void(beast::error_code)> finish;
+        };
+        BodySink sink_;
+
+        // Destination of the upload being received
+        std::uint64_t upload_user_ = 0;
+        std::string upload_name_;
+        std::filesystem::path upload_temp_;
+        int upload_fd_ = -1;
+        std::optional<Sha256> upload_hash_;
+        std::optional<Digest> upload_digest_;  // Declared by the client
+        std::uint64_t upload_reserved_ = 0;    // Of the user's quota
+
+        // Resumable upload the chunk being received belongs to
+        std::shared_ptr<Upload> chunk_upload_;
+
+        // A download in progress: each piece's text is written as is and
+        // then followed by a range of the file, sent with sendfile
+        struct Piece {
+            std::string text;
+            std::uint64_t offset;
+            std::uint64_t length;
+        };
+        int download_fd_ = -1;
+        std::uint64_t download_user_ = 0;
+        std::vector<Piece> pieces_;
+        std::size_t piece_ = 0;
+        std::unique_ptr<char, decltype(&std::free)> download_buffer_{nullptr, &std::free};  // With O_DIRECT
+
+        using response_type = http::response<http::string_body>;
+
+        tcp::socket& socket() {
+            return beast::get_lowest_layer(stream_).socket();
         }
 
-        json::object handle_get_user(const std::string& id) {
-            if (users_.contains(id)) {
-                return users_[id].as_object();
+        // True if what is written to the socket itself reaches the client
+        // as it should: always in the clear, and over TLS once the kernel
+        // encrypts
+        bool socket_writes() const {
+            if constexpr (kTls) {
+                return stream_.kernel_tx();
+            } else {
+                return true;
             }
-            
-            json::object error;
-            error["error"] = "User not found";
-            return error;
         }
 
-        json::object handle_create_user(const std::string& body) {
-            json::value jv = json::parse(body);
-            json::object user = jv.as_object();
-            
-            // Generate new ID
-            std::string new_id = std::to_string(users_.size() + 1);
-            user["id"] = std::stoi(new_id);
-            
-            users_[new_id] = user;
-            
-            json::object response;
-            response["message"] = "User created";
-            response["user"] = user;
-            return response;
+        // JSON API responses are written as a ResponseHead and the body,
+        // so building one allocates nothing beyond the body
+        using Reply = JsonApi::Reply;
+        using Canned = JsonApi::Canned;
+        Reply reply_;
+        ResponseHead response_head_;
+
+        // A canned response after the common headers, serialized once per
+        // error and connection disposition
+        static std::string const& canned_tail(Canned canned, bool keep_alive) {
+            static auto const table = [] {
+                std::array<std::array<std::string, 2>, std::size_t(Canned::count)> table;
+                for (std::size_t i = 1; i < table.size(); ++i) {
+                    JsonApi::CannedReply const& res = JsonApi::canned(Canned(i));
+                    for (bool keep : {false, true}) {
+                        table[i][keep] = std::string(res.retry ? "Retry-After: 1\r\n" : "") + "Content-Length: "
+                                         + std::to_string(res.body.size()) + "\r\n"
+                                         + (keep ? "" : "Connection: close\r\n") + "\r\n" + res.body;
+                    }
+                }
+                return table;
+            }();
+            return table[std::size_t(canned)][keep_alive];
+        }
+
+        static void set_error(response_type& res, http::status status, std::string const& message) {
+            res.result(status);
+            res.body() = JsonApi::error_body(message);
         }
 
         void route_request() {
-            std::string method(req_.method_string());
-            std::string target(req_.target());
-            
-            http::response<http::string_body> res{http::status::ok, req_.version()};
-            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-            res.set(http::field::content_type, "application/json");
-            res.keep_alive(req_.keep_alive());
-            
+            // Writes and list rebuilds may be handed to other threads
+            auto deferred = [self = this->shared_from_this()](Canned canned, Reply reply) mutable {
+                auto executor = self->stream_.get_executor();
+                net::post(executor, [self = std::move(self), canned, reply = std::move(reply)]() mutable {
+                    self->reply_ = std::move(reply);
+                    self->write_routed(canned);
+                });
+            };
+            if (api_.defer(head_.method, head_.target, head_.if_match, body_, std::move(deferred))) {
+                return;
+            }
+
+            // Another core's partition is served there; the session reads
+            // and writes nothing until the reply is back, so the request and
+            // reply_ stay where they are
+            if (auto partition = api_.partition_of(head_.method, head_.target);
+                cores_ && partition && cores_->owner(*partition) != CoreSet::current()) {
+                cores_->call(cores_->owner(*partition),
+                    [this] {
+                        return api_.route({head_.method, head_.target, head_.if_match, body_}, reply_);
+                    },
+                    [self = this->shared_from_this()](Canned canned) {
+                        self->write_routed(canned);
+                    });
+                return;
+            }
+            write_routed(api_.route({head_.method, head_.target, head_.if_match, body_}, reply_));
+        }
+
+        void write_routed(Canned canned) {
+            if (canned != Canned::none) {
+                write_canned(canned, head_.version == 11 && head_.keep_alive);
+                return;
+            }
+            write_reply();
+        }
+
+        // Routes req_, once Beast has read it
+        void route_parsed() {
+            std::optional<std::string_view> if_match;
+            if (auto it = req_.find(http::field::if_match); it != req_.end()) {
+                if_match = std::string_view(it->value().data(), it->value().size());
+            }
+            head_.set(req_.method(), {req_.target().data(), req_.target().size()}, req_.version(), req_.keep_alive(),
+                      if_match);
+            route_request();
+        }
+
+        // PUT /api/users/:id/files/:name - Upload a file, streamed to disk
+        void begin_upload(FileTarget const& file) {
+            auto const& head = header_parser_->get();
+            unsigned version = head.version();
+            bool expect_continue = beast::iequals(head[http::field::expect], "100-continue");
+
+            // Rejections leave the body unread, so the connection closes
+            Canned canned = Canned::none;
+            if (!users_.ready()) {
+                canned = Canned::recovering;
+            } else {
+                Epoch::Guard guard;
+                if (!users_.of(file.user).find(file.user)) {
+                    canned = Canned::user_not_found;
+                }
+            }
+            if (canned != Canned::none) {
+                write_canned(canned, false);
+                return;
+            }
+            if (!FileStore::valid_name(file.name)) {
+                send_error(version, http::status::bad_request, "Invalid file name");
+                return;
+            }
+
+            // The quota is checked against Content-Length before any of the
+            // body is read; a body of unknown length is cut off at whatever
+            // the quota has left
+            auto length = header_parser_->content_length();
+            if (!files_.reserve(file.user, length.value_or(0))) {
+                send_error(version, http::status::insufficient_storage, "Storage quota exceeded");
+                return;
+            }
+            upload_reserved_ = length.value_or(0);
+
+            upload_user_ = file.user;
+            upload_name_ = file.name;
+            upload_digest_.reset();
+            if (auto digest = head.find("Content-Digest"); digest != head.end()) {
+                upload_digest_ = parse_content_digest(std::string_view(digest->value().data(), digest->value().size()));
+            }
+
+            // Content declared to be already stored is only hashed, to prove
+            // the client has it, and never written
+            if (!upload_digest_) {
+                receive_upload(false, expect_continue, length.has_value());
+                return;
+            }
+            auto self = this->shared_from_this();
+            disk_.offload(stream_.get_executor(), [this, digest = *upload_digest_] {
+                return files_.has_object(digest);
+            }, [self, expect_continue, sized = length.has_value()](std::exception_ptr, bool stored) {
+                self->receive_upload(stored, expect_continue, sized);
+            });
+        }
+
+        // Reads the body of an upload begun by begin_upload, either only
+        // hashing it (stored) or writing it to a temporary file
+        void receive_upload(bool stored, bool expect_continue, bool sized) {
+            unsigned version = header_parser_->get().version();
+            if (stored) {
+                upload_fd_ = -1;
+            } else {
+                try {
+                    upload_temp_ = files_.begin();
+                } catch (std::exception const& e) {
+                    abort_upload();
+                    send_error(version, http::status::internal_server_error, e.what());
+                    return;
+                }
+                int flags = O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC;
+                upload_fd_ = ::open(upload_temp_.c_str(), flags | (disk_.direct() ? O_DIRECT : 0), 0644);
+                if (upload_fd_ < 0 && errno == EINVAL) {
+                    // The filesystem does not do O_DIRECT
+                    upload_fd_ = ::open(upload_temp_.c_str(), flags, 0644);
+                }
+                if (upload_fd_ < 0) {
+                    abort_upload();
+                    send_error(version, http::status::internal_server_error, "Cannot store file");
+                    return;
+                }
+            }
+            upload_hash_.emplace();
+            body_parser_.emplace(std::move(*header_parser_));
+            if (!sized) {
+                body_parser_->body_limit(files_.remaining(upload_user_));
+            }
+            sink_ = BodySink{};
+            sink_.user = upload_user_;
+            sink_.fd = upload_fd_;
+            sink_.hash = &*upload_hash_;
+            sink_.pad = upload_fd_ >= 0 && (::fcntl(upload_fd_, F_GETFL) & O_DIRECT);
+            sink_.finish = [this](beast::error_code ec) {
+                finish_upload(ec);
+            };
+
+            continue_then(expect_continue, [this] {
+                receive_body();
+            }, [this] {
+                abort_upload();
+            });
+        }
+
+        // Sends 100 Continue first if the client asked for it, then calls
+        // next; failed if the interim response could not be written
+        template <class Next, class Failed>
+        void continue_then(bool expect_continue, Next next, Failed failed) {
+            if (!expect_continue) {
+                next();
+                return;
+            }
+            static constexpr std::string_view kContinue = "HTTP/1.1 100 Continue\r\n\r\n";
+            auto self = this->shared_from_this();
+            net::async_write(stream_, net::buffer(kContinue.data(), kContinue.size()),
+                [self, next, failed](beast::error_code ec, std::size_t) {
+                    if (!ec) {
+                        next();
+                    } else {
+                        failed();
+                    }
+                });
+        }
+
+        // The body goes through DiskIo pool buffers, so an upload holds at
+        // most two of them: one filling, one being written. The content is
+        // hashed on the way. Each read is charged to the shaper, which
+        // decides how long to pause before the next.
+        //
+        // A pool buffer is only taken once body bytes are in the
+        // connection's own buffer, so clients that open uploads and then
+        // stall hold none and cannot starve the others.
+        void receive_body() {
+            auto self = this->shared_from_this();
+            if (buffer_.size() == 0 && !body_parser_->is_done()) {
+                stream_.async_read_some(buffer_.prepare(4096),
+                    [self](beast::error_code ec, std::size_t size) {
+                        if (ec) {
+                            self->sink_.error = ec;
+                            self->finish_body();
+                            return;
+                        }
+                        self->buffer_.commit(size);
+                        self->receive_body();
+                    });
+                return;
+            }
+            disk_.acquire(stream_.get_executor(), [self](DiskIo::Buffer buffer) {
+                self->sink_.buffer = buffer;
+                self->sink_.filled = 0;
+                self->fill_buffer();
+            });
+        }
+
+        void fill_buffer() {
+            auto& body = body_parser_->get().body();
+            body.data = sink_.buffer.data + sink_.filled;
+            body.size = std::min(DiskIo::kBufferSize - sink_.filled,
+                                 shaper_.slice(BandwidthShaper::Direction::upload, DiskIo::kBufferSize));
+            body.more = true;
+
+            auto self = this->shared_from_this();
+            http::async_read(stream_, buffer_, *body_parser_,
+                [self, size = body.size](beast::error_code ec, std::size_t) {
+                    self->on_read(ec, size - self->body_parser_->get().body().size);
+                });
+        }
+
+        void on_read(beast::error_code ec, std::size_t read) {
+            if (ec == http::error::need_buffer) {
+                ec = {};
+            }
+            DiskIo::Buffer buffer = sink_.buffer;
+            if (ec) {
+                disk_.release(buffer);
+                sink_.error = ec;
+                finish_body();
+                return;
+            }
+            if (sink_.hash) {
+                sink_.hash->update(buffer.data + sink_.filled, read);
+            }
+            sink_.filled += read;
+            sink_.written += read;
+            bool last = body_parser_->is_done();
+            auto self = this->shared_from_this();
+            if (!last && sink_.filled < DiskIo::kBufferSize) {
+                pace(BandwidthShaper::Direction::upload, sink_.user, read, [self] {
+                    self->fill_buffer();
+                });
+                return;
+            }
+
+            // The buffer is full, or holds the end of the body
+            std::size_t filled = sink_.filled;
+            if (sink_.fd < 0 || filled == 0) {
+                if (!last) {
+                    sink_.filled = 0;
+                    pace(BandwidthShaper::Direction::upload, sink_.user, read, [self] {
+                        self->fill_buffer();
+                    });
+                    return;
+                }
+                disk_.release(buffer);
+            } else {
+                std::size_t size = filled;
+                if (last && sink_.pad) {
+                    size = (filled + DiskIo::kAlignment - 1) & ~(DiskIo::kAlignment - 1);
+                    std::memset(buffer.data + filled, 0, size - filled);
+                }
+                sink_.writes++;
+                disk_.write(stream_.get_executor(), sink_.fd, buffer, size, sink_.start + sink_.written - filled,
+                    [self, buffer](beast::error_code ec, std::size_t) {
+                        self->disk_.release(buffer);
+                        self->sink_.writes--;
+                        if (ec && !self->sink_.error) {
+                            self->sink_.error = ec;
+                        }
+                        self->finish_body();
+                    });
+                if (!last) {
+                    pace(BandwidthShaper::Direction::upload, sink_.user, read, [self] {
+                        self->receive_body();
+                    });
+                    return;
+                }
+            }
+            sink_.done = true;
+            finish_body();
+        }
+
+        // Charges bytes moved for user, then runs next once the shaper's
+        // pause is over
+        template <class Next>
+        void pace(BandwidthShaper::Direction direction, std::uint64_t user, std::size_t bytes, Next next) {
+            auto wait = shaper_.charge(direction, user, bytes);
+            if (wait <= decltype(wait)::zero()) {
+                next();
+                return;
+            }
+            pace_timer_.expires_after(wait);
+            pace_timer_.async_wait([self = this->shared_from_this(), next](beast::error_code ec) {
+                if (!ec) {
+                    next();
+                }
+            });
+        }
+
+        // Hands the result over once the body is read, or failed, and no
+        // writes are left in flight
+        void finish_body() {
+            if ((sink_.done || sink_.error) && sink_.writes == 0 && sink_.finish) {
+                auto finish = std::move(sink_.finish);
+                sink_.finish = nullptr;
+                finish(sink_.error);
+            }
+        }
+
+        void abort_upload() {
+            if (upload_fd_ >= 0) {
+                ::close(upload_fd_);
+                upload_fd_ = -1;
+                files_.abort(upload_temp_);
+            }
+            release_quota();
+        }
+
+        void release_quota() {
+            files_.unreserve(upload_user_, upload_reserved_);
+            upload_reserved_ = 0;
+        }
+
+        void finish_upload(beast::error_code ec) {
+            unsigned version = body_parser_->get().version();
+            if (ec) {
+                abort_upload();
+                if (ec == http::error::body_limit) {
+                    // Only the quota limits a file body
+                    send_error(version, http::status::insufficient_storage, "Storage quota exceeded");
+                }
+                return;
+            }
+
+            Digest digest = upload_hash_->finish();
+            if (upload_digest_ && *upload_digest_ != digest) {
+                abort_upload();
+                send_error(version, http::status::bad_request, "Content-Digest mismatch");
+                return;
+            }
+            std::uint64_t size = sink_.written;
+            if (sink_.pad && ::ftruncate(upload_fd_, static_cast<off_t>(size)) != 0) {
+                abort_upload();
+                send_error(version, http::status::internal_server_error, "Cannot store file");
+                return;
+            }
+            auto failed = [this, version](http::status status, char const* message) {
+                abort_upload();
+                send_error(version, status, message);
+            };
+            if (upload_fd_ >= 0) {
+                store_file(upload_fd_, upload_temp_, digest, size, upload_user_, upload_name_, false, [this, digest, size] {
+                    commit_upload(digest, size);
+                }, failed);
+                return;
+            }
+            auto self = this->shared_from_this();
+            disk_.offload(stream_.get_executor(), [this, digest] {
+                return files_.link_existing(digest, upload_user_, upload_name_);
+            }, [self, digest, size, failed](std::exception_ptr error, bool linked) {
+                if (error) {
+                    fail_with(error, failed);
+                } else if (!linked) {
+                    failed(http::status::conflict, "Stored content vanished, upload again");
+                } else {
+                    self->commit_upload(digest, size);
+                }
+            });
+        }
+
+        // Answers an upload that is stored
+        void commit_upload(Digest const& digest, std::uint64_t size) {
+            unsigned version = body_parser_->get().version();
+            if (upload_fd_ >= 0) {
+                ::close(upload_fd_);
+                upload_fd_ = -1;
+            }
+            release_quota();
+
+            response_type res{http::status::created, version};
+            set_file_result(res, upload_name_, size, digest);
+            send(std::move(res), body_parser_->get().keep_alive());
+        }
+
+        // Calls failed(500, message) with the message of error
+        template <class Failed>
+        static void fail_with(std::exception_ptr error, Failed& failed) {
             try {
-                // GET /api/users - List all users
-                if (method == "GET" && target == "/api/users") {
-                    res.body() = json::serialize(handle_get_users());
-                }
-                // GET /api/users/:id - Get specific user
-                else if (method == "GET" && target.starts_with("/api/users/")) {
-                    std::string id = target.substr(11); // Skip "/api/users/"
-                    res.body() = json::serialize(handle_get_user(id));
-                }
-                // POST /api/users - Create new user
-                else if (method == "POST" && target == "/api/users") {
-                    res.body() = json::serialize(handle_create_user(req_.body()));
-                    res.result(http::status::created);
-                }
-                // 404 Not Found
-                else {
-                    res.result(http::status::not_found);
-                    json::object error;
-                    error["error"] = "Endpoint not found";
-                    res.body() = json::serialize(error);
+                std::rethrow_exception(error);
+            } catch (std::exception const& e) {
+                failed(http::status::internal_server_error, e.what());
+            }
+        }
+
+        // Stores the upload written to fd at temp as user's file name, then
+        // runs next; otherwise failed with the status to answer. Content
+        // already stored is only linked to. New content is first synced
+        // through the ring and put in the backend if there is one. The file
+        // system steps run through disk_.offload, off the io thread.
+        template <class Next, class Failed>
+        void store_file(int fd, std::filesystem::path const& temp, Digest const& digest, std::uint64_t size,
+                        std::uint64_t user, std::string const& name, bool synced, Next next, Failed failed) {
+            auto self = this->shared_from_this();
+            disk_.offload(stream_.get_executor(), [this, fd, temp, digest, user, name, synced] {
+                return files_.commit(fd, temp, digest, user, name, synced);
+            }, [self, fd, temp, digest, size, user, name, next, failed](std::exception_ptr error, bool stored) mutable {
+                if (error) {
+                    fail_with(error, failed);
+                    return;
+                }
+                if (stored) {
+                    next();
+                    return;
+                }
+                auto store = [self, fd, temp, digest, size, user, name, next, failed] {
+                    self->store_file(fd, temp, digest, size, user, name, true, next, failed);
+                };
+                self->disk_.sync(self->stream_.get_executor(), fd, [self, fd, digest, size, store, failed](beast::error_code ec, std::size_t) {
+                    if (ec) {
+                        failed(http::status::internal_server_error, "Cannot store file");
+                        return;
+                    }
+                    if (!self->backend_) {
+                        store();
+                        return;
+                    }
+                    self->backend_->put(to_hex(digest), fd, size, [self, store, failed](beast::error_code ec) {
+                        net::post(self->stream_.get_executor(), [ec, store, failed] {
+                            if (ec) {
+                                failed(http::status::bad_gateway, "Object store unavailable");
+                            } else {
+                                store();
+                            }
+                        });
+                    });
+                });
+            });
+        }
+
+        static void set_file_result(response_type& res, std::string const& name, std::uint64_t size, Digest const& digest) {
+            json::object result;
+            result["message"] = "File uploaded";
+            result["file"] = json::object{{"name", name}, {"size", size}, {"sha256", to_hex(digest)}};
+            res.body() = json::serialize(result);
+        }
+
+        // Upload-Offset, Upload-Length: unsigned decimal
+        static std::optional<std::uint64_t> upload_header(http::fields const& fields, std::string_view name) {
+            auto it = fields.find(beast::string_view(name.data(), name.size()));
+            if (it == fields.end()) {
+                return std::nullopt;
+            }
+            std::uint64_t value = 0;
+            auto [end, ec] = std::from_chars(it->value().data(), it->value().data() + it->value().size(), value);
+            if (ec != std::errc() || end != it->value().data() + it->value().size()) {
+                return std::nullopt;
+            }
+            return value;
+        }
+
+        // Resumable uploads (after tus): POST /api/users/:id/uploads/:name
+        // with Upload-Length creates one, PATCH /api/uploads/:token with
+        // Upload-Offset writes a chunk there, HEAD reports the offset up to
+        // which everything has arrived and DELETE cancels. Chunks may arrive
+        // out of order and in parallel; the file is committed when the last
+        // byte is in.
+        void create_upload(FileTarget const& file) {
+            auto const& head = header_parser_->get();
+            unsigned version = head.version();
+            if (!users_.ready()) {
+                write_canned(Canned::recovering, false);
+                return;
+            }
+            {
+                Epoch::Guard guard;
+                if (!users_.of(file.user).find(file.user)) {
+                    write_canned(Canned::user_not_found, false);
+                    return;
                 }
+            }
+            auto length = upload_header(head, "Upload-Length");
+            if (!length || !FileStore::valid_name(file.name)) {
+                send_error(version, http::status::bad_request, length ? "Invalid file name" : "Upload-Length required");
+                return;
+            }
+
+            std::shared_ptr<Upload> upload;
+            try {
+                upload = uploads_.create(file.user, file.name, *length);
             } catch (std::exception const& e) {
-                res.result(http::status::bad_request);
-                json::object error;
-                error["error"] = e.what();
-                res.body() = json::serialize(error);
+                send_error(version, http::status::internal_server_error, e.what());
+                return;
             }
-            
+            if (!upload) {
+                send_error(version, http::status::insufficient_storage, "Storage quota exceeded");
+                return;
+            }
+            response_type res{http::status::created, version};
+            res.set(http::field::location, "/api/uploads/" + upload->token);
+            res.set("Upload-Offset", "0");
+            res.body() = "{\"upload\":\"" + upload->token + "\"}";
+            send(std::move(res), false);
+        }
+
+        void upload_status(std::string_view token, http::verb method) {
+            auto const& head = header_parser_->get();
+            unsigned version = head.version();
+            if (method == http::verb::delete_) {
+                if (!uploads_.cancel(token)) {
+                    send_error(version, http::status::not_found, "Upload not found");
+                    return;
+                }
+                send(response_type{http::status::no_content, version}, false);
+                return;
+            }
+
+            std::shared_ptr<Upload> upload = uploads_.find(token);
+            if (!upload) {
+                send_error(version, http::status::not_found, "Upload not found");
+                return;
+            }
+            response_type res{http::status::ok, version};
+            res.set(http::field::cache_control, "no-store");
+            res.set("Upload-Offset", std::to_string(upload->offset()));
+            res.set("Upload-Length", std::to_string(upload->length));
+            send(std::move(res), false);
+        }
+
+        void begin_chunk(std::string_view token) {
+            auto const& head = header_parser_->get();
+            unsigned version = head.version();
+            bool expect_continue = beast::iequals(head[http::field::expect], "100-continue");
+
+            chunk_upload_ = uploads_.find(token);
+            if (!chunk_upload_) {
+                send_error(version, http::status::not_found, "Upload not found");
+                return;
+            }
+            auto offset = upload_header(head, "Upload-Offset");
+            auto size = header_parser_->content_length();
+            if (!offset || !size) {
+                send_error(version, http::status::bad_request, "Upload-Offset and Content-Length required");
+                return;
+            }
+            if (!chunk_upload_->begin_chunk(*offset, *size)) {
+                chunk_upload_.reset();
+                send_error(version, http::status::conflict, "Chunk outside the upload or upload finished");
+                return;
+            }
+
+            body_parser_.emplace(std::move(*header_parser_));
+            sink_ = BodySink{};
+            sink_.user = chunk_upload_->user;
+            sink_.fd = chunk_upload_->fd;
+            sink_.start = *offset;
+            sink_.hash = chunk_upload_->hash_from(*offset);
+            sink_.finish = [this](beast::error_code ec) {
+                finish_chunk(ec);
+            };
+            continue_then(expect_continue, [this] {
+                receive_body();
+            }, [this] {
+                finish_chunk(net::error::broken_pipe);
+            });
+        }
+
+        void finish_chunk(beast::error_code ec) {
+            auto const& req = body_parser_->get();
+            std::uint64_t size = body_parser_->content_length().value_or(0);
+            Upload::ChunkResult result = chunk_upload_->end_chunk(sink_.start, sink_.written, !ec && sink_.written == size,
+                                                                  sink_.hash != nullptr);
+            if (ec) {
+                return;
+            }
+
+            if (result.finish) {
+                hash_upload(chunk_upload_, [this, version = req.version()](beast::error_code ec, Digest const& digest) {
+                    auto failed = [this, version](http::status status, char const* message) {
+                        uploads_.cancel(chunk_upload_->token);
+                        send_error(version, status, message);
+                    };
+                    if (ec) {
+                        failed(http::status::internal_server_error, "Cannot read upload");
+                        return;
+                    }
+                    Upload const& upload = *chunk_upload_;
+                    store_file(upload.fd, upload.temp, digest, upload.length, upload.user, upload.name, false,
+                               [this, digest] {
+                                   commit_chunks(digest);
+                               },
+                               failed);
+                });
+                return;
+            }
+
+            response_type res{http::status::no_content, req.version()};
+            res.set("Upload-Offset", std::to_string(result.offset));
+            send(std::move(res), req.keep_alive());
+        }
+
+        // Finishes the hash of a finished upload: what was not hashed as it
+        // arrived is read back through the ring a buffer at a time and
+        // hashed as each read completes. done(ec, digest) runs on the strand.
+        template <class Done>
+        void hash_upload(std::shared_ptr<Upload> upload, Done done) {
+            if (upload->hashed() == upload->length) {
+                done(beast::error_code{}, upload->digest());
+                return;
+            }
+            auto self = this->shared_from_this();
+            disk_.acquire(stream_.get_executor(), [self, upload, done](DiskIo::Buffer buffer) {
+                self->hash_upload(upload, buffer, done);
+            });
+        }
+
+        template <class Done>
+        void hash_upload(std::shared_ptr<Upload> upload, DiskIo::Buffer buffer, Done done) {
+            std::uint64_t offset = upload->hashed();
+            if (offset == upload->length) {
+                disk_.release(buffer);
+                done(beast::error_code{}, upload->digest());
+                return;
+            }
+            auto self = this->shared_from_this();
+            std::size_t size = static_cast<std::size_t>(std::min<std::uint64_t>(DiskIo::kBufferSize, upload->length - offset));
+            disk_.read(stream_.get_executor(), upload->fd, buffer, size, offset,
+                       [self, upload, buffer, done](beast::error_code ec, std::size_t read) {
+                           if (!ec && read == 0) {
+                               ec = net::error::eof;
+                           }
+                           if (ec) {
+                               self->disk_.release(buffer);
+                               done(ec, Digest{});
+                               return;
+                           }
+                           upload->hash(buffer.data, read);
+                           self->hash_upload(upload, buffer, done);
+                       });
+        }
+
+        // Answers the chunk that finished an upload, which is stored
+        void commit_chunks(Digest const& digest) {
+            auto const& req = body_parser_->get();
+            uploads_.remove(chunk_upload_->token);
+
+            response_type res{http::status::ok, req.version()};
+            set_file_result(res, chunk_upload_->name, chunk_upload_->length, digest);
+            res.set("Upload-Offset", std::to_string(chunk_upload_->length));
+            send(std::move(res), req.keep_alive());
+        }
+
+        // GET /api/users/:id/files/:name - Download a file or byte ranges of
+        // it. File bytes go out with sendfile and never enter user space,
+        // or with O_DIRECT or TLS without kTLS are read through the ring.
+        void begin_download(FileTarget const& file) {
+            auto const& head = header_parser_->get();
+            unsigned version = head.version();
+            bool keep_alive = head.keep_alive();
+            {
+                Epoch::Guard guard;
+                if (!users_.of(file.user).find(file.user)) {
+                    write_canned(Canned::user_not_found, version == 11 && keep_alive);
+                    return;
+                }
+            }
+            download_user_ = file.user;
+            struct stat st;
+            if (FileStore::valid_name(file.name)) {
+                download_fd_ = files_.open(file.user, file.name, disk_.direct() ? O_DIRECT : 0);
+                if (download_fd_ < 0 && errno == EINVAL) {
+                    download_fd_ = files_.open(file.user, file.name);
+                }
+            }
+            if (download_fd_ < 0 || ::fstat(download_fd_, &st) != 0) {
+                send_error(version, http::status::not_found, "File not found");
+                return;
+            }
+            if ((::fcntl(download_fd_, F_GETFL) & O_DIRECT) || !socket_writes()) {
+                download_buffer_.reset(static_cast<char*>(std::aligned_alloc(DiskIo::kAlignment, DiskIo::kBufferSize)));
+            }
+            std::uint64_t size = static_cast<std::uint64_t>(st.st_size);
+
+            std::vector<ByteRange> ranges{{0, size}};
+            bool partial = false;
+            if (auto range = head.find(http::field::range); range != head.end()) {
+                auto requested = parse_byte_ranges(std::string_view(range->value().data(), range->value().size()), size);
+                if (requested && requested->empty()) {
+                    response_type res{http::status::range_not_satisfiable, version};
+                    set_error(res, http::status::range_not_satisfiable, "Range not satisfiable");
+                    res.set(http::field::content_range, "bytes */" + std::to_string(size));
+                    send(std::move(res), keep_alive);
+                    return;
+                }
+                if (requested) {
+                    ranges = std::move(*requested);
+                    partial = true;
+                }
+            }
+
+            auto content_range = [size](ByteRange const& range) {
+                return "bytes " + std::to_string(range.first) + "-" + std::to_string(range.first + range.length - 1)
+                       + "/" + std::to_string(size);
+            };
+            http::response<http::empty_body> res{partial ? http::status::partial_content : http::status::ok, version};
+            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            auto date = CommonHeaders::date();
+            res.set(http::field::date, beast::string_view(date.data(), date.size()));
+            res.set(http::field::accept_ranges, "bytes");
+            res.keep_alive(keep_alive);
+
+            if (ranges.size() == 1) {
+                res.set(http::field::content_type, "application/octet-stream");
+                if (partial) {
+                    res.set(http::field::content_range, content_range(ranges[0]));
+                }
+                res.content_length(ranges[0].length);
+                pieces_.push_back({std::string(), ranges[0].first, ranges[0].length});
+            } else {
+                // multipart/byteranges: every part carries its own headers
+                char boundary[24];
+                std::snprintf(boundary, sizeof(boundary), "%016llx",
+                              static_cast<unsigned long long>(std::random_device()()) << 32 | std::random_device()());
+                std::uint64_t length = 0;
+                for (ByteRange const& range : ranges) {
+                    std::string text = pieces_.empty() ? "--" : "\r\n--";
+                    text += boundary;
+                    text += "\r\nContent-Type: application/octet-stream\r\nContent-Range: ";
+                    text += content_range(range);
+                    text += "\r\n\r\n";
+                    length += text.size() + range.length;
+                    pieces_.push_back({std::move(text), range.first, range.length});
+                }
+                pieces_.push_back({"\r\n--" + std::string(boundary) + "--\r\n", 0, 0});
+                length += pieces_.back().text.size();
+
+                res.set(http::field::content_type, "multipart/byteranges; boundary=" + std::string(boundary));
+                res.content_length(length);
+            }
+
+            std::ostringstream out;
+            out << res.base();
+            pieces_.front().text.insert(0, out.str());
+            send_piece();
+        }
+
+        void send_piece() {
+            if (piece_ == pieces_.size()) {
+                beast::error_code ec;
+                socket().shutdown(tcp::socket::shutdown_send, ec);
+                return;
+            }
+            auto self = this->shared_from_this();
+            net::async_write(stream_, net::buffer(pieces_[piece_].text),
+                [self](beast::error_code ec, std::size_t) {
+                    if (!ec) {
+                        self->send_file_range();
+                    }
+                });
+        }
+
+        // Sends the current piece's file range until the socket buffer is
+        // full, then waits for the socket to drain
+        void send_file_range() {
+            if (download_buffer_) {
+                read_file_range();
+                return;
+            }
+            Piece& piece = pieces_[piece_];
+            tcp::socket& socket = this->socket();
+            beast::error_code ec;
+            socket.native_non_blocking(true, ec);
+            bool shaped = shaper_.shaped(BandwidthShaper::Direction::download);
+            std::size_t slice = shaper_.slice(BandwidthShaper::Direction::download, std::size_t(1) << 30);
+            while (piece.length > 0) {
+                off_t offset = static_cast<off_t>(piece.offset);
+                ssize_t sent = ::sendfile(socket.native_handle(), download_fd_, &offset,
+                                          std::min<std::uint64_t>(piece.length, slice));
+                if (sent > 0) {
+                    piece.offset += static_cast<std::uint64_t>(sent);
+                    piece.length -= static_cast<std::uint64_t>(sent);
+                    if (shaped) {
+                        pace(BandwidthShaper::Direction::download, download_user_, static_cast<std::size_t>(sent),
+                            [self = this->shared_from_this()] {
+                                self->send_file_range();
+                            });
+                        return;
+                    }
+                } else if (sent < 0 && errno == EAGAIN) {
+                    auto self = this->shared_from_this();
+                    socket.async_wait(tcp::socket::wait_write, [self](beast::error_code ec) {
+                        if (!ec) {
+                            self->send_file_range();
+                        }
+                    });
+                    return;
+                } else if (sent == 0 || errno != EINTR) {
+                    // Peer gone, or the file shrank under us
+                    socket.close(ec);
+                    return;
+                }
+            }
+            ++piece_;
+            send_piece();
+        }
+
+        // With O_DIRECT, sendfile would block on the disk, and over TLS in
+        // user space the bytes have to pass through OpenSSL; instead aligned
+        // blocks are read through the ring and written to the stream
+        void read_file_range() {
+            Piece& piece = pieces_[piece_];
+            if (piece.length == 0) {
+                ++piece_;
+                send_piece();
+                return;
+            }
+            std::uint64_t first = piece.offset & ~std::uint64_t(DiskIo::kAlignment - 1);
+            std::size_t skip = static_cast<std::size_t>(piece.offset - first);
+            std::size_t largest = shaper_.slice(BandwidthShaper::Direction::download, DiskIo::kBufferSize)
+                                  & ~(DiskIo::kAlignment - 1);
+            std::size_t size = static_cast<std::size_t>(std::min<std::uint64_t>(
+                largest, (skip + piece.length + DiskIo::kAlignment - 1) & ~std::uint64_t(DiskIo::kAlignment - 1)));
+
+            auto self = this->shared_from_this();
+            disk_.read(stream_.get_executor(), download_fd_, {download_buffer_.get(), DiskIo::kUnregistered}, size, first,
+                [self, skip](beast::error_code ec, std::size_t read) {
+                    Piece& piece = self->pieces_[self->piece_];
+                    if (ec || read <= skip) {
+                        // The file shrank under us
+                        self->socket().close(ec);
+                        return;
+                    }
+                    std::size_t size = static_cast<std::size_t>(std::min<std::uint64_t>(read - skip, piece.length));
+                    net::async_write(self->stream_, net::buffer(self->download_buffer_.get() + skip, size),
+                        [self, size](beast::error_code ec, std::size_t) {
+                            if (ec) {
+                                return;
+                            }
+                            Piece& piece = self->pieces_[self->piece_];
+                            piece.offset += size;
+                            piece.length -= size;
+                            self->pace(BandwidthShaper::Direction::download, self->download_user_, size, [self] {
+                                self->read_file_range();
+                            });
+                        });
+                });
+        }
+
+        void send_error(unsigned version, http::status status, std::string const& message) {
+            response_type res{status, version};
+            set_error(res, status, message);
+            send(std::move(res), false);
+        }
+
+        // Responses of the file routes, which are rare next to the JSON
+        // API's and still go through Beast's serializer
+        void send(response_type&& res, bool keep_alive) {
+            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            res.set(http::field::content_type, "application/json");
+            auto date = CommonHeaders::date();
+            res.set(http::field::date, beast::string_view(date.data(), date.size()));
+            res.keep_alive(keep_alive);
             res.prepare_payload();
             write_response(std::move(res));
         }
 
+        void start_head(unsigned version, http::status status) {
+            auto reason = http::obsolete_reason(status);
+            response_head_.start(version, static_cast<unsigned>(status), {reason.data(), reason.size()});
+        }
+
+        void write_head_and(net::const_buffer body) {
+            std::array<net::const_buffer, 2> buffers{net::buffer(response_head_.view()), body};
+            auto self = this->shared_from_this();
+
+            net::async_write(stream_, buffers,
+                [self](beast::error_code ec, std::size_t) {
+                    self->socket().shutdown(tcp::socket::shutdown_send, ec);
+                });
+        }
+
+        void write_canned(Canned canned, bool keep_alive) {
+            // The canned responses are HTTP/1.1; HTTP/1.0 clients get the
+            // variant that closes the connection
+            start_head(11, JsonApi::canned(canned).status);
+            write_head_and(net::buffer(canned_tail(canned, keep_alive)));
+        }
+
+        // Writes reply_ the way Beast would serialize it for head_
+        void write_reply() {
+            start_head(head_.version, reply_.status);
+            if (reply_.etag) {
+                response_head_ << "ETag: \"" << *reply_.etag << "\"\r\n";
+            }
+            response_head_ << "Content-Length: " << reply_.body.size() << "\r\n";
+            if (head_.version == 11 && !head_.keep_alive) {
+                response_head_ << "Connection: close\r\n";
+            } else if (head_.version == 10 && head_.keep_alive) {
+                response_head_ << "Connection: keep-alive\r\n";
+            }
+            response_head_ << "\r\n";
+            write_head_and(net::buffer(reply_.body));
+        }
+
         void write_response(http::response<http::string_body>&& res) {
             auto sp = std::make_shared<http::response<http::string_body>>(std::move(res));
-            auto self = shared_from_this();
+            auto self = this->shared_from_this();
             
             http::async_write(stream_, *sp,
                 [self, sp](beast::error_code ec, std::size_t) {
-                    self->stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+                    self->socket().shutdown(tcp::socket::shutdown_send, ec);
                 });
         }
 
+        void on_header() {
+            auto const& head = header_parser_->get();
+            std::string_view target(head.target().data(), head.target().size());
+            http::verb method = head.method();
+            if (auto file = parse_file_target(target, "/files/")) {
+                if (method == http::verb::put) {
+                    begin_upload(*file);
+                    return;
+                }
+                if (method == http::verb::get) {
+                    begin_download(*file);
+                    return;
+                }
+            }
+            if (method == http::verb::post) {
+                if (auto file = parse_file_target(target, "/uploads/")) {
+                    create_upload(*file);
+                    return;
+                }
+            }
+            if (target.starts_with("/api/uploads/")) {
+                std::string_view token = target.substr(13);
+                if (method == http::verb::patch) {
+                    begin_chunk(token);
+                    return;
+                }
+                if (method == http::verb::head || method == http::verb::delete_) {
+                    upload_status(token, method);
+                    return;
+                }
+            }
+
+            // The header parser had no limit, so a declared length has not
+            // been checked yet; chunked bodies are checked as they arrive
+            if (auto length = header_parser_->content_length(); length && *length > kBodyLimit) {
+                send_error(head.version(), http::status::payload_too_large, "Request body too large");
+                return;
+            }
+            if (header_parser_->is_done()) {
+                if (upgrade_h2c()) {
+                    return;
+                }
+                req_ = header_parser_->release();
+                route_parsed();
+                return;
+            }
+            if (JsonApi::takes_json(method, target)) {
+                json_parser_.emplace();
+            }
+            body_parser_.emplace(std::move(*header_parser_));
+            body_parser_->body_limit(kBodyLimit);
+            read_chunk();
+        }
+
+        // A body the route takes no notice of is still read, and dropped,
+        // so that closing the connection does not reset it before the
+        // client has the response
+        void read_chunk() {
+            auto& body = body_parser_->get().body();
+            body.data = chunk_.data();
+            body.size = chunk_.size();
+            body.more = true;
+
+            auto self = this->shared_from_this();
+            http::async_read(stream_, buffer_, *body_parser_,
+                [self](beast::error_code ec, std::size_t) {
+                    self->on_chunk(ec);
+                });
+        }
+
+        void on_chunk(beast::error_code ec) {
+            if (ec == http::error::need_buffer) {
+                ec = {};
+            }
+            if (ec == http::error::body_limit) {
+                send_error(body_parser_->get().version(), http::status::payload_too_large, "Request body too large");
+                return;
+            }
+            if (ec) {
+                return;
+            }
+            std::size_t read = chunk_.size() - body_parser_->get().body().size;
+            if (json_parser_ && !json_error_) {
+                json_parser_->write(chunk_.data(), read, json_error_);
+            }
+            if (!body_parser_->is_done()) {
+                read_chunk();
+                return;
+            }
+
+            if (json_parser_ && !json_error_) {
+                json_parser_->finish(json_error_);
+                if (!json_error_) {
+                    body_ = json_parser_->release();
+                }
+            }
+            req_ = http::request<http::empty_body>(std::move(body_parser_->get().base()));
+            route_parsed();
+        }
+
+        // Fast path for the JSON API's requests without a body, which are
+        // most of them: the headers are parsed in place and routed without
+        // building a Beast message. False leaves buffer_ to Beast.
+        bool route_in_place() {
+            auto data = buffer_.data();
+            RequestHead parsed;
+            if (!parse_request_head({static_cast<char const*>(data.data()), data.size()}, parsed)) {
+                return false;
+            }
+            http::verb method = http::string_to_verb({parsed.method.data(), parsed.method.size()});
+            std::string_view target = parsed.target;
+            if ((method != http::verb::get && method != http::verb::delete_) || !target.starts_with("/api/users")
+                || is_file_route(target)) {
+                return false;
+            }
+            auto length = parsed.find("Content-Length");
+            if ((length && *length != "0") || parsed.find("Transfer-Encoding") || parsed.find("Upgrade")) {
+                return false;
+            }
+            // A single Connection token; Beast works out lists
+            bool keep_alive = parsed.version == 11;
+            if (auto connection = parsed.find("Connection")) {
+                if (beast::iequals({connection->data(), connection->size()}, "close")) {
+                    keep_alive = false;
+                } else if (beast::iequals({connection->data(), connection->size()}, "keep-alive")) {
+                    keep_alive = true;
+                } else {
+                    return false;
+                }
+            }
+
+            head_.set(method, target, parsed.version, keep_alive, parsed.find("If-Match"));
+            route_request();
+            buffer_.consume(parsed.size);
+            return true;
+        }
+
+        // "Upgrade: h2c" on a JSON API request without a body hands the
+        // connection to an Http2Session, which answers it as stream 1. TLS
+        // connections negotiate HTTP/2 with ALPN instead.
+        bool upgrade_h2c() {
+            auto const& head = header_parser_->get();
+            auto settings_field = head.find("HTTP2-Settings");
+            std::string_view target(head.target().data(), head.target().size());
+            if (kTls || head.version() != 11 || settings_field == head.end() || is_file_route(target)) {
+                return false;
+            }
+            bool h2c = false;
+            for (auto const& token : http::token_list(head[http::field::upgrade])) {
+                h2c = h2c || beast::iequals(token, "h2c");
+            }
+            std::optional<std::string> settings = http2_settings_payload(
+                {settings_field->value().data(), settings_field->value().size()});
+            if (!h2c || !settings) {
+                return false;
+            }
+
+            std::optional<std::string_view> if_match;
+            if (auto it = head.find(http::field::if_match); it != head.end()) {
+                if_match = std::string_view(it->value().data(), it->value().size());
+            }
+            std::make_shared<Http2Session<Stream>>(std::move(stream_), std::move(buffer_), users_, home_, cores_, pool_)
+                ->start_upgraded({head.method_string().data(), head.method_string().size()}, target, if_match,
+                                 *settings);
+            return true;
+        }
+
+        // The first bytes tell HTTP/2 with prior knowledge, whose preface
+        // no HTTP/1.1 request starts with, from HTTP/1.1. Small requests
+        // arrive in one segment; whatever the fast path cannot take is
+        // parsed by Beast from the same buffer.
         void read_request() {
-            auto self = shared_from_this();
-            
-            http::async_read(stream_, buffer_, req_,
+            auto self = this->shared_from_this();
+            stream_.async_read_some(buffer_.prepare(4096),
+                [self](beast::error_code ec, std::size_t size) {
+                    if (ec) {
+                        return;
+                    }
+                    self->buffer_.commit(size);
+                    self->on_first_read();
+                });
+        }
+
+        void on_first_read() {
+            auto data = buffer_.data();
+            std::string_view received(static_cast<char const*>(data.data()), data.size());
+            std::string_view preface = kHttp2Preface;
+            if (preface.starts_with(received.substr(0, preface.size()))) {
+                if (received.size() < preface.size()) {
+                    read_request();
+                    return;
+                }
+                std::make_shared<Http2Session<Stream>>(std::move(stream_), std::move(buffer_), users_, home_, cores_, pool_)->start();
+                return;
+            }
+            if (fast_parse_ && route_in_place()) {
+                return;
+            }
+            read_header();
+        }
+
+        void read_header() {
+            auto self = this->shared_from_this();
+
+            // Checked against Content-Length as soon as the headers are in,
+            // so the limit is set per route in on_header
+            header_parser_.emplace();
+            header_parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+            http::async_read_header(stream_, buffer_, *header_parser_,
                 [self](beast::error_code ec, std::size_t) {
                     if (!ec) {
-                        self->route_request();
+                        self->on_header();
                     }
                 });
         }
 
     public:
-        Session(tcp::socket&& socket)
-            : stream_(std::move(socket)) {}
+        Session(Stream&& stream, UserPartitions& users, unsigned home, FileStore& files, UploadRegistry& uploads,
+                ObjectBackend* backend, DiskIo& disk, BandwidthShaper& shaper, bool fast_parse, CoreSet* cores,
+                CpuPool* pool)
+            : stream_(std::move(stream)), users_(users), home_(home), api_(users, home, pool), files_(files),
+              uploads_(uploads), backend_(backend), disk_(disk), shaper_(shaper), pace_timer_(stream_.get_executor()),
+              fast_parse_(fast_parse), cores_(cores), pool_(pool) {}
+
+        ~Session() {
+            if (download_fd_ >= 0) {
+                ::close(download_fd_);
+            }
+            abort_upload();
+        }
 
         void start() {
-            read_request();
+            if constexpr (kTls) {
+                // A client that stalls the handshake is dropped
+                auto self = this->shared_from_this();
+                beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+                stream_.async_handshake([self](beast::error_code ec) {
+                    if (ec) {
+                        return;
+                    }
+                    beast::get_lowest_layer(self->stream_).expires_never();
+                    self->read_request();
+                });
+            } else {
+                read_request();
+            }
         }
 };
 
 // Simple HTTP Server
 class RestApiServer {
     private:
+        unsigned threads_;
+        FileStore files_;
+        UploadRegistry uploads_;
         net::io_context ioc_;
-        tcp::acceptor acceptor_;
+        std::unique_ptr<ObjectBackend> backend_;
+        std::unique_ptr<DiskIo> disk_;
+        BandwidthShaper shaper_;
+        bool fast_parse_;
+        net::steady_timer date_timer_;
+        std::unique_ptr<TlsContext> tls_;
+        std::unique_ptr<CoreSet> cores_;  // With thread-per-core
+        UserPartitions users_;           // One per core with thread-per-core
+        std::unique_ptr<CpuPool> pool_;  // Unless cpu_threads is 0
+        std::atomic<unsigned> next_home_{0};  // Home partition of the next session off the cores
 
-        void accept_connection() {
-            acceptor_.async_accept(
-                [this](beast::error_code ec, tcp::socket socket) {
-                    if (!ec) {
-                        std::make_shared<Session>(std::move(socket))->start();
+        // A listening socket, and the core its sessions run on: kNone for
+        // strands of ioc_
+        struct Listener {
+            tcp::acceptor acceptor;
+            bool tls;
+            unsigned core;
+        };
+        std::vector<std::unique_ptr<Listener>> listeners_;
+
+        // Moves the Date of responses on once a second
+        void tick_date() {
+            CommonHeaders::tick();
+            date_timer_.expires_after(std::chrono::seconds(1));
+            date_timer_.async_wait([this](beast::error_code ec) {
+                if (!ec) {
+                    tick_date();
+                }
+            });
+        }
+
+        // A core's sessions create users in its partition; sessions off the
+        // cores take the partitions in turn
+        template <class Stream>
+        void start_session(Stream&& stream, unsigned core) {
+            unsigned home = core == CoreSet::kNone ? next_home_.fetch_add(1, std::memory_order_relaxed) : core;
+            std::make_shared<Session<Stream>>(std::move(stream), users_, home, files_, uploads_, backend_.get(), *disk_,
+                                              shaper_, fast_parse_, cores_.get(), pool_.get())
+                ->start();
+        }
+
+        void listen(net::io_context& ioc, unsigned short port, bool tls, unsigned core) {
+            tcp::endpoint endpoint(tcp::v4(), port);
+            auto listener = std::make_unique<Listener>(Listener{tcp::acceptor(ioc), tls, core});
+            listener->acceptor.open(endpoint.protocol());
+            listener->acceptor.set_option(net::socket_base::reuse_address(true));
+            if (cores_) {
+                // Every core listens on the port and the kernel spreads the
+                // connections between them
+                listener->acceptor.set_option(net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+            }
+            listener->acceptor.bind(endpoint);
+            listener->acceptor.listen();
+            listeners_.push_back(std::move(listener));
+        }
+
+        void accept_connection(Listener& listener) {
+            // Each session gets a strand: an upload reads the socket while
+            // its previous buffer is still being written. A core's sessions
+            // all run on its one thread.
+            net::any_io_executor executor = listener.core == CoreSet::kNone
+                                                ? net::any_io_executor(net::make_strand(ioc_))
+                                                : net::any_io_executor(cores_->context(listener.core).get_executor());
+            listener.acceptor.async_accept(executor,
+                [this, &listener](beast::error_code ec, tcp::socket socket) {
+                    if (!ec && listener.tls) {
+                        start_session(TlsStream(std::move(socket), *tls_), listener.core);
+                    } else if (!ec) {
+                        start_session(beast::tcp_stream(std::move(socket)), listener.core);
                     }
-                    accept_connection();
+                    accept_connection(listener);
                 });
         }
 
     public:
-        RestApiServer(unsigned short port)
-            : acceptor_(ioc_, tcp::endpoint(tcp::v4(), port)) {}
+        // The acceptor is only opened once the store has recovered (or, with
+        // early reads, loaded its compacted segments). File contents are
+        // also stored in S3 if s3 is set, or else in backend_dir if set.
+        // fast_parse routes simple requests with request_head.hpp's parser.
+        // With tls, HTTPS is served on its port besides HTTP on port. With
+        // thread_per_core, each of threads cores accepts and runs its own
+        // connections and keeps a partition of the users, which it serves
+        // for all of them. With write_pipeline, one thread per partition
+        // applies its writes in batches.
+        // List rebuilds run on cpu_threads threads of their own, if any.
+        RestApiServer(unsigned short port, unsigned threads, StoreOptions const& options,
+                      CompactorOptions const& compaction, DiskIoOptions const& disk, ShapingOptions const& shaping,
+                      std::uint64_t user_quota, std::optional<S3Options> const& s3,
+                      std::filesystem::path const& backend_dir, bool fast_parse, std::optional<TlsOptions> const& tls,
+                      bool thread_per_core, bool write_pipeline, unsigned cpu_threads)
+            : threads_(std::max(1u, threads)),
+              files_(options.data_dir, user_quota),
+              uploads_(files_),
+              ioc_(static_cast<int>(threads_)),
+              shaper_(shaping),
+              fast_parse_(fast_parse),
+              date_timer_(ioc_),
+              users_(options, compaction, thread_per_core ? threads_ : 1, write_pipeline) {
+            disk_ = std::make_unique<DiskIo>(ioc_, disk);
+            if (s3) {
+                backend_ = std::make_unique<S3Backend>(ioc_, *s3);
+            } else if (!backend_dir.empty()) {
+                backend_ = std::make_unique<LocalBackend>(ioc_, backend_dir);
+            }
+            if (tls) {
+                tls_ = std::make_unique<TlsContext>(*tls);
+            }
+            if (thread_per_core) {
+                cores_ = std::make_unique<CoreSet>(threads_);
+            }
+            if (cpu_threads > 0) {
+                pool_ = std::make_unique<CpuPool>(cpu_threads);
+            }
+            for (unsigned core = 0; core < (cores_ ? cores_->size() : 1); ++core) {
+                net::io_context& ioc = cores_ ? cores_->context(core) : ioc_;
+                unsigned owner = cores_ ? core : CoreSet::kNone;
+                listen(ioc, port, false, owner);
+                if (tls) {
+                    listen(ioc, tls->port, true, owner);
+                }
+            }
+        }
 
         void run() {
             std::cout << "REST API running on http://localhost:" 
-                    << acceptor_.local_endpoint().port() << std::endl;
+                    << listeners_.front()->acceptor.local_endpoint().port() << std::endl;
+            if (tls_) {
+                std::cout << "REST API running on https://localhost:" << listeners_[1]->acceptor.local_endpoint().port()
+                          << (tls_->kernel() ? " (kTLS when available)" : "") << std::endl;
+            }
+            if (cores_) {
+                std::cout << "Thread per core: " << cores_->size() << " cores, user partitions: "
+                          << users_.size() << std::endl;
+            }
+            if (users_.writes(0)) {
+                std::cout << "Writes batched on one writer thread per partition" << std::endl;
+            }
             std::cout << "\nEndpoints:" << std::endl;
             std::cout << "  GET    /api/users     - List all users" << std::endl;
             std::cout << "  GET    /api/users/:id - Get user by ID" << std::endl;
             std::cout << "  POST   /api/users     - Create new user" << std::endl;
+            std::cout << "  PUT    /api/users/:id - Replace user" << std::endl;
+            std::cout << "  PATCH  /api/users/:id - Merge-patch user (RFC 7396)" << std::endl;
+            std::cout << "  DELETE /api/users/:id - Delete user" << std::endl;
+            std::cout << "  PUT    /api/users/:id/files/:name - Upload file" << std::endl;
+            std::cout << "  GET    /api/users/:id/files/:name - Download file (Range supported)" << std::endl;
+            std::cout << "  POST   /api/users/:id/uploads/:name - Start resumable upload" << std::endl;
+            std::cout << "  PATCH  /api/uploads/:token - Upload chunk at Upload-Offset" << std::endl;
+            std::cout << "  HEAD   /api/uploads/:token - Query upload offset" << std::endl;
+            std::cout << "  DELETE /api/uploads/:token - Cancel upload" << std::endl;
             
-            accept_connection();
+            for (auto& listener : listeners_) {
+                accept_connection(*listener);
+            }
+            tick_date();
+
+            // Sessions run on the cores, and ioc_ on this thread keeps disk
+            // I/O, the object backend and the clock
+            if (cores_) {
+                cores_->start();
+                ioc_.run();
+                cores_->join();
+                return;
+            }
+
+            // Sessions run on their own strands
+            std::vector<std::thread> workers;
+            workers.reserve(threads_ - 1);
+            for (unsigned i = 1; i < threads_; ++i) {
+                workers.emplace_back([this] { ioc_.run(); });
+            }
             ioc_.run();
+            for (auto& worker : workers) {
+                worker.join();
+            }
         }
 };
 
 int main() {
     try {
-        RestApiServer server(8080);
+        StoreOptions options;
+        if (char const* dir = std::getenv("USER_STORE_DIR")) {
+            options.data_dir = dir;
+        }
+        if (char const* budget = std::getenv("USER_STORE_MEMORY_BUDGET")) {
+            options.memory_budget = std::stoull(budget);
+        }
+        if (char const* early = std::getenv("USER_STORE_EARLY_READS")) {
+            options.early_reads = std::string_view(early) == "1";
+        }
+
+        CompactorOptions compaction;
+        if (char const* rate = std::getenv("USER_STORE_COMPACTION_RATE")) {
+            compaction.rate = std::stoull(rate);
+        }
+
+        DiskIoOptions disk;
+        if (char const* direct = std::getenv("USER_STORE_DIRECT_IO")) {
+            disk.direct = std::string_view(direct) == "1";
+        }
+        if (char const* buffers = std::getenv("USER_STORE_IO_BUFFERS")) {
+            disk.buffers = static_cast<unsigned>(std::stoul(buffers));
+        }
+
+        // File transfer rates in bytes per second, and bytes of files per user
+        ShapingOptions shaping;
+        auto rate = [](char const* name, std::uint64_t& value) {
+            if (char const* set = std::getenv(name)) {
+                value = std::stoull(set);
+            }
+        };
+        rate("USER_STORE_UPLOAD_RATE", shaping.upload_rate);
+        rate("USER_STORE_DOWNLOAD_RATE", shaping.download_rate);
+        rate("USER_STORE_USER_UPLOAD_RATE", shaping.user_upload_rate);
+        rate("USER_STORE_USER_DOWNLOAD_RATE", shaping.user_download_rate);
+        std::uint64_t user_quota = 0;
+        rate("USER_STORE_USER_QUOTA", user_quota);
+
+        // Object backend: an S3-compatible endpoint (host[:port]) or a directory
+        std::optional<S3Options> s3;
+        if (char const* endpoint = std::getenv("USER_STORE_S3_ENDPOINT")) {
+            s3.emplace();
+            std::string_view host(endpoint);
+            if (std::size_t colon = host.rfind(':'); colon != std::string_view::npos) {
+                s3->port = host.substr(colon + 1);
+                host = host.substr(0, colon);
+            }
+            s3->host = host;
+            auto env = [](char const* name, std::string& value) {
+                if (char const* set = std::getenv(name)) {
+                    value = set;
+                }
+            };
+            env("USER_STORE_S3_BUCKET", s3->bucket);
+            env("AWS_REGION", s3->region);
+            env("AWS_ACCESS_KEY_ID", s3->access_key);
+            env("AWS_SECRET_ACCESS_KEY", s3->secret_key);
+            env("AWS_SESSION_TOKEN", s3->session_token);
+            if (char const* part = std::getenv("USER_STORE_S3_PART_SIZE")) {
+                s3->part_size = std::stoull(part);
+            }
+            if (char const* parts = std::getenv("USER_STORE_S3_PARTS_IN_FLIGHT")) {
+                s3->parts_in_flight = static_cast<unsigned>(std::stoul(parts));
+            }
+        }
+        std::filesystem::path backend_dir;
+        if (char const* dir = std::getenv("USER_STORE_BACKEND_DIR")) {
+            backend_dir = dir;
+        }
+
+        bool fast_parse = false;
+        if (char const* fast = std::getenv("USER_STORE_FAST_PARSE")) {
+            fast_parse = std::string_view(fast) == "1";
+        }
+
+        // HTTPS besides HTTP when given a certificate and key
+        std::optional<TlsOptions> tls;
+        char const* cert = std::getenv("USER_STORE_TLS_CERT");
+        char const* key = std::getenv("USER_STORE_TLS_KEY");
+        if (cert && key) {
+            tls.emplace();
+            tls->cert_file = cert;
+            tls->key_file = key;
+            if (char const* port = std::getenv("USER_STORE_TLS_PORT")) {
+                tls->port = static_cast<unsigned short>(std::stoul(port));
+            }
+            if (char const* kernel = std::getenv("USER_STORE_KTLS")) {
+                tls->kernel = std::string_view(kernel) == "1";
+            }
+        }
+
+        bool thread_per_core = false;
+        if (char const* per_core = std::getenv("USER_STORE_THREAD_PER_CORE")) {
+            thread_per_core = std::string_view(per_core) == "1";
+        }
+
+        bool write_pipeline = false;
+        if (char const* pipeline = std::getenv("USER_STORE_WRITE_PIPELINE")) {
+            write_pipeline = std::string_view(pipeline) == "1";
+        }
+
+        // Threads for CPU-heavy work off the connections' threads; 0 keeps it inline
+        unsigned cpu_threads = std::thread::hardware_concurrency();
+        if (char const* threads = std::getenv("USER_STORE_CPU_THREADS")) {
+            cpu_threads = static_cast<unsigned>(std::stoul(threads));
+        }
+
+        RestApiServer server(8080, std::thread::hardware_concurrency(), options, compaction, disk, shaping, user_quota, s3,
+                             backend_dir, fast_parse, tls, thread_per_core, write_pipeline, cpu_threads);
         server.run();
     } catch (std::exception const& e) {
         std::cerr << "Error: " << e.what() << std::endl;
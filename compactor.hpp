@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "bandwidth.hpp"
+#include "epoch.hpp"
+#include "segment_log.hpp"
+#include "user_store.hpp"
+
+struct CompactorOptions {
+    // Compact sealed segments whose live bytes fall below this share
+    double live_threshold = 0.5;
+
+    // Bytes per second the compactor may read plus write
+    std::size_t rate = std::size_t(32) << 20;
+
+    std::chrono::milliseconds interval{5000};
+};
+
+// Background compaction of the user store's segment log, on its own thread
+// so the io_context threads never pay for it.
+//
+// Each pass picks the sealed segments that are mostly superseded records
+// and have no append still in flight, copies the records that still back a
+// reachable version into new snap segments, publishes those with an atomic
+// rename, repoints the versions at the copies and, once no reader can still
+// hold an old location, deletes the old segments. All I/O is paced by a
+// TokenBucket so compaction cannot starve foreground requests of disk
+// bandwidth.
+class Compactor {
+    private:
+        struct Move {
+            std::uint64_t id;
+            LogLocation from;
+            LogLocation to;
+        };
+
+        UserStore& store_;
+        SegmentLog& log_;
+        CompactorOptions options_;
+        TokenBucket limiter_;
+
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        bool stopping_ = false;
+        std::thread thread_;
+
+        // Publishes output and points every moved version at its copy
+        void finish(std::unique_ptr<SegmentLog::Output>& output, std::vector<Move>& moves) {
+            if (!output) {
+                return;
+            }
+            log_.commit(*output);
+            for (Move const& move : moves) {
+                if (!store_.relocate(move.id, move.from, move.to)) {
+                    log_.release(move.to);
+                }
+            }
+            output.reset();
+            moves.clear();
+        }
+
+        void compact(std::vector<std::uint32_t> const& victims) {
+            std::unique_ptr<SegmentLog::Output> output;
+            std::vector<Move> moves;
+
+            for (std::uint32_t victim : victims) {
+                log_.scan(victim, [&](LogRecordHeader const& header, std::string_view body, LogLocation location) {
+                    std::uint32_t size = SegmentLog::record_size(body.size());
+                    std::this_thread::sleep_for(limiter_.take(size));
+                    if (!store_.is_live(header.id, location)) {
+                        return;
+                    }
+
+                    std::this_thread::sleep_for(limiter_.take(size));
+                    if (!output) {
+                        output = log_.begin_output();
+                    }
+                    LogLocation to = log_.write(*output, header, body);
+                    if (!to) {
+                        finish(output, moves);
+                        output = log_.begin_output();
+                        to = log_.write(*output, header, body);
+                    }
+                    moves.push_back({header.id, location, to});
+                });
+            }
+            finish(output, moves);
+
+            // Readers that loaded a location in a victim before the moves
+            // must be done before its mapping goes away
+            Epoch::barrier();
+            for (std::uint32_t victim : victims) {
+                log_.drop(victim);
+            }
+        }
+
+        void pass() {
+            // Records of segments not yet replayed would look dead
+            if (!store_.ready()) {
+                return;
+            }
+            std::vector<std::uint32_t> victims;
+            for (SegmentLog::SegmentStats const& segment : log_.sealed_segments()) {
+                // An append still in flight could be copied before its
+                // location is stored, or leave a hole that ends the scan
+                if (!segment.settled) {
+                    continue;
+                }
+                if (segment.used > 0 && segment.live < options_.live_threshold * static_cast<double>(segment.used)) {
+                    victims.push_back(segment.number);
+                }
+            }
+            if (!victims.empty()) {
+                compact(victims);
+            }
+        }
+
+        void run() {
+            std::unique_lock lock(mutex_);
+            while (!wake_.wait_for(lock, options_.interval, [this] { return stopping_; })) {
+                lock.unlock();
+                try {
+                    pass();
+                } catch (std::exception const& e) {
+                    std::cerr << "Compaction failed: " << e.what() << std::endl;
+                }
+                Epoch::collect();
+                lock.lock();
+            }
+        }
+
+    public:
+        Compactor(UserStore& store, CompactorOptions const& options)
+            : store_(store), log_(store.log()), options_(options), limiter_(options.rate),
+              thread_([this] { run(); }) {}
+
+        ~Compactor() {
+            {
+                std::lock_guard lock(mutex_);
+                stopping_ = true;
+            }
+            wake_.notify_one();
+            thread_.join();
+        }
+
+        Compactor(Compactor const&) = delete;
+        Compactor& operator=(Compactor const&) = delete;
+};
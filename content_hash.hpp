@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <openssl/evp.h>
+
+using Digest = std::array<unsigned char, 32>;
+
+// Incremental SHA-256. OpenSSL picks the fastest code path the CPU has
+// (SHA-NI, AVX2 or SSSE3) at runtime. A cryptographic hash is needed here
+// because content addresses are trusted to identify file contents.
+class Sha256 {
+    private:
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx_{EVP_MD_CTX_new(), &EVP_MD_CTX_free};
+
+    public:
+        Sha256() {
+            if (!ctx_ || EVP_DigestInit_ex(ctx_.get(), EVP_sha256(), nullptr) != 1) {
+                throw std::runtime_error("SHA-256 unavailable");
+            }
+        }
+
+        void update(void const* data, std::size_t size) {
+            EVP_DigestUpdate(ctx_.get(), data, size);
+        }
+
+        Digest finish() {
+            Digest digest;
+            unsigned size = 0;
+            EVP_DigestFinal_ex(ctx_.get(), digest.data(), &size);
+            return digest;
+        }
+};
+
+inline std::string to_hex(Digest const& digest) {
+    static constexpr char kHex[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(digest.size() * 2);
+    for (unsigned char byte : digest) {
+        hex += kHex[byte >> 4];
+        hex += kHex[byte & 15];
+    }
+    return hex;
+}
+
+// The sha-256 member of a Content-Digest header (RFC 9530), a dictionary
+// such as "sha-512=:<base64>:, sha-256=:<base64>:"; nullopt if there is
+// none or it is malformed. Members are compared by key, the last of a
+// repeated key wins as in RFC 8941, and parameters are ignored.
+inline std::optional<Digest> parse_content_digest(std::string_view header) {
+    std::optional<std::string_view> value;
+    while (!header.empty()) {
+        // Byte sequences are base64, which has no commas
+        std::size_t comma = header.find(',');
+        std::string_view member = header.substr(0, comma);
+        header.remove_prefix(comma == std::string_view::npos ? header.size() : comma + 1);
+
+        std::size_t first = member.find_first_not_of(" \t");
+        std::size_t last = member.find_last_not_of(" \t");
+        member = first == std::string_view::npos ? std::string_view() : member.substr(first, last - first + 1);
+        std::size_t equals = member.find('=');
+        if (equals != std::string_view::npos && member.substr(0, equals) == "sha-256") {
+            std::string_view item = member.substr(equals + 1);
+            value = item.substr(0, item.find(';'));
+        }
+    }
+
+    // 44 base64 characters between colons decode to 33 bytes, the last
+    // being padding
+    if (!value || value->size() != 46 || value->front() != ':' || value->back() != ':') {
+        return std::nullopt;
+    }
+    unsigned char decoded[33];
+    std::string encoded(value->substr(1, 44));
+    if (EVP_DecodeBlock(decoded, reinterpret_cast<unsigned char const*>(encoded.data()), 44) != 33
+        || encoded[43] != '=' || encoded[42] == '=') {
+        return std::nullopt;
+    }
+    Digest digest;
+    std::copy(decoded, decoded + 32, digest.begin());
+    return digest;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Threads for CPU-heavy work that would otherwise hold up every other
+// connection on an io_context thread. Each worker has its own deque: it
+// runs its own tasks newest first and, once it has none, steals the
+// oldest task of another worker. Tasks posted from outside the pool are
+// dealt to the workers in turn.
+class CpuPool {
+    public:
+        using Task = std::function<void()>;
+
+    private:
+        struct Worker {
+            CpuPool* pool;
+            std::mutex mutex;
+            std::deque<Task> tasks;
+            std::thread thread;
+        };
+
+        std::vector<std::unique_ptr<Worker>> workers_;
+        std::atomic<std::size_t> next_{0};    // Worker the next outside task goes to
+        std::atomic<std::size_t> queued_{0};  // Tasks in all the deques, changed with them
+        std::mutex sleep_mutex_;
+        std::condition_variable wake_;
+        bool stop_ = false;
+        static inline thread_local Worker* current_ = nullptr;
+
+        bool take(std::size_t index, Task& task) {
+            Worker& own = *workers_[index];
+            {
+                std::lock_guard lock(own.mutex);
+                if (!own.tasks.empty()) {
+                    task = std::move(own.tasks.back());
+                    own.tasks.pop_back();
+                    queued_.fetch_sub(1);
+                    return true;
+                }
+            }
+            for (std::size_t i = 1; i < workers_.size(); ++i) {
+                Worker& victim = *workers_[(index + i) % workers_.size()];
+                std::lock_guard lock(victim.mutex);
+                if (!victim.tasks.empty()) {
+                    task = std::move(victim.tasks.front());
+                    victim.tasks.pop_front();
+                    queued_.fetch_sub(1);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void run(std::size_t index) {
+            current_ = workers_[index].get();
+            Task task;
+            for (;;) {
+                if (take(index, task)) {
+                    task();
+                    task = nullptr;
+                    continue;
+                }
+                std::unique_lock lock(sleep_mutex_);
+                wake_.wait(lock, [this] {
+                    return stop_ || queued_.load() > 0;
+                });
+                if (stop_) {
+                    return;
+                }
+            }
+        }
+
+    public:
+        explicit CpuPool(unsigned threads) {
+            for (unsigned i = 0; i < std::max(1u, threads); ++i) {
+                workers_.push_back(std::make_unique<Worker>());
+                workers_.back()->pool = this;
+            }
+            for (std::size_t i = 0; i < workers_.size(); ++i) {
+                workers_[i]->thread = std::thread([this, i] {
+                    run(i);
+                });
+            }
+        }
+
+        ~CpuPool() {
+            {
+                std::lock_guard lock(sleep_mutex_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+            for (auto& worker : workers_) {
+                worker->thread.join();
+            }
+        }
+
+        CpuPool(CpuPool const&) = delete;
+        CpuPool& operator=(CpuPool const&) = delete;
+
+        // Runs task on a worker; a task posted by a worker goes to its own
+        // deque, where other workers can steal it
+        void post(Task task) {
+            Worker* worker = current_;
+            if (!worker || worker->pool != this) {
+                worker = workers_[next_.fetch_add(1, std::memory_order_relaxed) % workers_.size()].get();
+            }
+            // Counted under the deque's lock, so queued_ is never above
+            // what a worker can take, nor below zero
+            {
+                std::lock_guard lock(worker->mutex);
+                worker->tasks.push_back(std::move(task));
+                queued_.fetch_add(1);
+            }
+            {
+                std::lock_guard lock(sleep_mutex_);
+            }
+            wake_.notify_one();
+        }
+};
@@ -0,0 +1,505 @@
+#pragma once
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/system/error_code.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+struct DiskIoOptions {
+    // Pool buffers of DiskIo::kBufferSize; each upload in progress uses two
+    unsigned buffers = 32;
+
+    // Write uploads and read downloads with O_DIRECT, bypassing the page cache
+    bool direct = false;
+};
+
+// Asynchronous file I/O for the upload and download paths, on an io_uring
+// set up with raw syscalls. Completions are signalled on an eventfd that
+// the io_context watches, and handlers run on the executor given with each
+// operation, so disk I/O never blocks an io_context thread.
+//
+// Uploads are staged in a fixed pool of page-aligned buffers registered
+// with the ring, so writes skip pinning the pages on every call and can
+// use O_DIRECT, which needs aligned buffers, offsets and lengths. Where
+// io_uring is unavailable (old kernel, seccomp), the same operations run
+// as blocking calls on a small thread pool. File system calls the ring is
+// not used for, such as links, renames and directory syncs, go to threads
+// of their own through offload.
+class DiskIo {
+    public:
+        static constexpr std::size_t kBufferSize = 1024 * 1024;
+        static constexpr std::size_t kAlignment = 4096;
+        static constexpr unsigned kUnregistered = ~0u;
+
+        using Handler = std::function<void(boost::system::error_code, std::size_t)>;
+
+        // kBufferSize bytes aligned to kAlignment. Buffers from the pool
+        // carry their registration index; others are kUnregistered.
+        struct Buffer {
+            char* data = nullptr;
+            unsigned index = kUnregistered;
+        };
+
+    private:
+        struct Op {
+            boost::asio::any_io_executor executor;
+            Handler handler;
+            std::uint8_t opcode;
+            int fd;
+            Buffer buffer;
+            std::size_t size;
+            std::uint64_t offset;
+            std::size_t done = 0;
+        };
+
+        boost::asio::io_context& ioc_;
+        bool direct_;
+
+        char* memory_ = nullptr;
+        std::mutex pool_mutex_;
+        std::vector<unsigned> free_;
+        std::deque<std::pair<boost::asio::any_io_executor, std::function<void(Buffer)>>> waiters_;
+
+        int ring_ = -1;
+        bool registered_ = false;
+        void* sq_ring_ = MAP_FAILED;
+        void* cq_ring_ = MAP_FAILED;
+        std::size_t sq_ring_size_ = 0;
+        std::size_t cq_ring_size_ = 0;
+        io_uring_sqe* sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+        std::size_t sqes_size_ = 0;
+        unsigned* sq_head_ = nullptr;
+        unsigned* sq_tail_ = nullptr;
+        unsigned sq_mask_ = 0;
+        unsigned sq_entries_ = 0;
+        unsigned* sq_flags_ = nullptr;
+        unsigned* sq_array_ = nullptr;
+        unsigned* cq_head_ = nullptr;
+        unsigned* cq_tail_ = nullptr;
+        unsigned cq_mask_ = 0;
+        io_uring_cqe* cqes_ = nullptr;
+        std::mutex submit_mutex_;
+        std::deque<Op*> backlog_;  // Waiting for room in the submission queue
+        boost::asio::steady_timer retry_;
+        bool retrying_ = false;
+        int event_fd_ = -1;
+        std::optional<boost::asio::posix::stream_descriptor> events_;
+        std::uint64_t event_count_ = 0;
+
+        // Used instead of the ring where it could not be set up
+        std::optional<boost::asio::thread_pool> fallback_;
+
+        boost::asio::thread_pool blocking_{2};  // For offload
+
+        static void* ring_map(int ring, std::size_t size, off_t offset) {
+            return ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, offset);
+        }
+
+        bool setup_ring(unsigned entries, unsigned buffers) {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            ring_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+            if (ring_ < 0) {
+                return false;
+            }
+
+            sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single) {
+                sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+            }
+            sq_ring_ = ring_map(ring_, sq_ring_size_, IORING_OFF_SQ_RING);
+            cq_ring_ = single ? sq_ring_ : ring_map(ring_, cq_ring_size_, IORING_OFF_CQ_RING);
+            sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+            sqes_ = static_cast<io_uring_sqe*>(ring_map(ring_, sqes_size_, IORING_OFF_SQES));
+            if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+                return false;
+            }
+
+            auto* sq = static_cast<char*>(sq_ring_);
+            sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+            sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+            sq_entries_ = params.sq_entries;
+            sq_flags_ = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+            sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+            auto* cq = static_cast<char*>(cq_ring_);
+            cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+            event_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (event_fd_ < 0
+                || ::syscall(__NR_io_uring_register, ring_, IORING_REGISTER_EVENTFD, &event_fd_, 1) != 0) {
+                return false;
+            }
+
+            // Registration counts against RLIMIT_MEMLOCK; without it the
+            // ring still works, pinning pages per operation
+            std::vector<iovec> vectors(buffers);
+            for (unsigned i = 0; i < buffers; ++i) {
+                vectors[i] = {memory_ + i * kBufferSize, kBufferSize};
+            }
+            registered_ = ::syscall(__NR_io_uring_register, ring_, IORING_REGISTER_BUFFERS, vectors.data(), buffers) == 0;
+            return true;
+        }
+
+        void teardown_ring() {
+            if (sqes_ != MAP_FAILED) {
+                ::munmap(sqes_, sqes_size_);
+            }
+            if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+                ::munmap(cq_ring_, cq_ring_size_);
+            }
+            if (sq_ring_ != MAP_FAILED) {
+                ::munmap(sq_ring_, sq_ring_size_);
+            }
+            if (ring_ >= 0) {
+                ::close(ring_);
+            }
+            ring_ = -1;
+        }
+
+        void submit(Op* op) {
+            std::lock_guard lock(submit_mutex_);
+            backlog_.push_back(op);
+            flush();
+        }
+
+        // Moves the backlog into free submission queue slots and enters
+        // them, until it is empty or the kernel refuses. When the kernel is
+        // busy (completion queue full) or short of memory, what is queued
+        // stays put and is entered again after the next reap or a short
+        // pause; any other error fails every queued op. Called with
+        // submit_mutex_ held.
+        void flush() {
+            for (;;) {
+                unsigned head = std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire);
+                unsigned tail = *sq_tail_;
+                for (; !backlog_.empty() && tail - head < sq_entries_; ++tail) {
+                    prepare(backlog_.front(), tail & sq_mask_);
+                    backlog_.pop_front();
+                }
+                std::atomic_ref<unsigned>(*sq_tail_).store(tail, std::memory_order_release);
+                if (tail == head) {
+                    return;
+                }
+
+                long entered;
+                while ((entered = ::syscall(__NR_io_uring_enter, ring_, tail - head, 0, 0, nullptr, 0)) < 0
+                       && errno == EINTR) {
+                }
+                if (entered == 0 || (entered < 0 && (errno == EBUSY || errno == EAGAIN))) {
+                    retry_later();
+                    return;
+                }
+                if (entered < 0) {
+                    // The kernel took none of the queued entries, so they
+                    // are still ours to take back
+                    int error = errno;
+                    for (unsigned i = head; i != tail; ++i) {
+                        complete(reinterpret_cast<Op*>(sqes_[i & sq_mask_].user_data), -error);
+                    }
+                    std::atomic_ref<unsigned>(*sq_tail_).store(head, std::memory_order_release);
+                    for (Op* op : std::exchange(backlog_, {})) {
+                        complete(op, -error);
+                    }
+                    return;
+                }
+                if (backlog_.empty()) {
+                    return;
+                }
+            }
+        }
+
+        void prepare(Op* op, unsigned index) {
+            io_uring_sqe& sqe = sqes_[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = op->opcode;
+            sqe.fd = op->fd;
+            sqe.user_data = reinterpret_cast<std::uint64_t>(op);
+            if (op->opcode == IORING_OP_FSYNC) {
+                sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+            } else {
+                sqe.addr = reinterpret_cast<std::uint64_t>(op->buffer.data + op->done);
+                sqe.len = static_cast<unsigned>(op->size - op->done);
+                sqe.off = op->offset + op->done;
+                sqe.buf_index = static_cast<std::uint16_t>(op->buffer.index == kUnregistered ? 0 : op->buffer.index);
+            }
+            sq_array_[index] = index;
+        }
+
+        // Called with submit_mutex_ held
+        void retry_later() {
+            if (retrying_) {
+                return;
+            }
+            retrying_ = true;
+            retry_.expires_after(std::chrono::milliseconds(1));
+            retry_.async_wait([this](boost::system::error_code ec) {
+                if (ec == boost::asio::error::operation_aborted) {
+                    return;
+                }
+                std::lock_guard lock(submit_mutex_);
+                retrying_ = false;
+                flush();
+            });
+        }
+
+        void wait_events() {
+            events_->async_read_some(boost::asio::buffer(&event_count_, sizeof(event_count_)),
+                [this](boost::system::error_code ec, std::size_t) {
+                    if (ec == boost::asio::error::operation_aborted) {
+                        return;
+                    }
+                    reap();
+                    wait_events();
+                });
+        }
+
+        // Only one reap runs at a time: it is only called from wait_events
+        void reap() {
+            std::vector<std::pair<Op*, int>> done;
+            for (;;) {
+                unsigned head = *cq_head_;
+                unsigned tail = std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+                for (; head != tail; ++head) {
+                    io_uring_cqe const& cqe = cqes_[head & cq_mask_];
+                    done.emplace_back(reinterpret_cast<Op*>(cqe.user_data), cqe.res);
+                }
+                std::atomic_ref<unsigned>(*cq_head_).store(head, std::memory_order_release);
+
+                // Completions the queue had no room for wait in the kernel
+                // until an enter moves them in
+                if (!(std::atomic_ref<unsigned>(*sq_flags_).load(std::memory_order_acquire) & IORING_SQ_CQ_OVERFLOW)) {
+                    break;
+                }
+                ::syscall(__NR_io_uring_enter, ring_, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+            }
+            for (auto [op, res] : done) {
+                complete(op, res);
+            }
+
+            // Room in the completion queue lets a refused submission in
+            std::lock_guard lock(submit_mutex_);
+            if (retrying_) {
+                flush();
+            }
+        }
+
+        // Writes that come back short are resubmitted for the rest
+        void complete(Op* op, int res) {
+            bool write = op->opcode == IORING_OP_WRITE || op->opcode == IORING_OP_WRITE_FIXED;
+            if (res > 0 && write && op->done + static_cast<std::size_t>(res) < op->size) {
+                op->done += static_cast<std::size_t>(res);
+                submit(op);
+                return;
+            }
+            boost::system::error_code ec;
+            if (res < 0) {
+                ec.assign(-res, boost::system::generic_category());
+            } else {
+                op->done += static_cast<std::size_t>(res);
+            }
+            boost::asio::post(op->executor, [handler = std::move(op->handler), ec, size = op->done] {
+                handler(ec, size);
+            });
+            delete op;
+        }
+
+        // The same operation as blocking calls on the fallback pool
+        void run_blocking(Op* op) {
+            boost::asio::post(*fallback_, [this, op] {
+                bool read = op->opcode == IORING_OP_READ || op->opcode == IORING_OP_READ_FIXED;
+                ssize_t res;
+                for (;;) {
+                    char* data = op->buffer.data + op->done;
+                    std::size_t size = op->size - op->done;
+                    off_t offset = static_cast<off_t>(op->offset + op->done);
+                    if (op->opcode == IORING_OP_FSYNC) {
+                        res = ::fdatasync(op->fd);
+                    } else if (read) {
+                        res = ::pread(op->fd, data, size, offset);
+                    } else {
+                        res = ::pwrite(op->fd, data, size, offset);
+                    }
+                    if (res < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (res > 0) {
+                        op->done += static_cast<std::size_t>(res);
+                        if (!read && op->done < op->size) {
+                            continue;
+                        }
+                    }
+                    break;
+                }
+                boost::system::error_code ec;
+                if (res < 0) {
+                    ec.assign(errno, boost::system::generic_category());
+                }
+                boost::asio::post(op->executor, [handler = std::move(op->handler), ec, size = op->done] {
+                    handler(ec, size);
+                });
+                delete op;
+            });
+        }
+
+        void start(Op* op) {
+            if (ring_ < 0) {
+                run_blocking(op);
+            } else {
+                submit(op);
+            }
+        }
+
+    public:
+        DiskIo(boost::asio::io_context& ioc, DiskIoOptions const& options)
+            : ioc_(ioc), direct_(options.direct), retry_(ioc) {
+            unsigned buffers = std::max(2u, options.buffers);
+            memory_ = static_cast<char*>(std::aligned_alloc(kAlignment, buffers * kBufferSize));
+            if (!memory_) {
+                throw std::bad_alloc();
+            }
+            for (unsigned i = buffers; i-- > 0;) {
+                free_.push_back(i);
+            }
+
+            // Completions beyond the ring's size wait in the kernel, so this
+            // only needs to cover the usual number in flight
+            unsigned entries = 256;
+            while (entries < buffers * 2) {
+                entries <<= 1;
+            }
+            if (setup_ring(entries, buffers)) {
+                events_.emplace(ioc_, event_fd_);
+                wait_events();
+            } else {
+                teardown_ring();
+                if (event_fd_ >= 0) {
+                    ::close(event_fd_);
+                    event_fd_ = -1;
+                }
+                fallback_.emplace(4);
+            }
+        }
+
+        ~DiskIo() {
+            blocking_.join();
+            if (fallback_) {
+                fallback_->join();
+            }
+            events_.reset();
+            teardown_ring();
+            std::free(memory_);
+        }
+
+        DiskIo(DiskIo const&) = delete;
+        DiskIo& operator=(DiskIo const&) = delete;
+
+        bool direct() const {
+            return direct_;
+        }
+
+        bool uring() const {
+            return ring_ >= 0;
+        }
+
+        // Calls f on executor with a pool buffer, once one is free
+        void acquire(boost::asio::any_io_executor executor, std::function<void(Buffer)> f) {
+            std::unique_lock lock(pool_mutex_);
+            if (free_.empty()) {
+                waiters_.emplace_back(std::move(executor), std::move(f));
+                return;
+            }
+            unsigned index = free_.back();
+            free_.pop_back();
+            lock.unlock();
+            Buffer buffer{memory_ + index * kBufferSize, registered_ ? index : kUnregistered};
+            boost::asio::dispatch(executor, [f = std::move(f), buffer] {
+                f(buffer);
+            });
+        }
+
+        void release(Buffer buffer) {
+            std::unique_lock lock(pool_mutex_);
+            if (waiters_.empty()) {
+                free_.push_back(static_cast<unsigned>((buffer.data - memory_) / kBufferSize));
+                return;
+            }
+            auto [executor, f] = std::move(waiters_.front());
+            waiters_.pop_front();
+            lock.unlock();
+            boost::asio::post(executor, [f = std::move(f), buffer] {
+                f(buffer);
+            });
+        }
+
+        // size bytes of buffer at offset of fd; handler gets the bytes
+        // written, which is all of them unless there was an error
+        void write(boost::asio::any_io_executor executor, int fd, Buffer buffer, std::size_t size, std::uint64_t offset,
+                   Handler handler) {
+            std::uint8_t opcode = buffer.index == kUnregistered ? IORING_OP_WRITE : IORING_OP_WRITE_FIXED;
+            start(new Op{std::move(executor), std::move(handler), opcode, fd, buffer, size, offset});
+        }
+
+        // Up to size bytes at offset of fd into buffer; short at end of file
+        void read(boost::asio::any_io_executor executor, int fd, Buffer buffer, std::size_t size, std::uint64_t offset,
+                  Handler handler) {
+            std::uint8_t opcode = buffer.index == kUnregistered ? IORING_OP_READ : IORING_OP_READ_FIXED;
+            start(new Op{std::move(executor), std::move(handler), opcode, fd, buffer, size, offset});
+        }
+
+        // fdatasync
+        void sync(boost::asio::any_io_executor executor, int fd, Handler handler) {
+            start(new Op{std::move(executor), std::move(handler), IORING_OP_FSYNC, fd, Buffer{}, 0, 0});
+        }
+
+        // Runs work, blocking file system calls, off the io_context threads
+        // and then handler(error, result) on executor, with what work
+        // returned or threw
+        template <class Work, class Then>
+        void offload(boost::asio::any_io_executor executor, Work work, Then handler) {
+            boost::asio::post(blocking_, [executor = std::move(executor), work = std::move(work),
+                                          handler = std::move(handler)]() mutable {
+                std::exception_ptr error;
+                decltype(work()) result{};
+                try {
+                    result = work();
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                boost::asio::post(executor, [handler = std::move(handler), error, result = std::move(result)]() mutable {
+                    handler(error, std::move(result));
+                });
+            });
+        }
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Epoch-based memory reclamation.
+//
+// Readers pin the current thread with an Epoch::Guard and may then follow
+// shared pointers without locks or reference counts. Writers that unlink an
+// object hand it to Epoch::retire; it is freed once every thread that was
+// pinned when it was unlinked has unpinned. Pinning costs one store and a
+// atomic exchange on a thread-local cache line.
+//
+// The global epoch only advances when every pinned thread has observed it,
+// so an object retired in epoch e is unreachable by any reader once the
+// global epoch reaches e + 2.
+class Epoch {
+    private:
+        static constexpr std::size_t kCollectEvery = 64;
+
+        struct Retired {
+            void* object;
+            void (*deleter)(void*);
+            std::uint64_t epoch;
+        };
+
+        // Per-thread state. Records are linked once and never unlinked; a
+        // record released by an exiting thread is reused by the next one.
+        struct alignas(64) ThreadRecord {
+            // (epoch << 1) | pinned
+            std::atomic<std::uint64_t> state{0};
+            std::atomic<bool> in_use{false};
+            ThreadRecord* next = nullptr;
+
+            unsigned nesting = 0;
+            std::size_t since_collect = 0;
+            std::vector<Retired> retired;
+        };
+
+        std::atomic<std::uint64_t> global_epoch_{1};
+        std::atomic<ThreadRecord*> records_{nullptr};
+
+        // Garbage left behind by threads that exited
+        std::mutex orphans_mutex_;
+        std::vector<Retired> orphans_;
+
+        static Epoch& domain() {
+            static Epoch instance;
+            return instance;
+        }
+
+        ThreadRecord* acquire_record() {
+            for (ThreadRecord* r = records_.load(std::memory_order_acquire); r; r = r->next) {
+                bool expected = false;
+                if (!r->in_use.load(std::memory_order_relaxed)
+                    && r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                    return r;
+                }
+            }
+
+            auto* r = new ThreadRecord();
+            r->in_use.store(true, std::memory_order_relaxed);
+            ThreadRecord* head = records_.load(std::memory_order_relaxed);
+            do {
+                r->next = head;
+            } while (!records_.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+            return r;
+        }
+
+        void release_record(ThreadRecord* r) {
+            if (!r->retired.empty()) {
+                std::lock_guard lock(orphans_mutex_);
+                orphans_.insert(orphans_.end(), r->retired.begin(), r->retired.end());
+                r->retired.clear();
+            }
+            r->in_use.store(false, std::memory_order_release);
+        }
+
+        // Releases the thread's record when the thread exits
+        struct LocalHandle {
+            ThreadRecord* record = domain().acquire_record();
+
+            ~LocalHandle() {
+                domain().release_record(record);
+            }
+        };
+
+        static ThreadRecord& local() {
+            thread_local LocalHandle handle;
+            return *handle.record;
+        }
+
+        void try_advance() {
+            std::uint64_t epoch = global_epoch_.load();
+            for (ThreadRecord* r = records_.load(std::memory_order_acquire); r; r = r->next) {
+                std::uint64_t state = r->state.load();
+                if ((state & 1) && (state >> 1) != epoch) {
+                    return;
+                }
+            }
+            global_epoch_.compare_exchange_strong(epoch, epoch + 1);
+        }
+
+        static void free_expired(std::vector<Retired>& list, std::uint64_t epoch) {
+            std::size_t kept = 0;
+            for (Retired& item : list) {
+                if (item.epoch + 2 <= epoch) {
+                    item.deleter(item.object);
+                } else {
+                    list[kept++] = item;
+                }
+            }
+            list.resize(kept);
+        }
+
+        void collect(ThreadRecord& r) {
+            r.since_collect = 0;
+            try_advance();
+            std::uint64_t epoch = global_epoch_.load(std::memory_order_acquire);
+            free_expired(r.retired, epoch);
+
+            std::unique_lock lock(orphans_mutex_, std::try_to_lock);
+            if (lock.owns_lock()) {
+                free_expired(orphans_, epoch);
+            }
+        }
+
+    public:
+        // Pins the calling thread for its lifetime. Guards nest.
+        class Guard {
+            private:
+                ThreadRecord& record_;
+
+            public:
+                Guard()
+                    : record_(local()) {
+                    // A seq_cst exchange orders the pin before every load the
+                    // reader makes next, like a store followed by a full fence
+                    if (record_.nesting++ == 0) {
+                        std::uint64_t epoch = domain().global_epoch_.load();
+                        record_.state.exchange((epoch << 1) | 1);
+                    }
+                }
+
+                ~Guard() {
+                    if (--record_.nesting == 0) {
+                        record_.state.store(0, std::memory_order_release);
+                    }
+                }
+
+                Guard(Guard const&) = delete;
+                Guard& operator=(Guard const&) = delete;
+        };
+
+        // Frees object with deleter once no pinned reader can still see it.
+        // The object must already be unreachable for new readers.
+        static void retire(void* object, void (*deleter)(void*)) {
+            Epoch& d = domain();
+            ThreadRecord& r = local();
+            r.retired.push_back({object, deleter, d.global_epoch_.load()});
+            if (++r.since_collect >= kCollectEvery) {
+                d.collect(r);
+            }
+        }
+
+        template <class T>
+        static void retire(T const* object) {
+            retire(const_cast<void*>(static_cast<void const*>(object)), [](void* p) {
+                delete static_cast<T*>(p);
+            });
+        }
+
+        // Advances the epoch if possible and frees this thread's expired
+        // garbage; useful for threads that retire rarely
+        static void collect() {
+            domain().collect(local());
+        }
+
+        // Blocks until every thread that was pinned when it was called has
+        // unpinned. For background threads only; the caller must not be
+        // pinned.
+        static void barrier() {
+            Epoch& d = domain();
+            std::uint64_t target = d.global_epoch_.load() + 2;
+            for (;;) {
+                d.try_advance();
+                if (d.global_epoch_.load() >= target) {
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+};
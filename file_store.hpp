@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "content_hash.hpp"
+
+// Files uploaded for users, stored once per distinct content.
+//
+// Contents live in <root>/objects/<xx>/<sha256>, and a user's file
+// <root>/files/<user id>/<name> is a hard link to its object, so the link
+// count is the object's reference count and opening a user's file resolves
+// straight to the shared content. Each object records its hash in the
+// user.sha256 xattr, which lets replacing a file drop the object it
+// referenced once nothing else does. Objects left unreferenced (by a crash,
+// or on filesystems without xattrs) are swept at startup.
+//
+// Uploads are written to <root>/tmp and only become objects once complete
+// and durable; an upload whose content already exists is discarded without
+// being synced. Links are made under a temporary name and renamed into
+// place, so readers only ever see whole files. has_object, link_existing
+// and commit block on the file system and belong off the io_context
+// threads (DiskIo::offload).
+//
+// Each user's stored bytes are counted in memory, from a scan at startup,
+// so quotas are checked without touching the disk. Uploads reserve their
+// length up front, which keeps concurrent uploads from overrunning a quota
+// together.
+class FileStore {
+    private:
+        static constexpr char const* kHashAttribute = "user.sha256";
+
+        std::filesystem::path files_;
+        std::filesystem::path objects_;
+        std::filesystem::path tmp_;
+        std::atomic<std::uint64_t> next_temp_{0};
+
+        struct Usage {
+            std::uint64_t stored = 0;    // Bytes of the user's files, shared content counted per file
+            std::uint64_t reserved = 0;  // Bytes of uploads in progress
+        };
+        std::uint64_t quota_;
+        std::mutex usage_mutex_;
+        std::unordered_map<std::uint64_t, Usage> usage_;
+
+        [[noreturn]] static void fail(std::string const& what) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+
+        static void sync_dir(std::filesystem::path const& dir) {
+            int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+            if (fd >= 0) {
+                ::fsync(fd);
+                ::close(fd);
+            }
+        }
+
+        std::filesystem::path object_path(std::string const& hex) const {
+            return objects_ / hex.substr(0, 2) / hex;
+        }
+
+        // Removes the object behind fd if fd holds its last reference
+        void release_object(int fd) {
+            struct stat st;
+            char hex[65];
+            ssize_t size = ::fgetxattr(fd, kHashAttribute, hex, sizeof(hex) - 1);
+            if (size != 64 || ::fstat(fd, &st) != 0 || st.st_nlink != 1) {
+                return;
+            }
+            hex[64] = '\0';
+            std::filesystem::path object = object_path(hex);
+            struct stat object_st;
+            if (::stat(object.c_str(), &object_st) == 0 && object_st.st_ino == st.st_ino && object_st.st_dev == st.st_dev) {
+                ::unlink(object.c_str());
+            }
+        }
+
+        // Points user's name at object. False if the object vanished, which
+        // happens when its last reference was dropped concurrently.
+        bool link(std::filesystem::path const& object, std::uint64_t user, std::string_view name) {
+            std::filesystem::path dir = files_ / std::to_string(user);
+            std::filesystem::create_directories(dir);
+            std::filesystem::path staged = dir / ("." + std::string(name) + "." + std::to_string(next_temp_.fetch_add(1)) + ".link");
+            if (::link(object.c_str(), staged.c_str()) != 0) {
+                if (errno == ENOENT) {
+                    return false;
+                }
+                fail("link " + staged.string());
+            }
+
+            std::filesystem::path target = dir / name;
+            struct stat linked;
+            if (::stat(staged.c_str(), &linked) != 0) {
+                int error = errno;
+                ::unlink(staged.c_str());
+                errno = error;
+                fail("stat " + staged.string());
+            }
+            int replaced = ::open(target.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat replaced_st;
+            if (replaced >= 0 && ::fstat(replaced, &replaced_st) != 0) {
+                ::close(replaced);
+                replaced = -1;
+            }
+            if (replaced >= 0 && replaced_st.st_ino == linked.st_ino && replaced_st.st_dev == linked.st_dev) {
+                // Already this content. rename() between two links to one
+                // file does nothing, which would leave the staged link.
+                ::unlink(staged.c_str());
+                ::close(replaced);
+                return true;
+            }
+            if (::rename(staged.c_str(), target.c_str()) != 0) {
+                int error = errno;
+                ::unlink(staged.c_str());
+                if (replaced >= 0) {
+                    ::close(replaced);
+                }
+                errno = error;
+                fail("rename " + staged.string());
+            }
+            sync_dir(dir);
+            std::uint64_t replaced_size = 0;
+            if (replaced >= 0) {
+                replaced_size = static_cast<std::uint64_t>(replaced_st.st_size);
+                release_object(replaced);
+                ::close(replaced);
+            }
+            std::lock_guard lock(usage_mutex_);
+            Usage& usage = usage_[user];
+            usage.stored = usage.stored + static_cast<std::uint64_t>(linked.st_size) - std::min(replaced_size, usage.stored);
+            return true;
+        }
+
+    public:
+        // quota: bytes of files each user may store, 0 for no limit
+        explicit FileStore(std::filesystem::path const& root, std::uint64_t quota = 0)
+            : files_(root / "files"), objects_(root / "objects"), tmp_(root / "tmp"), quota_(quota) {
+            std::filesystem::create_directories(files_);
+            std::filesystem::create_directories(objects_);
+            std::filesystem::remove_all(tmp_);
+            std::filesystem::create_directories(tmp_);
+
+            for (auto const& user : std::filesystem::directory_iterator(files_)) {
+                if (!user.is_directory()) {
+                    continue;
+                }
+                std::uint64_t id = std::strtoull(user.path().filename().c_str(), nullptr, 10);
+                for (auto const& entry : std::filesystem::directory_iterator(user.path())) {
+                    if (entry.path().filename().string().starts_with(".")) {
+                        std::filesystem::remove(entry.path());
+                    } else if (entry.is_regular_file()) {
+                        usage_[id].stored += entry.file_size();
+                    }
+                }
+            }
+            for (auto const& entry : std::filesystem::recursive_directory_iterator(objects_)) {
+                if (entry.is_regular_file() && entry.hard_link_count() == 1) {
+                    std::filesystem::remove(entry.path());
+                }
+            }
+        }
+
+        FileStore(FileStore const&) = delete;
+        FileStore& operator=(FileStore const&) = delete;
+
+        // 1-255 characters of [A-Za-z0-9._-], not starting with a dot
+        static bool valid_name(std::string_view name) {
+            if (name.empty() || name.size() > 255 || name.front() == '.') {
+                return false;
+            }
+            for (char c : name) {
+                bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+                          || c == '.' || c == '_' || c == '-';
+                if (!ok) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        std::filesystem::path path(std::uint64_t user, std::string_view name) const {
+            return files_ / std::to_string(user) / name;
+        }
+
+        // Opens user's file name for reading, with extra flags such as
+        // O_DIRECT; -1 with errno set on failure
+        int open(std::uint64_t user, std::string_view name, int flags = 0) const {
+            return ::open(path(user, name).c_str(), O_RDONLY | O_CLOEXEC | flags);
+        }
+
+        // Sets bytes aside for an upload by user; false if that would take
+        // the user over quota. Each reservation is given back with
+        // unreserve once the upload is stored or abandoned.
+        bool reserve(std::uint64_t user, std::uint64_t bytes) {
+            std::lock_guard lock(usage_mutex_);
+            Usage& usage = usage_[user];
+            if (quota_ && (usage.stored + usage.reserved + bytes > quota_ || bytes > quota_)) {
+                return false;
+            }
+            usage.reserved += bytes;
+            return true;
+        }
+
+        void unreserve(std::uint64_t user, std::uint64_t bytes) {
+            std::lock_guard lock(usage_mutex_);
+            Usage& usage = usage_[user];
+            usage.reserved -= std::min(bytes, usage.reserved);
+        }
+
+        // Bytes user may still upload without a reservation, for bodies of
+        // unknown length
+        std::uint64_t remaining(std::uint64_t user) {
+            if (!quota_) {
+                return std::numeric_limits<std::uint64_t>::max();
+            }
+            std::lock_guard lock(usage_mutex_);
+            Usage& usage = usage_[user];
+            return quota_ - std::min(quota_, usage.stored + usage.reserved);
+        }
+
+        // A fresh temporary path for an upload
+        std::filesystem::path begin() {
+            return tmp_ / (std::to_string(next_temp_.fetch_add(1)) + ".part");
+        }
+
+        bool has_object(Digest const& digest) const {
+            return ::access(object_path(to_hex(digest)).c_str(), F_OK) == 0;
+        }
+
+        // Stores user's file name as a reference to existing content. False
+        // if no object has that digest.
+        bool link_existing(Digest const& digest, std::uint64_t user, std::string_view name) {
+            return link(object_path(to_hex(digest)), user, name);
+        }
+
+        // Stores the upload written to fd at temp as user's file name. The
+        // upload becomes a new object unless its content is already stored,
+        // in which case it is dropped unsynced. A new object needs fd to be
+        // synced already: unless synced, that case returns false having
+        // stored nothing, for the caller to sync fd and commit again.
+        bool commit(int fd, std::filesystem::path const& temp, Digest const& digest, std::uint64_t user,
+                    std::string_view name, bool synced) {
+            std::string hex = to_hex(digest);
+            std::filesystem::path object = object_path(hex);
+            for (;;) {
+                if (link(object, user, name)) {
+                    abort(temp);
+                    return true;
+                }
+                if (!synced) {
+                    return false;
+                }
+                ::fsetxattr(fd, kHashAttribute, hex.data(), hex.size(), 0);
+                std::filesystem::create_directories(object.parent_path());
+                // Concurrent uploads of the same content may race here;
+                // link() fails rather than replacing an existing object
+                if (::link(temp.c_str(), object.c_str()) != 0 && errno != EEXIST) {
+                    fail("link " + object.string());
+                }
+                sync_dir(object.parent_path());
+            }
+        }
+
+        // Removes an upload that did not complete
+        void abort(std::filesystem::path const& temp) {
+            std::error_code ec;
+            std::filesystem::remove(temp, ec);
+        }
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#if defined(__SSE2__) && !defined(__SANITIZE_THREAD__)
+#include <emmintrin.h>
+#define FLAT_INDEX_SSE2 1
+#endif
+
+#include "epoch.hpp"
+
+// Open-addressing hash index from integer id to a 32-bit slot number,
+// laid out like a Swiss table: one control byte per entry holding seven
+// bits of the hash, probed sixteen at a time with SSE2 so a lookup usually
+// touches one control group and one key.
+//
+// Lookups are lock-free and must run under an Epoch::Guard. Inserts are
+// serialized by the caller. An entry is written slot, then key, then
+// control byte, each with release, so a reader that matches a control byte
+// and then acquires the key sees the complete entry. Growing builds a new
+// table, publishes it and retires the old one. Keys are never removed and
+// 0 is reserved.
+class FlatIdIndex {
+    private:
+        static constexpr std::size_t kGroupSize = 16;
+        static constexpr std::uint8_t kEmpty = 0x80;
+
+        struct Table {
+            std::size_t group_mask;
+            std::size_t size = 0;
+            std::unique_ptr<std::atomic<std::uint8_t>[]> ctrl;
+            std::unique_ptr<std::atomic<std::uint64_t>[]> keys;
+            std::unique_ptr<std::atomic<std::uint32_t>[]> slots;
+
+            explicit Table(std::size_t groups)
+                : group_mask(groups - 1),
+                  ctrl(new std::atomic<std::uint8_t>[groups * kGroupSize]),
+                  keys(new std::atomic<std::uint64_t>[groups * kGroupSize]),
+                  slots(new std::atomic<std::uint32_t>[groups * kGroupSize]) {
+                for (std::size_t i = 0; i < groups * kGroupSize; ++i) {
+                    ctrl[i].store(kEmpty, std::memory_order_relaxed);
+                    keys[i].store(0, std::memory_order_relaxed);
+                }
+            }
+
+            std::size_t capacity() const {
+                return (group_mask + 1) * kGroupSize;
+            }
+        };
+
+        std::atomic<Table*> table_{new Table(4)};
+
+        static std::uint64_t hash(std::uint64_t id) {
+            id ^= id >> 33;
+            id *= 0xff51afd7ed558ccdULL;
+            id ^= id >> 33;
+            id *= 0xc4ceb9fe1a85ec53ULL;
+            id ^= id >> 33;
+            return id;
+        }
+
+        // Bit i set for each control byte in the group equal to h2, and for
+        // each empty one
+        static void match_group(Table const& table, std::size_t group, std::uint8_t h2,
+                                std::uint32_t& matches, std::uint32_t& empties) {
+            std::atomic<std::uint8_t> const* ctrl = &table.ctrl[group * kGroupSize];
+#ifdef FLAT_INDEX_SSE2
+            // Racy vector read of bytes that are only ever written by release
+            // stores; every candidate is re-validated by acquiring its key
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<__m128i const*>(ctrl));
+            matches = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(static_cast<char>(h2)))));
+            empties = static_cast<std::uint32_t>(_mm_movemask_epi8(bytes));
+#else
+            matches = 0;
+            empties = 0;
+            for (std::size_t i = 0; i < kGroupSize; ++i) {
+                std::uint8_t byte = ctrl[i].load(std::memory_order_relaxed);
+                matches |= std::uint32_t(byte == h2) << i;
+                empties |= std::uint32_t(byte == kEmpty) << i;
+            }
+#endif
+        }
+
+        static void put(Table& table, std::uint64_t id, std::uint32_t slot) {
+            std::uint64_t h = hash(id);
+            std::uint8_t h2 = h & 0x7f;
+            for (std::size_t group = (h >> 7) & table.group_mask, step = 1;; group = (group + step++) & table.group_mask) {
+                std::uint32_t matches, empties;
+                match_group(table, group, h2, matches, empties);
+                if (empties) {
+                    std::size_t i = group * kGroupSize + __builtin_ctz(empties);
+                    table.slots[i].store(slot, std::memory_order_release);
+                    table.keys[i].store(id, std::memory_order_release);
+                    table.ctrl[i].store(h2, std::memory_order_release);
+                    table.size++;
+                    return;
+                }
+            }
+        }
+
+    public:
+        ~FlatIdIndex() {
+            delete table_.load();
+        }
+
+        // Caller holds an Epoch::Guard
+        bool find(std::uint64_t id, std::uint32_t& slot) const {
+            Table const* table = table_.load(std::memory_order_acquire);
+            std::uint64_t h = hash(id);
+            std::uint8_t h2 = h & 0x7f;
+            for (std::size_t group = (h >> 7) & table->group_mask, step = 1;; group = (group + step++) & table->group_mask) {
+                std::uint32_t matches, empties;
+                match_group(*table, group, h2, matches, empties);
+                for (; matches; matches &= matches - 1) {
+                    std::size_t i = group * kGroupSize + __builtin_ctz(matches);
+                    if (table->keys[i].load(std::memory_order_acquire) == id) {
+                        slot = table->slots[i].load(std::memory_order_relaxed);
+                        return true;
+                    }
+                }
+                if (empties) {
+                    return false;
+                }
+            }
+        }
+
+        // Calls f with every key. Callers serialize this with inserts.
+        template <class F>
+        void for_each_key(F f) const {
+            Table const* table = table_.load(std::memory_order_relaxed);
+            for (std::size_t i = 0; i < table->capacity(); ++i) {
+                if (std::uint64_t key = table->keys[i].load(std::memory_order_relaxed)) {
+                    f(key);
+                }
+            }
+        }
+
+        // Callers serialize inserts
+        void insert(std::uint64_t id, std::uint32_t slot) {
+            Table* table = table_.load(std::memory_order_relaxed);
+            if ((table->size + 1) * 8 > table->capacity() * 7) {
+                auto* grown = new Table((table->group_mask + 1) * 2);
+                for (std::size_t i = 0; i < table->capacity(); ++i) {
+                    if (std::uint64_t key = table->keys[i].load(std::memory_order_relaxed)) {
+                        put(*grown, key, table->slots[i].load(std::memory_order_relaxed));
+                    }
+                }
+                table_.store(grown, std::memory_order_release);
+                Epoch::retire(table);
+                table = grown;
+            }
+            put(*table, id, slot);
+        }
+};
@@ -0,0 +1,488 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// HPACK (RFC 7541) header compression for HTTP/2.
+namespace hpack {
+
+struct Header {
+    std::string name;
+    std::string value;
+};
+
+// Appendix A
+inline constexpr std::array<std::pair<std::string_view, std::string_view>, 61> kStaticTable{{
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+}};
+
+// Appendix B: code and length in bits of each symbol, 256 being EOS
+struct HuffmanCode {
+    std::uint32_t code;
+    std::uint8_t bits;
+};
+inline constexpr std::array<HuffmanCode, 257> kHuffmanCodes{{
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30}
+}};
+
+// Each entry costs its name and value plus 32 bytes of overhead (4.1)
+inline std::size_t entry_size(std::string_view name, std::string_view value) {
+    return name.size() + value.size() + 32;
+}
+
+// Entries added by the header blocks seen so far, newest first, evicted
+// oldest first to stay within max_size
+class DynamicTable {
+    private:
+        std::deque<Header> entries_;
+        std::size_t size_ = 0;
+        std::size_t max_size_;
+
+        void evict(std::size_t room) {
+            while (!entries_.empty() && size_ + room > max_size_) {
+                size_ -= entry_size(entries_.back().name, entries_.back().value);
+                entries_.pop_back();
+            }
+        }
+
+    public:
+        explicit DynamicTable(std::size_t max_size) : max_size_(max_size) {}
+
+        std::size_t max_size() const {
+            return max_size_;
+        }
+
+        std::size_t count() const {
+            return entries_.size();
+        }
+
+        // 0 is the newest entry
+        Header const& at(std::size_t index) const {
+            return entries_[index];
+        }
+
+        void resize(std::size_t max_size) {
+            max_size_ = max_size;
+            evict(0);
+        }
+
+        // An entry larger than the table empties it and is not added
+        void add(std::string_view name, std::string_view value) {
+            std::size_t size = entry_size(name, value);
+            evict(size);
+            if (size > max_size_) {
+                return;
+            }
+            entries_.push_front({std::string(name), std::string(value)});
+            size_ += size;
+        }
+};
+
+namespace detail {
+
+// Prefixed integer (5.1) after the flag bits already in first
+inline void write_integer(std::string& out, std::uint8_t first, unsigned prefix, std::uint64_t value) {
+    std::uint64_t limit = (1u << prefix) - 1;
+    if (value < limit) {
+        out.push_back(static_cast<char>(first | value));
+        return;
+    }
+    out.push_back(static_cast<char>(first | limit));
+    value -= limit;
+    while (value >= 128) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+inline bool read_integer(std::string_view& in, unsigned prefix, std::uint64_t& value) {
+    if (in.empty()) {
+        return false;
+    }
+    std::uint64_t limit = (1u << prefix) - 1;
+    value = static_cast<std::uint8_t>(in.front()) & limit;
+    in.remove_prefix(1);
+    if (value < limit) {
+        return true;
+    }
+    for (unsigned shift = 0; shift < 63; shift += 7) {
+        if (in.empty()) {
+            return false;
+        }
+        auto byte = static_cast<std::uint8_t>(in.front());
+        in.remove_prefix(1);
+        value += std::uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Binary tree of the Huffman code, walked a bit at a time
+struct HuffmanTree {
+    struct Node {
+        std::int16_t child[2] = {-1, -1};
+        std::int16_t symbol = -1;
+    };
+    std::vector<Node> nodes;
+
+    HuffmanTree() : nodes(1) {
+        for (std::size_t symbol = 0; symbol < kHuffmanCodes.size(); ++symbol) {
+            auto [code, bits] = kHuffmanCodes[symbol];
+            std::size_t node = 0;
+            for (int bit = bits - 1; bit >= 0; --bit) {
+                int branch = (code >> bit) & 1;
+                if (nodes[node].child[branch] < 0) {
+                    nodes[node].child[branch] = static_cast<std::int16_t>(nodes.size());
+                    nodes.emplace_back();
+                }
+                node = static_cast<std::size_t>(nodes[node].child[branch]);
+            }
+            nodes[node].symbol = static_cast<std::int16_t>(symbol);
+        }
+    }
+
+    static HuffmanTree const& get() {
+        static HuffmanTree const tree;
+        return tree;
+    }
+};
+
+// False on EOS, or on padding that is longer than 7 bits or not all ones
+inline bool huffman_decode(std::string_view in, std::string& out) {
+    auto const& nodes = HuffmanTree::get().nodes;
+    std::size_t node = 0;
+    unsigned depth = 0;   // Bits since the last symbol
+    bool ones = true;     // ... all of them 1
+    for (char c : in) {
+        auto byte = static_cast<std::uint8_t>(c);
+        for (int bit = 7; bit >= 0; --bit) {
+            int branch = (byte >> bit) & 1;
+            std::int16_t next = nodes[node].child[branch];
+            if (next < 0) {
+                return false;
+            }
+            node = static_cast<std::size_t>(next);
+            ++depth;
+            ones = ones && branch;
+            if (std::int16_t symbol = nodes[node].symbol; symbol >= 0) {
+                if (symbol == 256) {
+                    return false;
+                }
+                out.push_back(static_cast<char>(symbol));
+                node = 0;
+                depth = 0;
+                ones = true;
+            }
+        }
+    }
+    return depth < 8 && ones;
+}
+
+}  // namespace detail
+
+// Decodes the header blocks of one connection, in order: each block may
+// change the dynamic table the next is decoded against.
+class Decoder {
+    private:
+        DynamicTable table_;
+        std::size_t limit_;      // The SETTINGS_HEADER_TABLE_SIZE we advertised
+        std::size_t max_list_;   // Decoded bytes per block, as entry_size counts them
+
+        bool lookup(std::uint64_t index, Header& header) const {
+            if (index == 0) {
+                return false;
+            }
+            if (index <= kStaticTable.size()) {
+                header.name = kStaticTable[index - 1].first;
+                header.value = kStaticTable[index - 1].second;
+                return true;
+            }
+            index -= kStaticTable.size() + 1;
+            if (index >= table_.count()) {
+                return false;
+            }
+            header = table_.at(index);
+            return true;
+        }
+
+        static bool read_string(std::string_view& in, std::string& out) {
+            if (in.empty()) {
+                return false;
+            }
+            bool huffman = static_cast<std::uint8_t>(in.front()) & 0x80;
+            std::uint64_t length;
+            if (!detail::read_integer(in, 7, length) || length > in.size()) {
+                return false;
+            }
+            std::string_view raw = in.substr(0, length);
+            in.remove_prefix(length);
+            out.clear();
+            if (huffman) {
+                return detail::huffman_decode(raw, out);
+            }
+            out.assign(raw);
+            return true;
+        }
+
+    public:
+        // max_list bounds what a block may decode to: indexed fields are a
+        // byte each, however long the entry they refer to
+        explicit Decoder(std::size_t table_size = 4096, std::size_t max_list = 65536)
+            : table_(table_size), limit_(table_size), max_list_(max_list) {}
+
+        // Appends the headers of block to headers; false on a compression
+        // error or a block over max_list, after which the connection cannot
+        // go on
+        bool decode(std::string_view block, std::vector<Header>& headers) {
+            bool first = true;
+            std::size_t list = 0;
+            auto add = [&](Header&& header) {
+                list += entry_size(header.name, header.value);
+                headers.push_back(std::move(header));
+                return list <= max_list_;
+            };
+            while (!block.empty()) {
+                auto byte = static_cast<std::uint8_t>(block.front());
+                std::uint64_t index;
+                if ((byte & 0xe0) == 0x20) {
+                    // Dynamic table size update, only at the start of a block
+                    if (!first || !detail::read_integer(block, 5, index) || index > limit_) {
+                        return false;
+                    }
+                    table_.resize(index);
+                    continue;
+                }
+                first = false;
+
+                Header header;
+                if (byte & 0x80) {
+                    // Indexed
+                    if (!detail::read_integer(block, 7, index) || !lookup(index, header) || !add(std::move(header))) {
+                        return false;
+                    }
+                    continue;
+                }
+                // Literal: with incremental indexing (01), without (0000) or
+                // never indexed (0001)
+                bool indexing = (byte & 0xc0) == 0x40;
+                if (!detail::read_integer(block, indexing ? 6 : 4, index)) {
+                    return false;
+                }
+                if (index ? !lookup(index, header) : !read_string(block, header.name)) {
+                    return false;
+                }
+                if (!read_string(block, header.value)) {
+                    return false;
+                }
+                if (indexing) {
+                    table_.add(header.name, header.value);
+                }
+                if (!add(std::move(header))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+};
+
+// Encodes the header blocks of one connection. Fields asked to be indexed
+// are added to the dynamic table and sent as a single index from then on;
+// strings go out as is, without Huffman coding.
+class Encoder {
+    private:
+        DynamicTable table_;
+        bool resized_ = false;  // A size update is due at the start of the next block
+
+        static void write_string(std::string& out, std::string_view text) {
+            detail::write_integer(out, 0, 7, text.size());
+            out.append(text);
+        }
+
+    public:
+        Encoder() : table_(4096) {}
+
+        // The peer's SETTINGS_HEADER_TABLE_SIZE
+        void set_max_size(std::size_t size) {
+            if (size != table_.max_size()) {
+                table_.resize(size);
+                resized_ = true;
+            }
+        }
+
+        void begin(std::string& out) {
+            if (resized_) {
+                detail::write_integer(out, 0x20, 5, table_.max_size());
+                resized_ = false;
+            }
+        }
+
+        void encode(std::string& out, std::string_view name, std::string_view value, bool index = false) {
+            std::uint64_t name_index = 0;
+            for (std::size_t i = 0; i < kStaticTable.size(); ++i) {
+                if (kStaticTable[i].first == name) {
+                    if (kStaticTable[i].second == value) {
+                        detail::write_integer(out, 0x80, 7, i + 1);
+                        return;
+                    }
+                    if (!name_index) {
+                        name_index = i + 1;
+                    }
+                }
+            }
+            for (std::size_t i = 0; i < table_.count(); ++i) {
+                Header const& entry = table_.at(i);
+                if (entry.name == name && entry.value == value) {
+                    detail::write_integer(out, 0x80, 7, kStaticTable.size() + 1 + i);
+                    return;
+                }
+            }
+
+            if (index) {
+                detail::write_integer(out, 0x40, 6, name_index);
+            } else {
+                detail::write_integer(out, 0x00, 4, name_index);
+            }
+            if (!name_index) {
+                write_string(out, name);
+            }
+            write_string(out, value);
+            if (index) {
+                table_.add(name, value);
+            }
+        }
+};
+
+}  // namespace hpack
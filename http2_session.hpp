@@ -0,0 +1,783 @@
+#pragma once
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http/verb.hpp>
+#include <boost/beast/version.hpp>
+#include <boost/json.hpp>
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "cpu_pool.hpp"
+#include "hpack.hpp"
+#include "json_api.hpp"
+#include "response_head.hpp"
+#include "thread_per_core.hpp"
+#include "user_partitions.hpp"
+
+// What a client sends first on an HTTP/2 connection
+inline constexpr std::string_view kHttp2Preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// The SETTINGS payload an HTTP2-Settings header carries, in RFC 4648
+// base64url; nullopt if it is malformed
+inline std::optional<std::string> http2_settings_payload(std::string_view text) {
+    std::string out;
+    std::uint32_t bits = 0;
+    int count = 0;
+    for (char c : text) {
+        int value;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+        } else if (c == '-') {
+            value = 62;
+        } else if (c == '_') {
+            value = 63;
+        } else if (c == '=') {
+            break;
+        } else {
+            return std::nullopt;
+        }
+        bits = (bits << 6) | static_cast<std::uint32_t>(value);
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            out.push_back(static_cast<char>((bits >> count) & 0xff));
+        }
+    }
+    if (out.size() % 6 != 0) {
+        return std::nullopt;
+    }
+    return out;
+}
+
+// An HTTP/2 connection (RFC 9113) over cleartext or TLS, started with the
+// client preface or, in the clear, by upgrading an HTTP/1.1 request with
+// "Upgrade: h2c". Connection is a beast::tcp_stream or a TlsStream.
+//
+// Requests on any number of concurrent streams go to the same JsonApi as
+// HTTP/1.1 sessions. Each runs as soon as its END_STREAM arrives; the
+// responses are then interleaved a frame at a time within the peer's flow
+// control windows. The file routes stream bodies to and from disk through
+// machinery tied to an HTTP/1.1 connection, so their streams are reset
+// with HTTP_1_1_REQUIRED.
+//
+// Frames are written through one buffer, whose contents go out in a
+// single write while the next frames gather behind it.
+template <class Connection>
+class Http2Session : public std::enable_shared_from_this<Http2Session<Connection>> {
+    private:
+        using tcp = boost::asio::ip::tcp;
+        using Canned = JsonApi::Canned;
+
+        enum class Frame : std::uint8_t {
+            data,
+            headers,
+            priority,
+            rst_stream,
+            settings,
+            push_promise,
+            ping,
+            goaway,
+            window_update,
+            continuation
+        };
+
+        enum class Error : std::uint32_t {
+            none = 0x0,
+            protocol = 0x1,
+            flow_control = 0x3,
+            stream_closed = 0x5,
+            frame_size = 0x6,
+            refused_stream = 0x7,
+            compression = 0x9,
+            enhance_your_calm = 0xb,
+            http_1_1_required = 0xd
+        };
+
+        static constexpr std::uint8_t kEndStream = 0x1;
+        static constexpr std::uint8_t kAck = 0x1;
+        static constexpr std::uint8_t kEndHeaders = 0x4;
+        static constexpr std::uint8_t kPadded = 0x8;
+        static constexpr std::uint8_t kPriority = 0x20;
+
+        static constexpr std::size_t kFrameHeader = 9;
+        static constexpr std::size_t kMaxFrameSize = 16384;       // Ours, the protocol default
+        static constexpr std::int64_t kWindow = 65535;            // Ours, the protocol default
+        static constexpr std::int64_t kMaxWindow = 0x7fffffff;
+        static constexpr std::uint32_t kMaxConcurrentStreams = 100;
+        static constexpr std::size_t kMaxHeaderBlock = 65536;
+        static constexpr std::uint64_t kBodyLimit = 1024 * 1024;  // As for HTTP/1.1
+        static constexpr std::size_t kOutputHigh = 256 * 1024;    // Queued output that pauses framing and reading
+
+        struct Stream {
+            std::vector<hpack::Header> headers;  // Owns what the views below point at
+            boost::beast::http::verb method = boost::beast::http::verb::unknown;
+            std::string_view target;
+            std::optional<std::string_view> if_match;
+            std::optional<json::stream_parser> json;  // Null for routes that take no body
+            json::error_code json_error;
+            std::uint64_t received = 0;
+            std::int64_t recv_window = kWindow;
+            std::int64_t recv_consumed = 0;  // Not yet given back with WINDOW_UPDATE
+            bool remote_closed = false;      // END_STREAM received, or the request was answered early
+
+            bool responding = false;
+            std::string body;
+            std::size_t sent = 0;
+            std::int64_t send_window = 0;
+        };
+
+        Connection stream_;
+        boost::beast::flat_buffer buffer_;
+        JsonApi api_;
+        CoreSet* cores_;  // With thread-per-core, else null
+        hpack::Decoder decoder_;
+        hpack::Encoder encoder_;
+        std::map<std::uint32_t, Stream> streams_;
+        std::uint32_t last_stream_ = 0;
+        bool preface_seen_ = false;
+
+        // A header block split over CONTINUATION frames
+        std::uint32_t continuation_stream_ = 0;
+        std::uint8_t continuation_flags_ = 0;
+        std::string header_block_;
+
+        // Connection flow control and the peer's settings
+        std::int64_t send_window_ = kWindow;
+        std::int64_t recv_window_ = kWindow;
+        std::int64_t recv_consumed_ = 0;
+        std::int64_t peer_initial_window_ = kWindow;
+        std::size_t peer_max_frame_ = 16384;
+
+        std::string out_;      // Frames gathering
+        std::string writing_;  // Frames being written
+        bool write_in_flight_ = false;
+        bool read_paused_ = false;  // Until the output drains
+        bool closing_ = false;  // Shut down once everything queued is written
+
+        void frame_header(std::size_t length, Frame type, std::uint8_t flags, std::uint32_t id) {
+            char header[kFrameHeader] = {
+                static_cast<char>(length >> 16), static_cast<char>(length >> 8), static_cast<char>(length),
+                static_cast<char>(type), static_cast<char>(flags),
+                static_cast<char>(id >> 24), static_cast<char>(id >> 16), static_cast<char>(id >> 8),
+                static_cast<char>(id)};
+            out_.append(header, kFrameHeader);
+        }
+
+        static std::uint32_t read32(std::string_view bytes) {
+            return (std::uint32_t(std::uint8_t(bytes[0])) << 24) | (std::uint32_t(std::uint8_t(bytes[1])) << 16)
+                   | (std::uint32_t(std::uint8_t(bytes[2])) << 8) | std::uint32_t(std::uint8_t(bytes[3]));
+        }
+
+        static void append32(std::string& out, std::uint32_t value) {
+            char bytes[4] = {static_cast<char>(value >> 24), static_cast<char>(value >> 16),
+                             static_cast<char>(value >> 8), static_cast<char>(value)};
+            out.append(bytes, 4);
+        }
+
+        void send_settings() {
+            // MAX_CONCURRENT_STREAMS and MAX_HEADER_LIST_SIZE
+            frame_header(12, Frame::settings, 0, 0);
+            out_.append("\0\3", 2);
+            append32(out_, kMaxConcurrentStreams);
+            out_.append("\0\6", 2);
+            append32(out_, kMaxHeaderBlock);
+        }
+
+        void send_window_update(std::uint32_t id, std::int64_t increment) {
+            frame_header(4, Frame::window_update, 0, id);
+            append32(out_, static_cast<std::uint32_t>(increment));
+        }
+
+        void reset(std::uint32_t id, Error error) {
+            frame_header(4, Frame::rst_stream, 0, id);
+            append32(out_, static_cast<std::uint32_t>(error));
+            streams_.erase(id);
+        }
+
+        // A connection error: GOAWAY, and no more frames are read
+        bool fail(Error error) {
+            frame_header(8, Frame::goaway, 0, 0);
+            append32(out_, last_stream_);
+            append32(out_, static_cast<std::uint32_t>(error));
+            closing_ = true;
+            return false;
+        }
+
+        // SETTINGS parameters from a frame or the HTTP2-Settings header
+        Error apply_settings(std::string_view payload) {
+            for (; payload.size() >= 6; payload.remove_prefix(6)) {
+                unsigned id = (unsigned(std::uint8_t(payload[0])) << 8) | std::uint8_t(payload[1]);
+                std::uint32_t value = read32(payload.substr(2));
+                switch (id) {
+                    case 0x1:  // HEADER_TABLE_SIZE; more than the default buys little
+                        encoder_.set_max_size(std::min<std::uint32_t>(value, 4096));
+                        break;
+                    case 0x2:  // ENABLE_PUSH, which we never do
+                        if (value > 1) {
+                            return Error::protocol;
+                        }
+                        break;
+                    case 0x4: {  // INITIAL_WINDOW_SIZE, applied to open streams too
+                        if (value > kMaxWindow) {
+                            return Error::flow_control;
+                        }
+                        std::int64_t delta = std::int64_t(value) - peer_initial_window_;
+                        peer_initial_window_ = value;
+                        for (auto& [id, stream] : streams_) {
+                            stream.send_window += delta;
+                        }
+                        break;
+                    }
+                    case 0x5:  // MAX_FRAME_SIZE
+                        if (value < 16384 || value > 16777215) {
+                            return Error::protocol;
+                        }
+                        peer_max_frame_ = value;
+                        break;
+                    default:
+                        break;
+                }
+            }
+            return Error::none;
+        }
+
+        void respond(std::uint32_t id, Stream& stream, JsonApi::Status status, std::string body,
+                     std::optional<std::uint64_t> etag, bool retry) {
+            char digits[24];
+            auto number = [&digits](std::uint64_t value) {
+                return std::string_view(digits, static_cast<std::size_t>(
+                                                    std::to_chars(digits, digits + sizeof(digits), value).ptr - digits));
+            };
+
+            std::size_t at = out_.size();
+            frame_header(0, Frame::headers, kEndHeaders | (body.empty() ? kEndStream : 0), id);
+            encoder_.begin(out_);
+            encoder_.encode(out_, ":status", number(static_cast<unsigned>(status)));
+            encoder_.encode(out_, "server", BOOST_BEAST_VERSION_STRING, true);
+            encoder_.encode(out_, "content-type", "application/json", true);
+            encoder_.encode(out_, "date", CommonHeaders::date(), true);
+            if (etag) {
+                std::string tag = "\"" + std::string(number(*etag)) + "\"";
+                encoder_.encode(out_, "etag", tag);
+            }
+            if (retry) {
+                encoder_.encode(out_, "retry-after", "1");
+            }
+            encoder_.encode(out_, "content-length", number(body.size()));
+            std::size_t length = out_.size() - at - kFrameHeader;
+            out_[at] = static_cast<char>(length >> 16);
+            out_[at + 1] = static_cast<char>(length >> 8);
+            out_[at + 2] = static_cast<char>(length);
+
+            if (body.empty()) {
+                streams_.erase(id);
+                return;
+            }
+            stream.remote_closed = true;
+            stream.responding = true;
+            stream.body = std::move(body);
+        }
+
+        void respond_error(std::uint32_t id, Stream& stream, JsonApi::Status status, std::string const& message) {
+            respond(id, stream, status, JsonApi::error_body(message), std::nullopt, false);
+        }
+
+        void finish_request(std::uint32_t id, Stream& stream) {
+            stream.remote_closed = true;
+            std::optional<json::value> body;
+            if (stream.json && !stream.json_error) {
+                stream.json->finish(stream.json_error);
+                if (!stream.json_error) {
+                    body = stream.json->release();
+                }
+            }
+            stream.json.reset();
+
+            // Writes and list rebuilds may be handed to other threads
+            auto deferred = [self = this->shared_from_this(), id](Canned canned, JsonApi::Reply reply) mutable {
+                auto executor = self->stream_.get_executor();
+                boost::asio::post(executor, [self = std::move(self), id, canned, reply = std::move(reply)]() mutable {
+                    if (auto it = self->streams_.find(id); it != self->streams_.end()) {
+                        self->answer(id, it->second, canned, std::move(reply));
+                        self->flush();
+                    }
+                });
+            };
+            if (api_.defer(stream.method, stream.target, stream.if_match, body, std::move(deferred))) {
+                return;
+            }
+
+            // Another core's partition is served there, from a copy of the
+            // request: the stream may be reset before the reply is back
+            if (auto partition = api_.partition_of(stream.method, stream.target);
+                cores_ && partition && cores_->owner(*partition) != CoreSet::current()) {
+                cores_->call(cores_->owner(*partition),
+                    [this, method = stream.method, target = std::string(stream.target),
+                     if_match = std::optional<std::string>(stream.if_match), body = std::move(body)] {
+                        JsonApi::Reply reply;
+                        Canned canned = api_.route({method, target, if_match, body}, reply);
+                        return std::pair(canned, std::move(reply));
+                    },
+                    [self = this->shared_from_this(), id](std::pair<Canned, JsonApi::Reply> routed) {
+                        if (auto it = self->streams_.find(id); it != self->streams_.end()) {
+                            self->answer(id, it->second, routed.first, std::move(routed.second));
+                            self->flush();
+                        }
+                    });
+                return;
+            }
+
+            JsonApi::Reply reply;
+            Canned canned = api_.route({stream.method, stream.target, stream.if_match, body}, reply);
+            answer(id, stream, canned, std::move(reply));
+        }
+
+        void answer(std::uint32_t id, Stream& stream, Canned canned, JsonApi::Reply reply) {
+            if (canned != Canned::none) {
+                JsonApi::CannedReply const& res = JsonApi::canned(canned);
+                respond(id, stream, res.status, res.body, std::nullopt, res.retry);
+            } else {
+                respond(id, stream, reply.status, std::move(reply.body), reply.etag, false);
+            }
+        }
+
+        void open_stream(std::uint32_t id, std::vector<hpack::Header>&& headers, bool end_stream) {
+            Stream& stream = streams_[id];
+            stream.headers = std::move(headers);
+            stream.send_window = peer_initial_window_;
+            std::optional<std::string_view> method;
+            std::optional<std::string_view> target;
+            for (hpack::Header const& header : stream.headers) {
+                if (header.name == ":method") {
+                    method = header.value;
+                } else if (header.name == ":path") {
+                    target = header.value;
+                } else if (header.name == "if-match" && !stream.if_match) {
+                    stream.if_match = header.value;
+                }
+            }
+            if (!method || !target || target->empty()) {
+                reset(id, Error::protocol);
+                return;
+            }
+            if (is_file_route(*target)) {
+                reset(id, Error::http_1_1_required);
+                return;
+            }
+            stream.method = boost::beast::http::string_to_verb({method->data(), method->size()});
+            stream.target = *target;
+            if (JsonApi::takes_json(stream.method, stream.target)) {
+                stream.json.emplace();
+            }
+            if (end_stream) {
+                finish_request(id, stream);
+            }
+        }
+
+        bool on_header_block(std::uint32_t id, std::uint8_t flags, std::string_view block) {
+            // Decoded whatever becomes of the stream, to keep the table in step
+            std::vector<hpack::Header> headers;
+            if (!decoder_.decode(block, headers)) {
+                return fail(Error::compression);
+            }
+            if (auto it = streams_.find(id); it != streams_.end()) {
+                // Trailers, which end the request and are otherwise ignored
+                if (it->second.remote_closed || !(flags & kEndStream)) {
+                    reset(id, Error::protocol);
+                } else {
+                    finish_request(id, it->second);
+                }
+                return true;
+            }
+            if (id % 2 == 0 || id <= last_stream_) {
+                return fail(Error::protocol);
+            }
+            last_stream_ = id;
+            if (streams_.size() >= kMaxConcurrentStreams) {
+                frame_header(4, Frame::rst_stream, 0, id);
+                append32(out_, static_cast<std::uint32_t>(Error::refused_stream));
+                return true;
+            }
+            open_stream(id, std::move(headers), flags & kEndStream);
+            return true;
+        }
+
+        // Strips the padding of a DATA or HEADERS payload
+        static bool unpad(std::uint8_t flags, std::string_view& payload) {
+            if (!(flags & kPadded)) {
+                return true;
+            }
+            if (payload.empty() || std::uint8_t(payload[0]) >= payload.size()) {
+                return false;
+            }
+            std::size_t pad = std::uint8_t(payload[0]);
+            payload = payload.substr(1, payload.size() - 1 - pad);
+            return true;
+        }
+
+        bool on_data(std::uint8_t flags, std::uint32_t id, std::string_view payload) {
+            if (id == 0) {
+                return fail(Error::protocol);
+            }
+            // The whole frame, padding included, counts against the windows
+            auto length = static_cast<std::int64_t>(payload.size());
+            recv_window_ -= length;
+            if (recv_window_ < 0) {
+                return fail(Error::flow_control);
+            }
+            recv_consumed_ += length;
+            if (recv_consumed_ >= kWindow / 2) {
+                send_window_update(0, recv_consumed_);
+                recv_window_ += recv_consumed_;
+                recv_consumed_ = 0;
+            }
+            if (!unpad(flags, payload)) {
+                return fail(Error::protocol);
+            }
+
+            auto it = streams_.find(id);
+            if (it == streams_.end() || it->second.remote_closed) {
+                if (id > last_stream_) {
+                    return fail(Error::protocol);
+                }
+                if (it != streams_.end() && !it->second.responding) {
+                    reset(id, Error::stream_closed);
+                }
+                return true;
+            }
+            Stream& stream = it->second;
+            stream.recv_window -= length;
+            if (stream.recv_window < 0) {
+                reset(id, Error::flow_control);
+                return true;
+            }
+            stream.received += payload.size();
+            if (stream.received > kBodyLimit) {
+                // Answered at once; the rest of the body is dropped
+                respond_error(id, stream, JsonApi::Status::payload_too_large, "Request body too large");
+                return true;
+            }
+            if (stream.json && !stream.json_error) {
+                stream.json->write(payload.data(), payload.size(), stream.json_error);
+            }
+            if (flags & kEndStream) {
+                finish_request(id, stream);
+                return true;
+            }
+            stream.recv_consumed += length;
+            if (stream.recv_consumed >= kWindow / 2) {
+                send_window_update(id, stream.recv_consumed);
+                stream.recv_window += stream.recv_consumed;
+                stream.recv_consumed = 0;
+            }
+            return true;
+        }
+
+        // False on a connection error or GOAWAY, after which nothing more
+        // is read
+        bool on_frame(Frame type, std::uint8_t flags, std::uint32_t id, std::string_view payload) {
+            if (continuation_stream_ && (type != Frame::continuation || id != continuation_stream_)) {
+                return fail(Error::protocol);
+            }
+            switch (type) {
+                case Frame::data:
+                    return on_data(flags, id, payload);
+
+                case Frame::headers:
+                    if (id == 0 || !unpad(flags, payload)) {
+                        return fail(Error::protocol);
+                    }
+                    if (flags & kPriority) {
+                        if (payload.size() < 5) {
+                            return fail(Error::frame_size);
+                        }
+                        payload.remove_prefix(5);
+                    }
+                    if (!(flags & kEndHeaders)) {
+                        continuation_stream_ = id;
+                        continuation_flags_ = flags;
+                        header_block_.assign(payload);
+                        return true;
+                    }
+                    return on_header_block(id, flags, payload);
+
+                case Frame::continuation: {
+                    if (!continuation_stream_) {
+                        return fail(Error::protocol);
+                    }
+                    header_block_.append(payload);
+                    if (header_block_.size() > kMaxHeaderBlock) {
+                        return fail(Error::enhance_your_calm);
+                    }
+                    if (!(flags & kEndHeaders)) {
+                        return true;
+                    }
+                    continuation_stream_ = 0;
+                    std::string block = std::move(header_block_);
+                    header_block_.clear();
+                    return on_header_block(id, continuation_flags_, block);
+                }
+
+                case Frame::priority:
+                    if (id == 0) {
+                        return fail(Error::protocol);
+                    }
+                    if (payload.size() != 5) {
+                        reset(id, Error::frame_size);
+                    }
+                    return true;
+
+                case Frame::rst_stream:
+                    if (id == 0 || id > last_stream_) {
+                        return fail(Error::protocol);
+                    }
+                    if (payload.size() != 4) {
+                        return fail(Error::frame_size);
+                    }
+                    streams_.erase(id);
+                    return true;
+
+                case Frame::settings: {
+                    if (id != 0) {
+                        return fail(Error::protocol);
+                    }
+                    if (flags & kAck) {
+                        return payload.empty() || fail(Error::frame_size);
+                    }
+                    if (payload.size() % 6 != 0) {
+                        return fail(Error::frame_size);
+                    }
+                    if (Error error = apply_settings(payload); error != Error::none) {
+                        return fail(error);
+                    }
+                    frame_header(0, Frame::settings, kAck, 0);
+                    return true;
+                }
+
+                case Frame::push_promise:
+                    return fail(Error::protocol);
+
+                case Frame::ping:
+                    if (id != 0) {
+                        return fail(Error::protocol);
+                    }
+                    if (payload.size() != 8) {
+                        return fail(Error::frame_size);
+                    }
+                    if (!(flags & kAck)) {
+                        frame_header(8, Frame::ping, kAck, 0);
+                        out_.append(payload);
+                    }
+                    return true;
+
+                case Frame::goaway:
+                    // Responses already framed still go out
+                    closing_ = true;
+                    return false;
+
+                case Frame::window_update: {
+                    if (payload.size() != 4) {
+                        return fail(Error::frame_size);
+                    }
+                    std::int64_t increment = read32(payload) & 0x7fffffff;
+                    if (id == 0) {
+                        send_window_ += increment;
+                        if (increment == 0 || send_window_ > kMaxWindow) {
+                            return fail(increment ? Error::flow_control : Error::protocol);
+                        }
+                    } else if (auto it = streams_.find(id); it != streams_.end()) {
+                        it->second.send_window += increment;
+                        if (increment == 0 || it->second.send_window > kMaxWindow) {
+                            reset(id, increment ? Error::flow_control : Error::protocol);
+                        }
+                    }
+                    return true;
+                }
+
+                default:
+                    // Unknown frame types are ignored
+                    return true;
+            }
+        }
+
+        // Handles every complete frame in buffer_; false once no more are
+        // to be read
+        bool process() {
+            if (!preface_seen_) {
+                auto data = buffer_.data();
+                std::string_view received(static_cast<char const*>(data.data()), data.size());
+                if (!kHttp2Preface.starts_with(received.substr(0, kHttp2Preface.size()))) {
+                    closing_ = true;
+                    return false;
+                }
+                if (received.size() < kHttp2Preface.size()) {
+                    return true;
+                }
+                buffer_.consume(kHttp2Preface.size());
+                preface_seen_ = true;
+            }
+
+            for (;;) {
+                auto data = buffer_.data();
+                std::string_view received(static_cast<char const*>(data.data()), data.size());
+                if (received.size() < kFrameHeader) {
+                    return true;
+                }
+                std::size_t length = (std::size_t(std::uint8_t(received[0])) << 16)
+                                     | (std::size_t(std::uint8_t(received[1])) << 8) | std::uint8_t(received[2]);
+                if (length > kMaxFrameSize) {
+                    return fail(Error::frame_size);
+                }
+                if (received.size() < kFrameHeader + length) {
+                    return true;
+                }
+                auto type = static_cast<Frame>(received[3]);
+                auto flags = static_cast<std::uint8_t>(received[4]);
+                std::uint32_t id = read32(received.substr(5)) & 0x7fffffff;
+                bool more = on_frame(type, flags, id, received.substr(kFrameHeader, length));
+                buffer_.consume(kFrameHeader + length);
+                if (!more) {
+                    return false;
+                }
+            }
+        }
+
+        // Frames response bodies, a frame per stream in turn, as far as the
+        // flow control windows allow
+        void frame_bodies() {
+            bool progress = true;
+            while (progress && send_window_ > 0 && out_.size() < kOutputHigh) {
+                progress = false;
+                for (auto it = streams_.begin(); it != streams_.end() && send_window_ > 0;) {
+                    auto& [id, stream] = *it;
+                    if (!stream.responding || stream.send_window <= 0) {
+                        ++it;
+                        continue;
+                    }
+                    std::size_t size = std::min({stream.body.size() - stream.sent,
+                                                 static_cast<std::size_t>(stream.send_window),
+                                                 static_cast<std::size_t>(send_window_), peer_max_frame_});
+                    bool last = stream.sent + size == stream.body.size();
+                    frame_header(size, Frame::data, last ? kEndStream : 0, id);
+                    out_.append(stream.body, stream.sent, size);
+                    stream.sent += size;
+                    stream.send_window -= static_cast<std::int64_t>(size);
+                    send_window_ -= static_cast<std::int64_t>(size);
+                    progress = true;
+                    it = last ? streams_.erase(it) : std::next(it);
+                }
+            }
+        }
+
+        void flush() {
+            frame_bodies();
+            if (write_in_flight_) {
+                return;
+            }
+            if (out_.empty()) {
+                if (closing_) {
+                    boost::beast::error_code ec;
+                    boost::beast::get_lowest_layer(stream_).socket().shutdown(tcp::socket::shutdown_send, ec);
+                }
+                return;
+            }
+            writing_.swap(out_);
+            out_.clear();
+            write_in_flight_ = true;
+            auto self = this->shared_from_this();
+            boost::asio::async_write(stream_, boost::asio::buffer(writing_),
+                [self](boost::beast::error_code ec, std::size_t) {
+                    self->write_in_flight_ = false;
+                    if (ec) {
+                        return;
+                    }
+                    self->writing_.clear();
+                    self->flush();
+                    if (self->read_paused_ && self->out_.size() < kOutputHigh) {
+                        self->read_paused_ = false;
+                        self->read();
+                    }
+                });
+        }
+
+        void read() {
+            auto self = this->shared_from_this();
+            stream_.async_read_some(buffer_.prepare(kFrameHeader + kMaxFrameSize),
+                [self](boost::beast::error_code ec, std::size_t size) {
+                    if (ec) {
+                        self->closing_ = true;
+                        self->flush();
+                        return;
+                    }
+                    self->buffer_.commit(size);
+                    bool more = self->process();
+                    self->flush();
+                    // A peer that sends requests faster than it reads the
+                    // responses is read no further until it catches up
+                    if (more && self->out_.size() >= kOutputHigh) {
+                        self->read_paused_ = true;
+                    } else if (more) {
+                        self->read();
+                    }
+                });
+        }
+
+    public:
+        // buffer holds whatever was read past the HTTP/1.1 request, or the
+        // client preface and what followed it. Users created on the
+        // connection go to partition home.
+        Http2Session(Connection&& stream, boost::beast::flat_buffer&& buffer, UserPartitions& users, unsigned home,
+                     CoreSet* cores, CpuPool* pool)
+            : stream_(std::move(stream)), buffer_(std::move(buffer)), api_(users, home, pool), cores_(cores) {}
+
+        // With prior knowledge: the client preface is in the buffer
+        void start() {
+            send_settings();
+            bool more = process();
+            flush();
+            if (more) {
+                read();
+            }
+        }
+
+        // "Upgrade: h2c" on a request without a body, which becomes stream
+        // 1; settings is the decoded HTTP2-Settings header, which the 101
+        // response acknowledges
+        void start_upgraded(std::string_view method, std::string_view target,
+                            std::optional<std::string_view> if_match, std::string_view settings) {
+            out_ = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+            send_settings();
+            bool more = false;
+            if (Error error = apply_settings(settings); error != Error::none) {
+                fail(error);
+            } else {
+                std::vector<hpack::Header> headers{{":method", std::string(method)}, {":path", std::string(target)}};
+                if (if_match) {
+                    headers.push_back({"if-match", std::string(*if_match)});
+                }
+                last_stream_ = 1;
+                open_stream(1, std::move(headers), true);
+                more = process();
+            }
+            flush();
+            if (more) {
+                read();
+            }
+        }
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+struct ByteRange {
+    std::uint64_t first;
+    std::uint64_t length;
+};
+
+// Parses a Range header (RFC 7233) against a representation of size bytes.
+// Returns nullopt if the header is to be ignored: not a bytes range, bad
+// syntax, or more than max_ranges ranges. Otherwise returns the
+// satisfiable ranges in request order, which is empty if none are.
+inline std::optional<std::vector<ByteRange>> parse_byte_ranges(std::string_view header, std::uint64_t size,
+                                                               std::size_t max_ranges = 16) {
+    auto trim = [](std::string_view s) {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+            s.remove_prefix(1);
+        }
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+            s.remove_suffix(1);
+        }
+        return s;
+    };
+    auto number = [](std::string_view s, std::uint64_t& value) {
+        auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+        return !s.empty() && ec == std::errc() && end == s.data() + s.size();
+    };
+
+    header = trim(header);
+    if (!header.starts_with("bytes=")) {
+        return std::nullopt;
+    }
+    header.remove_prefix(6);
+
+    std::vector<ByteRange> ranges;
+    std::size_t count = 0;
+    while (!header.empty()) {
+        std::size_t comma = header.find(',');
+        std::string_view spec = trim(header.substr(0, comma));
+        header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+        if (spec.empty()) {
+            continue;
+        }
+        if (++count > max_ranges) {
+            return std::nullopt;
+        }
+
+        std::size_t dash = spec.find('-');
+        if (dash == std::string_view::npos) {
+            return std::nullopt;
+        }
+        std::string_view from = spec.substr(0, dash);
+        std::string_view to = spec.substr(dash + 1);
+        std::uint64_t first = 0;
+        std::uint64_t last = 0;
+
+        if (from.empty()) {
+            // "-n": the last n bytes
+            if (!number(to, last)) {
+                return std::nullopt;
+            }
+            if (last > 0 && size > 0) {
+                std::uint64_t length = std::min(last, size);
+                ranges.push_back({size - length, length});
+            }
+            continue;
+        }
+
+        if (!number(from, first) || (!to.empty() && (!number(to, last) || last < first))) {
+            return std::nullopt;
+        }
+        if (first >= size) {
+            continue;
+        }
+        last = to.empty() ? size - 1 : std::min(last, size - 1);
+        ranges.push_back({first, last - first + 1});
+    }
+    if (count == 0) {
+        return std::nullopt;
+    }
+    return ranges;
+}
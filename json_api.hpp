@@ -0,0 +1,376 @@
+#pragma once
+
+#include <boost/beast/http/status.hpp>
+#include <boost/beast/http/verb.hpp>
+#include <boost/json.hpp>
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "cpu_pool.hpp"
+#include "epoch.hpp"
+#include "user_partitions.hpp"
+#include "user_store.hpp"
+#include "write_pipeline.hpp"
+
+namespace json = boost::json;
+
+inline std::optional<std::uint64_t> parse_user_id(std::string_view id) {
+    std::uint64_t value = 0;
+    auto [end, ec] = std::from_chars(id.data(), id.data() + id.size(), value);
+    if (ec != std::errc() || end != id.data() + id.size()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+struct FileTarget {
+    std::uint64_t user;
+    std::string_view name;
+};
+
+// "/api/users/:id<collection>:name", collection being "/files/" or
+// "/uploads/"
+inline std::optional<FileTarget> parse_file_target(std::string_view target, std::string_view collection) {
+    if (!target.starts_with("/api/users/")) {
+        return std::nullopt;
+    }
+    target.remove_prefix(11);
+    std::size_t slash = target.find('/');
+    if (slash == std::string_view::npos || !target.substr(slash).starts_with(collection)) {
+        return std::nullopt;
+    }
+    auto id = parse_user_id(target.substr(0, slash));
+    if (!id) {
+        return std::nullopt;
+    }
+    return FileTarget{*id, target.substr(slash + collection.size())};
+}
+
+// Targets of the file and upload routes, which stream bodies and so are
+// served by HTTP/1.1 sessions only
+inline bool is_file_route(std::string_view target) {
+    return parse_file_target(target, "/files/") || parse_file_target(target, "/uploads/")
+           || target.starts_with("/api/uploads/");
+}
+
+// The JSON API over the user store, apart from the connection it is
+// served on: HTTP/1.1 sessions and HTTP/2 streams route through it alike
+// and each write the result in their own framing.
+class JsonApi {
+    public:
+        using Status = boost::beast::http::status;
+        using Verb = boost::beast::http::verb;
+
+        struct Request {
+            Verb method;
+            std::string_view target;
+            std::optional<std::string_view> if_match;
+            std::optional<json::value> const& body;  // Empty if missing or not valid JSON
+        };
+
+        struct Reply {
+            Status status = Status::ok;
+            std::string body;
+            std::optional<std::uint64_t> etag;  // Record version
+        };
+
+        // Common errors, answered with headers and body serialized once
+        enum class Canned {
+            none,
+            user_not_found,
+            endpoint_not_found,
+            invalid_json,
+            recovering,
+            count
+        };
+
+        struct CannedReply {
+            Status status = Status::not_found;
+            std::string body;
+            bool retry = false;  // Retry-After: 1
+        };
+
+    private:
+        UserPartitions& users_;
+        unsigned home_;  // Partition that users created here go to
+        CpuPool* pool_;  // Null to rebuild the list on the calling thread
+
+        static CannedReply canned_message(Canned canned) {
+            switch (canned) {
+                case Canned::user_not_found:
+                    return {Status::not_found, error_body("User not found")};
+                case Canned::endpoint_not_found:
+                    return {Status::not_found, error_body("Endpoint not found")};
+                case Canned::invalid_json:
+                    return {Status::bad_request, error_body("Invalid JSON")};
+                default:
+                    return {Status::service_unavailable, error_body("Recovery in progress"), true};
+            }
+        }
+
+        // If-Match: "<version>" requests a compare-and-swap against that
+        // version. "*" or no header means any current version; a tag that
+        // is not one of ours can never match.
+        static std::optional<std::uint64_t> expected_version(Request const& req) {
+            if (!req.if_match || *req.if_match == "*") {
+                return std::nullopt;
+            }
+
+            std::string_view tag = *req.if_match;
+            std::uint64_t version = 0;
+            if (tag.size() >= 2 && tag.front() == '"' && tag.back() == '"') {
+                auto [end, ec] = std::from_chars(tag.data() + 1, tag.data() + tag.size() - 1, version);
+                if (ec != std::errc() || end != tag.data() + tag.size() - 1) {
+                    version = 0;
+                }
+            }
+            return version;
+        }
+
+        void set_record(Reply& res, UserRecord const& record) {
+            res.etag = record.version;
+            res.body = users_.of(record.id).body_of(record);
+        }
+
+        Canned set_write_result(Reply& res, WriteResult const& result) {
+            switch (result.status) {
+                case WriteStatus::ok:
+                    if (result.record) {
+                        set_record(res, *result.record);
+                    } else {
+                        res.body = "{\"message\":\"User deleted\"}";
+                    }
+                    break;
+                case WriteStatus::not_found:
+                    return Canned::user_not_found;
+                case WriteStatus::precondition_failed:
+                    set_error(res, Status::precondition_failed, "Version mismatch");
+                    res.etag = result.record->version;
+                    break;
+            }
+            return Canned::none;
+        }
+
+        void handle_get_users(Reply& res) {
+            Epoch::Guard guard;
+            res.body = users_.list();
+        }
+
+        Canned handle_get_user(std::uint64_t id, Reply& res) {
+            Epoch::Guard guard;
+            if (UserRecord const* record = users_.of(id).find(id)) {
+                set_record(res, *record);
+                return Canned::none;
+            }
+            return Canned::user_not_found;
+        }
+
+        Canned handle_create_user(std::optional<json::value> const& jv, Reply& res) {
+            if (!jv) {
+                return Canned::invalid_json;
+            }
+            Epoch::Guard guard;
+            set_created(res, *users_.at(home_).create(jv->as_object()));
+            return Canned::none;
+        }
+
+        static void set_created(Reply& res, UserRecord const& record) {
+            res.status = Status::created;
+            res.etag = record.version;
+            res.body = "{\"message\":\"User created\",\"user\":" + record.body + "}";
+        }
+
+        Canned handle_replace_user(std::uint64_t id, Request const& req, Reply& res) {
+            if (!req.body) {
+                return Canned::invalid_json;
+            }
+            Epoch::Guard guard;
+            return set_write_result(res, users_.of(id).replace(id, req.body->as_object(), expected_version(req)));
+        }
+
+        Canned handle_patch_user(std::uint64_t id, Request const& req, Reply& res) {
+            if (!req.body) {
+                return Canned::invalid_json;
+            }
+            Epoch::Guard guard;
+            return set_write_result(res, users_.of(id).patch(id, *req.body, expected_version(req)));
+        }
+
+        Canned handle_delete_user(std::uint64_t id, Request const& req, Reply& res) {
+            Epoch::Guard guard;
+            return set_write_result(res, users_.of(id).erase(id, expected_version(req)));
+        }
+
+        Canned dispatch(Request const& req, Reply& res) {
+            Verb method = req.method;
+            std::string_view target = req.target;
+
+            // Only reads are served while startup recovery finishes
+            if (method != Verb::get && !users_.ready()) {
+                return Canned::recovering;
+            }
+            // GET /api/users - List all users
+            if (method == Verb::get && target == "/api/users") {
+                handle_get_users(res);
+                return Canned::none;
+            }
+            // POST /api/users - Create new user
+            if (method == Verb::post && target == "/api/users") {
+                return handle_create_user(req.body, res);
+            }
+            // /api/users/:id - Get, replace, patch or delete a specific user
+            if (target.starts_with("/api/users/")) {
+                auto id = user_of(target);
+
+                if (method != Verb::get && method != Verb::put && method != Verb::patch && method != Verb::delete_) {
+                    return Canned::endpoint_not_found;
+                } else if (!id) {
+                    return Canned::user_not_found;
+                } else if (method == Verb::get) {
+                    return handle_get_user(*id, res);
+                } else if (method == Verb::put) {
+                    return handle_replace_user(*id, req, res);
+                } else if (method == Verb::patch) {
+                    return handle_patch_user(*id, req, res);
+                } else {
+                    return handle_delete_user(*id, req, res);
+                }
+            }
+            // 404 Not Found
+            return Canned::endpoint_not_found;
+        }
+
+    public:
+        explicit JsonApi(UserPartitions& users, unsigned home = 0, CpuPool* pool = nullptr)
+            : users_(users), home_(home % users.size()), pool_(pool) {}
+
+        // The user a /api/users/:id target names
+        static std::optional<std::uint64_t> user_of(std::string_view target) {
+            if (!target.starts_with("/api/users/")) {
+                return std::nullopt;
+            }
+            return parse_user_id(target.substr(11));
+        }
+
+        // The partition a request creates in or serves a single user of, if
+        // any; with thread-per-core, the core owning it serves the request
+        std::optional<unsigned> partition_of(Verb method, std::string_view target) const {
+            if (method == Verb::post && target == "/api/users") {
+                return home_;
+            }
+            if (auto id = user_of(target)) {
+                return users_.partition_of(*id);
+            }
+            return std::nullopt;
+        }
+
+        // True for the routes that take a JSON body
+        static bool takes_json(Verb method, std::string_view target) {
+            return (method == Verb::post && target == "/api/users")
+                   || ((method == Verb::put || method == Verb::patch) && target.starts_with("/api/users/"));
+        }
+
+        static std::string error_body(std::string const& message) {
+            json::object error;
+            error["error"] = message;
+            return json::serialize(error);
+        }
+
+        static void set_error(Reply& res, Status status, std::string const& message) {
+            res.status = status;
+            res.body = error_body(message);
+        }
+
+        static CannedReply const& canned(Canned canned) {
+            static auto const table = [] {
+                std::array<CannedReply, std::size_t(Canned::count)> table;
+                for (std::size_t i = 1; i < table.size(); ++i) {
+                    table[i] = canned_message(Canned(i));
+                }
+                return table;
+            }();
+            return table[std::size_t(canned)];
+        }
+
+        // Hands work that should not run on the connection's thread to
+        // another thread and returns true; done(canned, reply) is called
+        // there once it is done. A list that needs rebuilding goes to the
+        // CPU pool, and a write the store will apply goes to the writer
+        // thread of its partition, taking body. Everything else is left to
+        // route, including writes that fail up front.
+        template <class Done>
+        bool defer(Verb method, std::string_view target, std::optional<std::string_view> if_match,
+                   std::optional<json::value>& body, Done done) {
+            if (method == Verb::get && target == "/api/users") {
+                if (!pool_ || users_.list_cached()) {
+                    return false;
+                }
+                users_.rebuild_list(*pool_, [this, done = std::move(done)]() mutable {
+                    std::optional<json::value> none;
+                    Reply res;
+                    Canned canned = route({Verb::get, "/api/users", std::nullopt, none}, res);
+                    done(canned, std::move(res));
+                });
+                return true;
+            }
+
+            using Kind = UserStore::Mutation::Kind;
+            auto id = user_of(target);
+            WritePipeline* writes = users_.writes(id ? users_.partition_of(*id) : home_);
+            if (!writes || !users_.ready()) {
+                return false;
+            }
+            UserStore::Mutation mutation;
+            if (method == Verb::post && target == "/api/users") {
+                mutation.kind = Kind::create;
+            } else if (id && method == Verb::put) {
+                mutation.kind = Kind::replace;
+            } else if (id && method == Verb::patch) {
+                mutation.kind = Kind::patch;
+            } else if (id && method == Verb::delete_) {
+                mutation.kind = Kind::erase;
+            } else {
+                return false;
+            }
+            mutation.id = id.value_or(0);
+            bool object = mutation.kind == Kind::create || mutation.kind == Kind::replace;
+            if (mutation.kind != Kind::erase && (!body || (object && !body->is_object()))) {
+                return false;
+            }
+            mutation.expected_version = expected_version({method, target, if_match, body});
+            if (mutation.kind != Kind::erase) {
+                mutation.body = std::move(*body);
+            }
+
+            writes->publish(std::move(mutation), [this, done = std::move(done)](UserStore::Mutation& written) mutable {
+                Reply res;
+                Canned canned = Canned::none;
+                if (!written.error.empty()) {
+                    set_error(res, Status::bad_request, written.error);
+                } else if (written.kind == Kind::create) {
+                    set_created(res, *written.result.record);
+                } else {
+                    canned = set_write_result(res, written.result);
+                }
+                done(canned, std::move(res));
+            });
+            return true;
+        }
+
+        // Fills res, or returns the canned response to send instead. A
+        // request the store rejects is answered 400 with the reason.
+        Canned route(Request const& req, Reply& res) {
+            try {
+                return dispatch(req, res);
+            } catch (std::exception const& e) {
+                set_error(res, Status::bad_request, e.what());
+                return Canned::none;
+            }
+        }
+};
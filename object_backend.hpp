@@ -0,0 +1,91 @@
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/system/error_code.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Durable home for file contents, keyed by the hex SHA-256 of the content.
+// FileStore keeps names and a local copy of every object to serve
+// downloads from; a backend receives each distinct content once, before
+// the upload that brought it is acknowledged.
+class ObjectBackend {
+    public:
+        using Handler = std::function<void(boost::system::error_code)>;
+
+        virtual ~ObjectBackend() = default;
+
+        // Stores the first size bytes of fd as key. done runs on the
+        // io_context; fd must stay open until then.
+        virtual void put(std::string const& key, int fd, std::uint64_t size, Handler done) = 0;
+};
+
+// Keeps objects in a directory, e.g. on a separate volume, as
+// <dir>/<xx>/<key>. Copies with copy_file_range, which filesystems that
+// support it turn into a reflink.
+class LocalBackend : public ObjectBackend {
+    private:
+        boost::asio::io_context& ioc_;
+        std::filesystem::path dir_;
+
+        boost::system::error_code copy(std::string const& key, int fd, std::uint64_t size) {
+            std::filesystem::path target = dir_ / key.substr(0, 2) / key;
+            if (std::filesystem::exists(target)) {
+                return {};
+            }
+            std::error_code ec;
+            std::filesystem::create_directories(target.parent_path(), ec);
+            std::filesystem::path temp = target;
+            temp += ".part";
+            int out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out < 0) {
+                return {errno, boost::system::generic_category()};
+            }
+
+            loff_t in_offset = 0;
+            while (static_cast<std::uint64_t>(in_offset) < size) {
+                ssize_t n = ::copy_file_range(fd, &in_offset, out, nullptr, size - in_offset, 0);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    boost::system::error_code error(n < 0 ? errno : EIO, boost::system::generic_category());
+                    ::close(out);
+                    ::unlink(temp.c_str());
+                    return error;
+                }
+            }
+            if (::fdatasync(out) != 0 || ::rename(temp.c_str(), target.c_str()) != 0) {
+                boost::system::error_code error(errno, boost::system::generic_category());
+                ::close(out);
+                ::unlink(temp.c_str());
+                return error;
+            }
+            ::close(out);
+            int dir = ::open(target.parent_path().c_str(), O_RDONLY | O_DIRECTORY);
+            if (dir >= 0) {
+                ::fsync(dir);
+                ::close(dir);
+            }
+            return {};
+        }
+
+    public:
+        LocalBackend(boost::asio::io_context& ioc, std::filesystem::path dir)
+            : ioc_(ioc), dir_(std::move(dir)) {
+            std::filesystem::create_directories(dir_);
+        }
+
+        void put(std::string const& key, int fd, std::uint64_t size, Handler done) override {
+            boost::asio::post(ioc_, [done = std::move(done), ec = copy(key, fd, size)] {
+                done(ec);
+            });
+        }
+};
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Request line and headers of an HTTP/1.x request, parsed in place: every
+// view points into the buffer that was parsed.
+struct RequestHead {
+    struct Header {
+        std::string_view name;
+        std::string_view value;  // Without surrounding whitespace
+    };
+    static constexpr std::size_t kMaxHeaders = 32;
+
+    std::string_view method;
+    std::string_view target;
+    unsigned version = 11;  // 10 or 11
+    std::array<Header, kMaxHeaders> headers;
+    std::size_t header_count = 0;
+    std::size_t size = 0;  // Bytes up to and including the blank line
+
+    // First header called name, compared case-insensitively
+    std::optional<std::string_view> find(std::string_view name) const {
+        for (std::size_t i = 0; i < header_count; ++i) {
+            std::string_view candidate = headers[i].name;
+            if (candidate.size() != name.size()) {
+                continue;
+            }
+            bool same = true;
+            for (std::size_t j = 0; j < name.size() && same; ++j) {
+                same = (candidate[j] | 0x20) == (name[j] | 0x20);
+            }
+            if (same) {
+                return headers[i].value;
+            }
+        }
+        return std::nullopt;
+    }
+};
+
+namespace request_head_detail {
+
+// RFC 9110 tchar
+inline bool is_token(unsigned char c) {
+    static constexpr auto table = [] {
+        std::array<bool, 256> table{};
+        for (int c = '0'; c <= '9'; ++c) {
+            table[c] = true;
+        }
+        for (int c = 'a'; c <= 'z'; ++c) {
+            table[c] = table[c - 'a' + 'A'] = true;
+        }
+        for (char c : std::string_view("!#$%&'*+-.^_`|~")) {
+            table[static_cast<unsigned char>(c)] = true;
+        }
+        return table;
+    }();
+    return table[c];
+}
+
+// Offset of the first byte of [p, p + n) that cannot continue a target
+// (control, space, DEL or non-ASCII) or, with value set, a header value
+// (control or DEL), else n. Sixteen bytes at a time with SSE2.
+inline std::size_t find_stop(char const* p, std::size_t n, bool value) {
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    __m128i const low = _mm_set1_epi8(value ? 0x1f : 0x20);
+    __m128i const del = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + i));
+        // Unsigned byte <= low, via max; DEL and above for targets via min
+        __m128i stop = _mm_cmpeq_epi8(_mm_max_epu8(block, low), low);
+        stop = _mm_or_si128(stop, value ? _mm_cmpeq_epi8(block, del)
+                                        : _mm_cmpeq_epi8(_mm_min_epu8(block, del), del));
+        if (int mask = _mm_movemask_epi8(stop)) {
+            return i + static_cast<std::size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        auto c = static_cast<unsigned char>(p[i]);
+        if (value ? (c < 0x20 || c == 0x7f) : (c <= 0x20 || c >= 0x7f)) {
+            return i;
+        }
+    }
+    return n;
+}
+
+}  // namespace request_head_detail
+
+// Parses the request line and headers at the start of data into head.
+// Returns false if they are incomplete or anything is out of the
+// ordinary: bare LF line ends, folded headers, more than kMaxHeaders
+// headers, versions other than 1.0 and 1.1, non-ASCII targets. Callers
+// hand those to a general-purpose parser, which this one does not try to
+// replace.
+inline bool parse_request_head(std::string_view data, RequestHead& head) {
+    using request_head_detail::find_stop;
+    using request_head_detail::is_token;
+
+    head.header_count = 0;
+    char const* p = data.data();
+    std::size_t n = data.size();
+    std::size_t i = 0;
+
+    // Method SP target SP HTTP/1.x CRLF
+    while (i < n && is_token(static_cast<unsigned char>(p[i]))) {
+        ++i;
+    }
+    if (i == 0 || i >= n || p[i] != ' ') {
+        return false;
+    }
+    head.method = data.substr(0, i);
+    std::size_t start = ++i;
+    i += find_stop(p + i, n - i, false);
+    if (i == start || i >= n || p[i] != ' ') {
+        return false;
+    }
+    head.target = data.substr(start, i - start);
+    ++i;
+    std::string_view version = data.substr(i, 10);
+    if (version == "HTTP/1.1\r\n") {
+        head.version = 11;
+    } else if (version == "HTTP/1.0\r\n") {
+        head.version = 10;
+    } else {
+        return false;
+    }
+    i += 10;
+
+    // Header lines up to an empty one
+    for (;;) {
+        if (i + 2 > n) {
+            return false;
+        }
+        if (p[i] == '\r') {
+            if (p[i + 1] != '\n') {
+                return false;
+            }
+            head.size = i + 2;
+            return true;
+        }
+        if (head.header_count == RequestHead::kMaxHeaders) {
+            return false;
+        }
+
+        start = i;
+        while (i < n && is_token(static_cast<unsigned char>(p[i]))) {
+            ++i;
+        }
+        if (i == start || i >= n || p[i] != ':') {
+            return false;
+        }
+        std::string_view name = data.substr(start, i - start);
+        ++i;
+        while (i < n && (p[i] == ' ' || p[i] == '\t')) {
+            ++i;
+        }
+        start = i;
+        for (;;) {
+            i += find_stop(p + i, n - i, true);
+            if (i >= n || p[i] != '\t') {
+                break;
+            }
+            ++i;
+        }
+        if (i + 2 > n || p[i] != '\r' || p[i + 1] != '\n') {
+            return false;
+        }
+        std::size_t end = i;
+        while (end > start && (p[end - 1] == ' ' || p[end - 1] == '\t')) {
+            --end;
+        }
+        head.headers[head.header_count++] = {name, data.substr(start, end - start)};
+        i += 2;
+    }
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <boost/beast/version.hpp>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <stdexcept>
+#include <string_view>
+
+// The headers every JSON response starts with: Server, Content-Type and
+// Date. Each thread keeps its own copy and reformats it, once, after each
+// tick(), which the server calls from a one-second timer; a response only
+// pays an atomic load to find out whether its thread's copy is current.
+class CommonHeaders {
+    private:
+        static inline std::atomic<std::uint64_t> generation_{0};
+
+        struct Block {
+            std::uint64_t generation = UINT64_MAX;
+            std::array<char, 128> text;
+            std::size_t size = 0;
+        };
+
+        static constexpr std::string_view kPrefix =
+            "Server: " BOOST_BEAST_VERSION_STRING "\r\nContent-Type: application/json\r\nDate: ";
+        static constexpr std::size_t kDateAt = kPrefix.size();
+
+        static Block const& current() {
+            thread_local Block block;
+            std::uint64_t generation = generation_.load(std::memory_order_relaxed);
+            if (block.generation != generation) {
+                static_assert(kDateAt + 32 < sizeof(block.text));
+                std::time_t now = std::time(nullptr);
+                std::tm tm;
+                ::gmtime_r(&now, &tm);
+                kPrefix.copy(block.text.data(), kDateAt);
+                std::size_t size = kDateAt;
+                size += std::strftime(block.text.data() + size, block.text.size() - size,
+                                      "%a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+                block.size = size;
+                block.generation = generation;
+            }
+            return block;
+        }
+
+    public:
+        static void tick() {
+            generation_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Valid until this thread reformats it after the next tick()
+        static std::string_view get() {
+            Block const& block = current();
+            return {block.text.data(), block.size};
+        }
+
+        // The value of the Date header alone
+        static std::string_view date() {
+            Block const& block = current();
+            return {block.text.data() + kDateAt, block.size - kDateAt - 2};
+        }
+};
+
+// Status line and headers of a response, built in a fixed buffer so that
+// writing them allocates nothing
+class ResponseHead {
+    private:
+        std::array<char, 512> data_;
+        std::size_t size_ = 0;
+
+    public:
+        // "HTTP/1.x <status> <reason>\r\n" followed by the common headers
+        void start(unsigned version, unsigned status, std::string_view reason) {
+            size_ = 0;
+            *this << (version == 10 ? "HTTP/1.0 " : "HTTP/1.1 ") << status << " " << reason << "\r\n"
+                  << CommonHeaders::get();
+        }
+
+        ResponseHead& operator<<(std::string_view text) {
+            if (text.size() > data_.size() - size_) {
+                throw std::length_error("Response headers too long");
+            }
+            text.copy(data_.data() + size_, text.size());
+            size_ += text.size();
+            return *this;
+        }
+
+        ResponseHead& operator<<(std::uint64_t value) {
+            char digits[20];
+            auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+            return *this << std::string_view(digits, static_cast<std::size_t>(end - digits));
+        }
+
+        std::string_view view() const {
+            return {data_.data(), size_};
+        }
+};
@@ -0,0 +1,421 @@
+#pragma once
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <openssl/hmac.h>
+#include <unistd.h>
+
+#include "content_hash.hpp"
+#include "object_backend.hpp"
+
+struct S3Options {
+    std::string host;
+    std::string port = "80";
+    std::string bucket;
+    std::string region = "us-east-1";
+    std::string access_key;
+    std::string secret_key;
+    std::string session_token;
+    std::string prefix = "objects/";
+    std::uint64_t part_size = 8 * 1024 * 1024;  // At least 5 MiB
+    unsigned parts_in_flight = 4;
+    unsigned max_attempts = 5;
+    std::chrono::milliseconds retry_delay{200};  // Doubled on each retry
+    std::chrono::seconds timeout{30};            // Per request
+};
+
+// Stores objects in an S3-compatible bucket, path-style over plain HTTP,
+// signed with AWS Signature Version 4.
+//
+// Objects up to part_size go up in one PUT. Larger ones use multipart
+// upload: parts_in_flight connections each read the next part from the
+// file into their own buffer and upload it, so at most parts_in_flight
+// parts are held in memory. Connection errors, 5xx and 429 replies are
+// retried with exponential backoff, reconnecting as needed; a multipart
+// upload that still fails is aborted so the bucket does not keep its
+// parts. Everything runs on the server's io_context, each upload on its
+// own strand.
+class S3Backend : public ObjectBackend {
+    private:
+        using error_code = boost::system::error_code;
+        using tcp = boost::asio::ip::tcp;
+        using Request = boost::beast::http::request<boost::beast::http::string_body>;
+        using Response = boost::beast::http::response<boost::beast::http::string_body>;
+
+        boost::asio::io_context& ioc_;
+        S3Options options_;
+        tcp::resolver::results_type endpoints_;
+        std::string host_header_;
+        std::string scope_;  // Region, service and terminator of the credential scope
+
+        static std::string hmac(std::string_view key, std::string_view data) {
+            unsigned char out[EVP_MAX_MD_SIZE];
+            unsigned size = 0;
+            HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+                 reinterpret_cast<unsigned char const*>(data.data()), data.size(), out, &size);
+            return std::string(reinterpret_cast<char*>(out), size);
+        }
+
+        static std::string sha256_hex(std::string_view data) {
+            Sha256 hash;
+            hash.update(data.data(), data.size());
+            return to_hex(hash.finish());
+        }
+
+        // RFC 3986 percent-encoding as SigV4 wants it
+        static std::string uri_encode(std::string_view s, bool keep_slash) {
+            static constexpr char kHex[] = "0123456789ABCDEF";
+            std::string out;
+            for (unsigned char c : s) {
+                bool unreserved = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')
+                                  || c == '-' || c == '_' || c == '.' || c == '~' || (keep_slash && c == '/');
+                if (unreserved) {
+                    out += static_cast<char>(c);
+                } else {
+                    out += '%';
+                    out += kHex[c >> 4];
+                    out += kHex[c & 15];
+                }
+            }
+            return out;
+        }
+
+        // Request for path?query, query already canonical: sorted and encoded
+        Request make_request(boost::beast::http::verb method, std::string const& key, std::string query) const {
+            std::string target = "/" + options_.bucket + "/" + uri_encode(options_.prefix + key, true);
+            if (!query.empty()) {
+                target += "?" + query;
+            }
+            Request req{method, target, 11};
+            req.keep_alive(true);
+            return req;
+        }
+
+        // Adds the SigV4 headers to req, whose target and body are final
+        void sign(Request& req) const {
+            std::time_t now = std::time(nullptr);
+            std::tm utc;
+            gmtime_r(&now, &utc);
+            char stamp[17];
+            std::strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &utc);
+            std::string_view date(stamp, 8);
+            std::string payload_hash = sha256_hex(req.body());
+
+            req.set(boost::beast::http::field::host, host_header_);
+            req.set("x-amz-date", stamp);
+            req.set("x-amz-content-sha256", payload_hash);
+            std::string canonical_headers = "host:" + host_header_ + "\nx-amz-content-sha256:" + payload_hash
+                                            + "\nx-amz-date:" + stamp + "\n";
+            std::string signed_headers = "host;x-amz-content-sha256;x-amz-date";
+            if (!options_.session_token.empty()) {
+                req.set("x-amz-security-token", options_.session_token);
+                canonical_headers += "x-amz-security-token:" + options_.session_token + "\n";
+                signed_headers += ";x-amz-security-token";
+            }
+
+            std::string_view target(req.target().data(), req.target().size());
+            std::size_t question = target.find('?');
+            std::string_view path = target.substr(0, question);
+            std::string_view query = question == std::string_view::npos ? std::string_view() : target.substr(question + 1);
+            std::string canonical = std::string(req.method_string()) + "\n" + std::string(path) + "\n"
+                                    + std::string(query) + "\n" + canonical_headers + "\n" + signed_headers + "\n"
+                                    + payload_hash;
+
+            std::string scope = std::string(date) + "/" + scope_;
+            std::string to_sign = "AWS4-HMAC-SHA256\n" + std::string(stamp) + "\n" + scope + "\n" + sha256_hex(canonical);
+            std::string key = hmac("AWS4" + options_.secret_key, date);
+            key = hmac(key, options_.region);
+            key = hmac(key, "s3");
+            key = hmac(key, "aws4_request");
+            std::string signature = hmac(key, to_sign);
+            Digest digest;
+            std::copy(signature.begin(), signature.end(), digest.begin());
+
+            req.set(boost::beast::http::field::authorization,
+                    "AWS4-HMAC-SHA256 Credential=" + options_.access_key + "/" + scope
+                    + ", SignedHeaders=" + signed_headers + ", Signature=" + to_hex(digest));
+            req.prepare_payload();
+        }
+
+        static std::string xml_value(std::string_view xml, std::string_view tag) {
+            std::string open = "<" + std::string(tag) + ">";
+            std::size_t start = xml.find(open);
+            if (start == std::string_view::npos) {
+                return {};
+            }
+            start += open.size();
+            std::size_t end = xml.find("</", start);
+            return end == std::string_view::npos ? std::string() : std::string(xml.substr(start, end - start));
+        }
+
+        // One connection of an upload, with its request and part buffer
+        struct Lane {
+            boost::beast::tcp_stream stream;
+            boost::beast::flat_buffer buffer;
+            Request req;
+            std::optional<boost::beast::http::response_parser<boost::beast::http::string_body>> parser;
+            boost::asio::steady_timer timer;
+            unsigned attempt = 0;
+            std::uint64_t part = 0;
+            std::function<void(error_code, Response&)> then;
+
+            explicit Lane(boost::asio::strand<boost::asio::io_context::executor_type> const& strand)
+                : stream(strand), timer(strand) {}
+        };
+
+        class Upload : public std::enable_shared_from_this<Upload> {
+            private:
+                S3Backend& backend_;
+                std::string key_;
+                int fd_;
+                std::uint64_t size_;
+                Handler done_;
+                std::uint64_t part_size_;
+                std::uint64_t parts_;
+                std::uint64_t next_part_ = 1;
+                std::string upload_id_;
+                std::vector<std::string> etags_;
+                std::vector<std::unique_ptr<Lane>> lanes_;
+                unsigned busy_ = 0;
+                error_code failure_;
+
+                // Sends lane.req, retrying transient failures, then calls
+                // lane.then with the reply
+                void exchange(Lane& lane, std::function<void(error_code, Response&)> then) {
+                    lane.attempt = 0;
+                    lane.then = std::move(then);
+                    send(lane);
+                }
+
+                void send(Lane& lane) {
+                    backend_.sign(lane.req);
+                    lane.stream.expires_after(backend_.options_.timeout);
+                    if (!lane.stream.socket().is_open()) {
+                        lane.stream.async_connect(backend_.endpoints_,
+                            [self = shared_from_this(), &lane](error_code ec, tcp::endpoint const&) {
+                                if (ec) {
+                                    self->retry(lane, ec);
+                                } else {
+                                    self->write(lane);
+                                }
+                            });
+                        return;
+                    }
+                    write(lane);
+                }
+
+                void write(Lane& lane) {
+                    boost::beast::http::async_write(lane.stream, lane.req,
+                        [self = shared_from_this(), &lane](error_code ec, std::size_t) {
+                            if (ec) {
+                                self->retry(lane, ec);
+                                return;
+                            }
+                            lane.parser.emplace();
+                            lane.parser->body_limit(1024 * 1024);
+                            boost::beast::http::async_read(lane.stream, lane.buffer, *lane.parser,
+                                [self, &lane](error_code ec, std::size_t) {
+                                    self->on_response(lane, ec);
+                                });
+                        });
+                }
+
+                void on_response(Lane& lane, error_code ec) {
+                    if (ec) {
+                        retry(lane, ec);
+                        return;
+                    }
+                    Response res = lane.parser->release();
+                    if (!res.keep_alive()) {
+                        lane.stream.close();
+                    }
+                    unsigned status = res.result_int();
+                    // CompleteMultipartUpload can fail after sending 200
+                    if (status >= 500 || status == 429 || res.body().find("<Error>") != std::string::npos) {
+                        retry(lane, boost::system::errc::make_error_code(boost::system::errc::io_error));
+                        return;
+                    }
+                    if (status >= 300) {
+                        ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+                    }
+                    auto then = std::move(lane.then);
+                    then(ec, res);
+                }
+
+                void retry(Lane& lane, error_code ec) {
+                    lane.stream.close();
+                    lane.buffer.clear();
+                    if (++lane.attempt >= backend_.options_.max_attempts) {
+                        Response none;
+                        auto then = std::move(lane.then);
+                        then(ec, none);
+                        return;
+                    }
+                    lane.timer.expires_after(backend_.options_.retry_delay * (1 << (lane.attempt - 1)));
+                    lane.timer.async_wait([self = shared_from_this(), &lane](error_code) {
+                        self->send(lane);
+                    });
+                }
+
+                // Reads size bytes at offset into lane's request body
+                error_code read_part(Lane& lane, std::uint64_t offset, std::uint64_t size) {
+                    std::string& body = lane.req.body();
+                    body.resize(size);
+                    for (std::uint64_t done = 0; done < size;) {
+                        ssize_t n = ::pread(fd_, body.data() + done, size - done, static_cast<off_t>(offset + done));
+                        if (n < 0 && errno == EINTR) {
+                            continue;
+                        }
+                        if (n <= 0) {
+                            return {n < 0 ? errno : EIO, boost::system::generic_category()};
+                        }
+                        done += static_cast<std::uint64_t>(n);
+                    }
+                    return {};
+                }
+
+                void put_single() {
+                    Lane& lane = *lanes_.front();
+                    lane.req = backend_.make_request(boost::beast::http::verb::put, key_, "");
+                    if (error_code ec = read_part(lane, 0, size_)) {
+                        done_(ec);
+                        return;
+                    }
+                    exchange(lane, [self = shared_from_this()](error_code ec, Response&) {
+                        self->done_(ec);
+                    });
+                }
+
+                void create_multipart() {
+                    Lane& lane = *lanes_.front();
+                    lane.req = backend_.make_request(boost::beast::http::verb::post, key_, "uploads=");
+                    exchange(lane, [self = shared_from_this()](error_code ec, Response& res) {
+                        self->upload_id_ = xml_value(res.body(), "UploadId");
+                        if (!ec && self->upload_id_.empty()) {
+                            ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+                        }
+                        if (ec) {
+                            self->done_(ec);
+                            return;
+                        }
+                        self->busy_ = static_cast<unsigned>(self->lanes_.size());
+                        for (auto& lane : self->lanes_) {
+                            self->next_part(*lane);
+                        }
+                    });
+                }
+
+                // Puts lane to work on the next part, or retires it
+                void next_part(Lane& lane) {
+                    if (failure_ || next_part_ > parts_) {
+                        lane.req.body() = std::string();
+                        if (--busy_ == 0) {
+                            finish_multipart();
+                        }
+                        return;
+                    }
+                    lane.part = next_part_++;
+                    std::uint64_t offset = (lane.part - 1) * part_size_;
+                    std::string query = "partNumber=" + std::to_string(lane.part) + "&uploadId=" + uri_encode(upload_id_, false);
+                    std::string buffer = std::move(lane.req.body());
+                    lane.req = backend_.make_request(boost::beast::http::verb::put, key_, std::move(query));
+                    lane.req.body() = std::move(buffer);
+                    if (error_code ec = read_part(lane, offset, std::min(part_size_, size_ - offset))) {
+                        failure_ = ec;
+                        next_part(lane);
+                        return;
+                    }
+                    exchange(lane, [self = shared_from_this(), &lane](error_code ec, Response& res) {
+                        auto etag = res.find(boost::beast::http::field::etag);
+                        if (!ec && etag == res.end()) {
+                            ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+                        }
+                        if (ec) {
+                            self->failure_ = ec;
+                        } else {
+                            self->etags_[lane.part - 1] = std::string(etag->value());
+                        }
+                        self->next_part(lane);
+                    });
+                }
+
+                void finish_multipart() {
+                    Lane& lane = *lanes_.front();
+                    std::string query = "uploadId=" + uri_encode(upload_id_, false);
+                    if (failure_) {
+                        lane.req = backend_.make_request(boost::beast::http::verb::delete_, key_, std::move(query));
+                        exchange(lane, [self = shared_from_this()](error_code, Response&) {
+                            self->done_(self->failure_);
+                        });
+                        return;
+                    }
+
+                    lane.req = backend_.make_request(boost::beast::http::verb::post, key_, std::move(query));
+                    std::string& body = lane.req.body();
+                    body = "<CompleteMultipartUpload>";
+                    for (std::size_t i = 0; i < etags_.size(); ++i) {
+                        body += "<Part><PartNumber>" + std::to_string(i + 1) + "</PartNumber><ETag>" + etags_[i] + "</ETag></Part>";
+                    }
+                    body += "</CompleteMultipartUpload>";
+                    exchange(lane, [self = shared_from_this()](error_code ec, Response&) {
+                        self->done_(ec);
+                    });
+                }
+
+            public:
+                Upload(S3Backend& backend, std::string key, int fd, std::uint64_t size, Handler done)
+                    : backend_(backend), key_(std::move(key)), fd_(fd), size_(size), done_(std::move(done)) {
+                    // S3 allows at most 10000 parts
+                    part_size_ = std::max(backend.options_.part_size, (size + 9999) / 10000);
+                    parts_ = std::max<std::uint64_t>(1, (size + part_size_ - 1) / part_size_);
+                    etags_.resize(parts_);
+                    auto strand = boost::asio::make_strand(backend.ioc_);
+                    unsigned lanes = parts_ == 1 ? 1 : static_cast<unsigned>(std::min<std::uint64_t>(backend.options_.parts_in_flight, parts_));
+                    for (unsigned i = 0; i < lanes; ++i) {
+                        lanes_.push_back(std::make_unique<Lane>(strand));
+                    }
+                }
+
+                void start() {
+                    boost::asio::dispatch(lanes_.front()->stream.get_executor(), [self = shared_from_this()] {
+                        if (self->parts_ == 1) {
+                            self->put_single();
+                        } else {
+                            self->create_multipart();
+                        }
+                    });
+                }
+        };
+
+    public:
+        // Resolves the endpoint once, up front
+        S3Backend(boost::asio::io_context& ioc, S3Options options)
+            : ioc_(ioc), options_(std::move(options)) {
+            options_.part_size = std::max<std::uint64_t>(options_.part_size, 5 * 1024 * 1024);
+            options_.parts_in_flight = std::max(1u, options_.parts_in_flight);
+            options_.max_attempts = std::max(1u, options_.max_attempts);
+            endpoints_ = tcp::resolver(ioc_).resolve(options_.host, options_.port);
+            host_header_ = options_.port == "80" ? options_.host : options_.host + ":" + options_.port;
+            scope_ = options_.region + "/s3/aws4_request";
+        }
+
+        void put(std::string const& key, int fd, std::uint64_t size, Handler done) override {
+            std::make_shared<Upload>(*this, key, fd, size, std::move(done))->start();
+        }
+};
@@ -0,0 +1,494 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "epoch.hpp"
+
+// Position of a record in the log: (segment << 32) | offset. Segment
+// numbers start at 1, so 0 means "not logged".
+using LogLocation = std::uint64_t;
+
+struct LogRecordHeader {
+    std::uint32_t checksum;  // FNV-1a over the rest of the header and the body
+    std::uint32_t length;    // Body bytes following the header
+    std::uint64_t id;
+    std::uint64_t version;
+    std::uint32_t flags;
+    std::uint32_t reserved;
+};
+
+static_assert(sizeof(LogRecordHeader) == 32);
+
+// Append-only log of user versions split into fixed-size segment files.
+//
+// Appends reserve space with a fetch_add on the active segment's tail and
+// then pwrite into it, so concurrent writers never wait on each other;
+// only rolling over to a new segment takes a lock. An append ends by
+// storing the record's location where the caller asked, and a segment is
+// settled once no append to it is still short of that. Every segment is
+// mapped read-only once, and reads return views straight into the mapping.
+//
+// Appended segments are named wal-N.seg. Compaction writes the surviving
+// records of old segments into snap-N.seg files, which are published with
+// a rename, and then drops the old segments. Replay does not depend on
+// segment order: the highest version of each id wins.
+class SegmentLog {
+    public:
+        static constexpr std::uint32_t kTombstone = 1;
+        static constexpr std::uint32_t kSegmentSize = 64u << 20;
+
+        struct SegmentStats {
+            std::uint32_t number;
+            std::uint64_t used;
+            std::int64_t live;
+            bool settled;  // No append to it is still in flight
+        };
+
+        // A compaction output segment being written under a temporary name
+        struct Output {
+            std::uint32_t number = 0;
+            std::string path;
+            int fd = -1;
+            std::uint64_t tail = 0;
+
+            ~Output() {
+                if (fd >= 0) {
+                    ::close(fd);
+                    ::unlink((path + ".tmp").c_str());
+                }
+            }
+        };
+
+    private:
+        static constexpr std::uint32_t kMaxSegments = 1 << 16;
+        static constexpr std::uint32_t kAlignment = 8;
+        static constexpr std::size_t kBatchRecords = 256;  // Three iovecs each, within IOV_MAX
+
+        struct Segment {
+            std::uint32_t number;
+            std::string path;
+            bool compacted = false;  // A snap- segment
+            int fd = -1;
+            char* map = nullptr;
+            std::atomic<std::uint64_t> tail{0};
+
+            // Appends that reserved space here and have not stored their
+            // location yet. One whose write failed stays counted, so the
+            // hole it left is never compacted away.
+            std::atomic<std::uint32_t> appending{0};
+
+            // Bytes of records that are still the current version of some id.
+            // Approximate: it only steers which segments get compacted.
+            std::atomic<std::int64_t> live{0};
+
+            ~Segment() {
+                if (map) {
+                    ::munmap(map, kSegmentSize);
+                }
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+        };
+
+        std::filesystem::path dir_;
+        std::unique_ptr<std::atomic<Segment*>[]> segments_{new std::atomic<Segment*>[kMaxSegments]()};
+        std::atomic<Segment*> active_{nullptr};
+        std::uint32_t next_segment_ = 1;
+        std::uint32_t recovered_end_ = 1;  // Segments below this predate startup
+        std::mutex roll_mutex_;
+
+        [[noreturn]] static void fail(std::string const& what) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+
+        static std::uint32_t checksum(LogRecordHeader const& header, std::string_view body) {
+            std::uint32_t h = 2166136261u;
+            auto mix = [&](void const* data, std::size_t size) {
+                auto const* bytes = static_cast<unsigned char const*>(data);
+                for (std::size_t i = 0; i < size; ++i) {
+                    h = (h ^ bytes[i]) * 16777619u;
+                }
+            };
+            mix(reinterpret_cast<char const*>(&header) + sizeof(header.checksum), sizeof(header) - sizeof(header.checksum));
+            mix(body.data(), body.size());
+            return h;
+        }
+
+        std::string segment_path(char const* prefix, std::uint32_t number) const {
+            char name[32];
+            std::snprintf(name, sizeof(name), "%s-%08u.seg", prefix, number);
+            return (dir_ / name).string();
+        }
+
+        // Parses "wal-N.seg" or "snap-N.seg"; 0 if name is neither
+        static std::uint32_t segment_number(std::string_view name) {
+            std::size_t prefix = name.starts_with("wal-") ? 4 : name.starts_with("snap-") ? 5 : 0;
+            std::uint32_t number = 0;
+            if (prefix == 0 || name.size() != prefix + 12 || !name.ends_with(".seg")) {
+                return 0;
+            }
+            auto [end, ec] = std::from_chars(name.data() + prefix, name.data() + prefix + 8, number);
+            return ec == std::errc() && end == name.data() + prefix + 8 && number < kMaxSegments ? number : 0;
+        }
+
+        static void sync_file(int fd, std::string const& path) {
+            if (::fdatasync(fd) != 0) {
+                fail("fdatasync " + path);
+            }
+        }
+
+        void sync_dir() const {
+            int fd = ::open(dir_.c_str(), O_RDONLY | O_DIRECTORY);
+            if (fd >= 0) {
+                ::fsync(fd);
+                ::close(fd);
+            }
+        }
+
+        Segment* open_segment(std::uint32_t number, std::string path, bool create) {
+            auto segment = std::make_unique<Segment>();
+            segment->number = number;
+            segment->path = std::move(path);
+            segment->fd = ::open(segment->path.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+            if (segment->fd < 0) {
+                fail("open " + segment->path);
+            }
+            if (create && ::ftruncate(segment->fd, kSegmentSize) != 0) {
+                fail("ftruncate " + segment->path);
+            }
+            void* map = ::mmap(nullptr, kSegmentSize, PROT_READ, MAP_SHARED, segment->fd, 0);
+            if (map == MAP_FAILED) {
+                fail("mmap " + segment->path);
+            }
+            segment->map = static_cast<char*>(map);
+
+            Segment* raw = segment.release();
+            segments_[number].store(raw, std::memory_order_release);
+            return raw;
+        }
+
+        std::uint32_t allocate_number() {
+            if (next_segment_ >= kMaxSegments) {
+                throw std::length_error("Segment log is full");
+            }
+            return next_segment_++;
+        }
+
+        // Replaces a full active segment, unless another writer already did
+        Segment* roll(Segment* full) {
+            std::lock_guard lock(roll_mutex_);
+            Segment* active = active_.load(std::memory_order_acquire);
+            if (active != full) {
+                return active;
+            }
+            std::uint32_t number = allocate_number();
+            Segment* fresh = open_segment(number, segment_path("wal", number), true);
+            active_.store(fresh, std::memory_order_release);
+            return fresh;
+        }
+
+        Segment* segment_at(LogLocation location) const {
+            return segments_[location >> 32].load(std::memory_order_acquire);
+        }
+
+        LogRecordHeader const& header_at(LogLocation location) const {
+            return *reinterpret_cast<LogRecordHeader const*>(segment_at(location)->map + std::uint32_t(location));
+        }
+
+    public:
+        // Opens every existing segment under dir; appends go to new segments.
+        // Compaction outputs that never got published are discarded.
+        explicit SegmentLog(std::filesystem::path dir)
+            : dir_(std::move(dir)) {
+            std::filesystem::create_directories(dir_);
+            for (auto const& entry : std::filesystem::directory_iterator(dir_)) {
+                std::string name = entry.path().filename().string();
+                if (name.ends_with(".seg.tmp")) {
+                    std::filesystem::remove(entry.path());
+                } else if (std::uint32_t number = segment_number(name)) {
+                    open_segment(number, entry.path().string(), false)->compacted = name.starts_with("snap-");
+                    next_segment_ = std::max(next_segment_, number + 1);
+                }
+            }
+            recovered_end_ = next_segment_;
+        }
+
+        ~SegmentLog() {
+            for (std::uint32_t i = 0; i < kMaxSegments; ++i) {
+                delete segments_[i].load();
+            }
+        }
+
+        SegmentLog(SegmentLog const&) = delete;
+        SegmentLog& operator=(SegmentLog const&) = delete;
+
+        static std::uint32_t record_size(std::size_t body) {
+            return static_cast<std::uint32_t>((sizeof(LogRecordHeader) + body + kAlignment - 1) & ~std::size_t(kAlignment - 1));
+        }
+
+        // Appends one record and stores its location in location
+        void append(std::uint64_t id, std::uint64_t version, std::uint32_t flags, std::string_view body,
+                    std::atomic<LogLocation>& location) {
+            if (body.size() > kSegmentSize - sizeof(LogRecordHeader)) {
+                throw std::length_error("Record too large for the segment log");
+            }
+
+            LogRecordHeader header{0, static_cast<std::uint32_t>(body.size()), id, version, flags, 0};
+            header.checksum = checksum(header, body);
+            std::uint32_t size = record_size(body.size());
+
+            Segment* segment = active_.load(std::memory_order_acquire);
+            for (;;) {
+                if (!segment) {
+                    segment = roll(nullptr);
+                }
+                segment->appending.fetch_add(1);
+                std::uint64_t offset = segment->tail.fetch_add(size);
+                if (offset + size <= kSegmentSize) {
+                    iovec parts[2] = {{&header, sizeof(header)}, {const_cast<char*>(body.data()), body.size()}};
+                    if (::pwritev(segment->fd, parts, 2, offset) != static_cast<ssize_t>(sizeof(header) + body.size())) {
+                        fail("write " + segment->path);
+                    }
+                    segment->live.fetch_add(size, std::memory_order_relaxed);
+                    location.store((LogLocation(segment->number) << 32) | offset, std::memory_order_release);
+                    segment->appending.fetch_sub(1);
+                    return;
+                }
+                segment->appending.fetch_sub(1);
+                segment = roll(segment);
+            }
+        }
+
+        // A record for append_batch
+        struct Append {
+            std::uint64_t id;
+            std::uint64_t version;
+            std::uint32_t flags;
+            std::string_view body;
+            std::atomic<LogLocation>* location;  // Where its location is stored
+        };
+
+        // Appends records back to back and stores each one's location. Each
+        // run of up to kBatchRecords records takes one reservation and one
+        // pwritev, so a batch of writes commits to the log together.
+        void append_batch(std::vector<Append> const& records) {
+            static constexpr char kPadding[kAlignment] = {};
+            std::vector<LogRecordHeader> headers(records.size());
+            for (std::size_t i = 0; i < records.size(); ++i) {
+                Append const& record = records[i];
+                if (record.body.size() > kSegmentSize - sizeof(LogRecordHeader)) {
+                    throw std::length_error("Record too large for the segment log");
+                }
+                headers[i] = {0, static_cast<std::uint32_t>(record.body.size()), record.id, record.version, record.flags, 0};
+                headers[i].checksum = checksum(headers[i], record.body);
+            }
+
+            std::vector<LogLocation> locations(records.size());
+            std::vector<iovec> parts;
+            Segment* segment = active_.load(std::memory_order_acquire);
+            for (std::size_t first = 0; first < records.size();) {
+                std::size_t last = first;
+                std::uint64_t size = 0;
+                while (last < records.size() && last - first < kBatchRecords
+                       && size + record_size(records[last].body.size()) <= kSegmentSize) {
+                    size += record_size(records[last++].body.size());
+                }
+
+                for (;;) {
+                    if (!segment) {
+                        segment = roll(nullptr);
+                    }
+                    segment->appending.fetch_add(1);
+                    std::uint64_t offset = segment->tail.fetch_add(size);
+                    if (offset + size > kSegmentSize) {
+                        segment->appending.fetch_sub(1);
+                        segment = roll(segment);
+                        continue;
+                    }
+                    // Padding is written too, so the run is one contiguous write
+                    parts.clear();
+                    for (std::size_t i = first, at = offset; i < last; ++i) {
+                        std::string_view body = records[i].body;
+                        std::size_t padding = record_size(body.size()) - sizeof(LogRecordHeader) - body.size();
+                        parts.push_back({&headers[i], sizeof(LogRecordHeader)});
+                        parts.push_back({const_cast<char*>(body.data()), body.size()});
+                        if (padding) {
+                            parts.push_back({const_cast<char*>(kPadding), padding});
+                        }
+                        locations[i] = (LogLocation(segment->number) << 32) | at;
+                        at += record_size(body.size());
+                    }
+                    if (::pwritev(segment->fd, parts.data(), static_cast<int>(parts.size()), offset)
+                        != static_cast<ssize_t>(size)) {
+                        fail("write " + segment->path);
+                    }
+                    segment->live.fetch_add(static_cast<std::int64_t>(size), std::memory_order_relaxed);
+                    for (std::size_t i = first; i < last; ++i) {
+                        records[i].location->store(locations[i], std::memory_order_release);
+                    }
+                    segment->appending.fetch_sub(1);
+                    break;
+                }
+                first = last;
+            }
+        }
+
+        // Body of the record at location. The view points into the segment
+        // mapping and is valid while the caller holds an Epoch::Guard.
+        std::string_view read(LogLocation location) const {
+            auto const* header = &header_at(location);
+            return {reinterpret_cast<char const*>(header + 1), header->length};
+        }
+
+        // Marks the record at location as superseded
+        void release(LogLocation location) {
+            if (Segment* segment = segment_at(location)) {
+                segment->live.fetch_sub(record_size(header_at(location).length), std::memory_order_relaxed);
+            }
+        }
+
+        // Calls f(header, body, location) for every intact record of one
+        // segment. The scan stops at the first torn or unused record.
+        template <class F>
+        std::uint64_t scan(std::uint32_t number, F f) const {
+            Segment const* segment = segments_[number].load(std::memory_order_acquire);
+            std::uint64_t end = std::min<std::uint64_t>(segment->tail.load(), kSegmentSize);
+            std::uint64_t offset = 0;
+            while (offset + sizeof(LogRecordHeader) <= end) {
+                auto const* header = reinterpret_cast<LogRecordHeader const*>(segment->map + offset);
+                if (header->id == 0 || header->length > end - offset - sizeof(LogRecordHeader)) {
+                    break;
+                }
+                std::string_view body(reinterpret_cast<char const*>(header + 1), header->length);
+                if (checksum(*header, body) != header->checksum) {
+                    break;
+                }
+                f(*header, body, (LogLocation(number) << 32) | offset);
+                offset += record_size(header->length);
+            }
+            return offset;
+        }
+
+        // Segments that were on disk at startup and have not been dropped:
+        // the compaction outputs, or the segments appends went to
+        std::vector<std::uint32_t> recovered_segments(bool compacted) const {
+            std::vector<std::uint32_t> numbers;
+            for (std::uint32_t number = 1; number < recovered_end_; ++number) {
+                Segment const* segment = segments_[number].load(std::memory_order_acquire);
+                if (segment && segment->compacted == compacted) {
+                    numbers.push_back(number);
+                }
+            }
+            return numbers;
+        }
+
+        // Replays one segment that was on disk at startup and establishes
+        // its tail. Every record starts out counted as live. Different
+        // segments may be replayed concurrently.
+        template <class F>
+        void replay(std::uint32_t number, F f) {
+            Segment* segment = segments_[number].load(std::memory_order_acquire);
+            segment->tail.store(kSegmentSize);
+            std::uint64_t end = scan(number, f);
+            segment->tail.store(end);
+            segment->live.fetch_add(static_cast<std::int64_t>(end));
+        }
+
+        // Every segment except the one appends currently go to. A segment
+        // that is no longer active only takes reservations past its end, so
+        // once it is settled it stays settled.
+        std::vector<SegmentStats> sealed_segments() const {
+            std::vector<SegmentStats> stats;
+            Segment const* active = active_.load(std::memory_order_acquire);
+            for (std::uint32_t number = 1; number < kMaxSegments; ++number) {
+                Segment const* segment = segments_[number].load(std::memory_order_acquire);
+                if (segment && segment != active) {
+                    stats.push_back({number, std::min<std::uint64_t>(segment->tail.load(), kSegmentSize),
+                                     segment->live.load(std::memory_order_relaxed), segment->appending.load() == 0});
+                }
+            }
+            return stats;
+        }
+
+        std::unique_ptr<Output> begin_output() {
+            auto output = std::make_unique<Output>();
+            {
+                std::lock_guard lock(roll_mutex_);
+                output->number = allocate_number();
+            }
+            output->path = segment_path("snap", output->number);
+            output->fd = ::open((output->path + ".tmp").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (output->fd < 0) {
+                fail("open " + output->path + ".tmp");
+            }
+            return output;
+        }
+
+        // Copies a record into output; 0 if the output segment is full
+        LogLocation write(Output& output, LogRecordHeader const& header, std::string_view body) {
+            std::uint32_t size = record_size(body.size());
+            if (output.tail + size > kSegmentSize) {
+                return 0;
+            }
+            iovec parts[2] = {{const_cast<LogRecordHeader*>(&header), sizeof(header)},
+                              {const_cast<char*>(body.data()), body.size()}};
+            if (::pwritev(output.fd, parts, 2, output.tail) != static_cast<ssize_t>(sizeof(header) + body.size())) {
+                fail("write " + output.path);
+            }
+            LogLocation location = (LogLocation(output.number) << 32) | output.tail;
+            output.tail += size;
+            return location;
+        }
+
+        // Makes the output durable and atomically renames it into place.
+        // Locations returned by write() become readable from here on.
+        void commit(Output& output) {
+            std::string tmp = output.path + ".tmp";
+            if (::ftruncate(output.fd, kSegmentSize) != 0) {
+                fail("ftruncate " + tmp);
+            }
+            sync_file(output.fd, tmp);
+            if (::rename(tmp.c_str(), output.path.c_str()) != 0) {
+                fail("rename " + tmp);
+            }
+            sync_dir();
+            ::close(output.fd);
+            output.fd = -1;
+
+            Segment* segment = open_segment(output.number, output.path, false);
+            segment->compacted = true;
+            segment->tail.store(output.tail);
+            segment->live.store(static_cast<std::int64_t>(output.tail));
+        }
+
+        // Deletes a sealed segment. No reader may still hold a location in
+        // it (see Epoch::barrier).
+        void drop(std::uint32_t number) {
+            Segment* segment = segments_[number].exchange(nullptr, std::memory_order_acq_rel);
+            if (segment) {
+                ::unlink(segment->path.c_str());
+                delete segment;
+                sync_dir();
+            }
+        }
+};
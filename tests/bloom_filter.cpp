@@ -0,0 +1,123 @@
+// The split-block BloomFilter: every id added must be reported as maybe
+// present, through each time the table doubles and while readers look ids
+// up during growth, and ids never added must come back absent at about
+// the rate the header claims.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bloom_filter.hpp"
+#include "epoch.hpp"
+
+namespace {
+
+constexpr std::uint64_t kIds = 200000;  // Grows the 512 id table many times
+
+bool failed = false;
+
+void check(bool ok, std::string const& what) {
+    if (!ok && !failed) {
+        failed = true;
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+// Adds id, handing the filter every id added before it if it grows
+void add(BloomFilter& filter, std::vector<std::uint64_t>& ids, std::uint64_t id) {
+    filter.add(id, [&](auto add) {
+        for (std::uint64_t key : ids) {
+            add(key);
+        }
+    });
+    ids.push_back(id);
+}
+
+}  // namespace
+
+int main() {
+    {
+        BloomFilter filter;
+        Epoch::Guard guard;
+        check(!filter.may_contain(1) && !filter.may_contain(0), "an empty filter");
+    }
+
+    // No false negatives, checked as each id goes in and again at the end
+    {
+        BloomFilter filter;
+        std::vector<std::uint64_t> ids;
+        for (std::uint64_t id = 1; id <= kIds; ++id) {
+            add(filter, ids, id);
+            Epoch::Guard guard;
+            if (!filter.may_contain(id) || !filter.may_contain(ids[id / 2])) {
+                check(false, "id " + std::to_string(id) + " added and missing");
+                break;
+            }
+        }
+        Epoch::Guard guard;
+        for (std::uint64_t id : ids) {
+            if (!filter.may_contain(id)) {
+                check(false, "id " + std::to_string(id) + " missing at the end");
+                break;
+            }
+        }
+    }
+
+    // False positives among ids never added: the table runs at 16 to 32
+    // bits per id, so well under 0.1% even at its fullest
+    {
+        BloomFilter filter;
+        std::vector<std::uint64_t> ids;
+        for (std::uint64_t id = 1; id <= 2 * kIds; id += 2) {
+            add(filter, ids, id);
+        }
+        Epoch::Guard guard;
+        std::uint64_t positives = 0;
+        for (std::uint64_t id = 2; id <= 2 * kIds; id += 2) {
+            positives += filter.may_contain(id);
+        }
+        check(positives * 1000 < kIds, "false positive rate " + std::to_string(positives) + " in " +
+                                           std::to_string(kIds));
+    }
+
+    // Readers never miss an id that was added before they looked, while
+    // the writer grows and retires tables under them
+    {
+        BloomFilter filter;
+        std::atomic<std::uint64_t> added{0};
+        std::atomic<bool> missed{false};
+        std::vector<std::thread> readers;
+        for (int r = 0; r < 3; ++r) {
+            readers.emplace_back([&, r] {
+                std::uint64_t probe = r + 1;
+                while (added.load() < kIds) {
+                    Epoch::Guard guard;
+                    std::uint64_t high = added.load(std::memory_order_acquire);
+                    if (high && !filter.may_contain(probe % high + 1)) {
+                        missed = true;
+                    }
+                    probe = probe * 6364136223846793005ULL + 1442695040888963407ULL;
+                }
+            });
+        }
+        std::vector<std::uint64_t> ids;
+        for (std::uint64_t id = 1; id <= kIds; ++id) {
+            add(filter, ids, id);
+            added.store(id, std::memory_order_release);
+        }
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        check(!missed, "a reader missed an added id during growth");
+    }
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+// SHA-256 against known digests, and Content-Digest headers: the sha-256
+// member must be found by its key among other algorithms and parameters,
+// and anything malformed must come back as no digest at all.
+
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "content_hash.hpp"
+
+namespace {
+
+// SHA-256 of "abc" and of nothing, in hex and in base64
+constexpr std::string_view kAbcHex = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+constexpr std::string_view kAbc = "ungWv48Bz+pBQUDeXa4iI7ADYaOWF3qctBD/YfIAFa0=";
+constexpr std::string_view kEmptyHex = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+constexpr std::string_view kEmpty = "47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=";
+constexpr std::string_view kSha512 =
+    "3a81oZNherrMQXNJriBBMRLm+k6JqX6iCp7u5ktV05ohkpkqJ0/BqDa6PCOj/uu9RU1EI2Q86A4qmslPpUyknw==";
+
+bool failed = false;
+
+void check(bool ok, std::string const& what) {
+    if (!ok && !failed) {
+        failed = true;
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+std::string sha256(std::string_view data) {
+    Sha256 hash;
+    hash.update(data.data(), data.size());
+    return to_hex(hash.finish());
+}
+
+// The hex of the header's sha-256 digest, or "none"
+std::string parsed(std::string const& header) {
+    std::optional<Digest> digest = parse_content_digest(header);
+    return digest ? to_hex(*digest) : "none";
+}
+
+std::string member(std::string_view key, std::string_view base64) {
+    return std::string(key) + "=:" + std::string(base64) + ":";
+}
+
+}  // namespace
+
+int main() {
+    check(sha256("abc") == kAbcHex, "SHA-256 of abc");
+    check(sha256("") == kEmptyHex, "SHA-256 of nothing");
+    {
+        Sha256 hash;
+        hash.update("a", 1);
+        hash.update("bc", 2);
+        check(to_hex(hash.finish()) == kAbcHex, "SHA-256 of abc in two updates");
+    }
+
+    std::string abc = member("sha-256", kAbc);
+    std::string empty = member("sha-256", kEmpty);
+    std::string sha512 = member("sha-512", kSha512);
+
+    // Well formed
+    check(parsed(abc) == kAbcHex, "a lone sha-256 member");
+    check(parsed(sha512 + ", " + abc) == kAbcHex, "sha-256 after sha-512");
+    check(parsed(abc + ",sha-512=:" + std::string(kSha512) + ":") == kAbcHex, "sha-256 before sha-512");
+    check(parsed(" \t" + abc + " \t") == kAbcHex, "whitespace around a member");
+    check(parsed(abc + ";note=1, " + sha512) == kAbcHex, "parameters are ignored");
+    check(parsed(empty + ", " + abc) == kAbcHex, "the last of a repeated key wins");
+
+    // No sha-256 member
+    check(parsed("") == "none", "an empty header");
+    check(parsed(sha512) == "none", "only sha-512");
+    check(parsed("unixsum=:" + std::string(kAbc) + ":") == "none", "another algorithm");
+
+    // The key must match exactly, not appear anywhere
+    check(parsed(member("x-sha-256", kAbc)) == "none", "a key ending in sha-256");
+    check(parsed(member("sha-256x", kAbc)) == "none", "a key starting with sha-256");
+    check(parsed(member("SHA-256", kAbc)) == "none", "an upper case key");
+    check(parsed("note=\"sha-256=:" + std::string(kAbc) + ":\"") == "none", "sha-256 inside another member");
+
+    // Malformed values
+    check(parsed("sha-256=" + std::string(kAbc)) == "none", "no colons");
+    check(parsed("sha-256=:" + std::string(kAbc)) == "none", "no closing colon");
+    check(parsed("sha-256=:" + std::string(kAbc.substr(0, 40)) + ":") == "none", "a short digest");
+    check(parsed("sha-256=:" + std::string(kSha512) + ":") == "none", "a sha-512 sized digest");
+    check(parsed("sha-256=:" + std::string(kAbc.substr(0, 43)) + "!:") == "none", "a character outside base64");
+    check(parsed("sha-256=:" + std::string(kAbc.substr(0, 42)) + "==:") == "none", "too much padding");
+    check(parsed("sha-256 =:" + std::string(kAbc) + ":") == "none", "a space before =");
+    check(parsed(abc + ", sha-256=:bad:") == "none", "a malformed repeat overrides");
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+// The work-stealing CpuPool: tasks posted from outside and from workers,
+// some fanning out into more, must each run exactly once, tasks a worker
+// queues for itself must be stolen by the others while it is busy, and
+// workers with nothing to do must sleep rather than spin.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpu_pool.hpp"
+
+namespace {
+
+constexpr unsigned kWorkers = 4;
+constexpr unsigned kOutside = 2000;  // Each fans out into kFanOut more
+constexpr unsigned kFanOut = 4;
+
+bool failed = false;
+
+void check(bool ok, std::string const& what) {
+    if (!ok && !failed) {
+        failed = true;
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+// Waits up to a few seconds for count to reach expected
+bool reaches(std::atomic<unsigned> const& count, unsigned expected) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (count.load() < expected && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return count.load() == expected;
+}
+
+void every_task_runs_once() {
+    CpuPool pool(kWorkers);
+    std::vector<std::atomic<unsigned>> runs(kOutside * (1 + kFanOut));
+    std::atomic<unsigned> done{0};
+
+    std::vector<std::thread> posters;
+    for (unsigned t = 0; t < 2; ++t) {
+        posters.emplace_back([&, t] {
+            for (unsigned i = t; i < kOutside; i += 2) {
+                pool.post([&, i] {
+                    runs[i]++;
+                    done++;
+                    for (unsigned k = 1; k <= kFanOut; ++k) {
+                        pool.post([&, n = i * kFanOut + k + kOutside - 1] {
+                            runs[n]++;
+                            done++;
+                        });
+                    }
+                });
+            }
+        });
+    }
+    for (auto& poster : posters) {
+        poster.join();
+    }
+
+    check(reaches(done, static_cast<unsigned>(runs.size())), "every task runs");
+    for (auto const& count : runs) {
+        check(count.load() == 1, "a task runs exactly once");
+    }
+}
+
+void workers_steal() {
+    CpuPool pool(kWorkers);
+    std::mutex mutex;
+    std::set<std::thread::id> threads;
+    std::atomic<unsigned> done{0};
+    constexpr unsigned kTasks = 64;
+
+    // One task queues the rest on its own deque and stays busy, so only
+    // stealing gets them run before it returns
+    std::atomic<bool> release{false};
+    pool.post([&] {
+        for (unsigned i = 0; i < kTasks; ++i) {
+            pool.post([&] {
+                {
+                    std::lock_guard lock(mutex);
+                    threads.insert(std::this_thread::get_id());
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                done++;
+            });
+        }
+        while (!release.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    check(reaches(done, kTasks), "stolen tasks run while their poster is busy");
+    release = true;
+    check(threads.size() > 1, "several workers steal");
+}
+
+void idle_workers_sleep() {
+    CpuPool pool(kWorkers);
+    std::atomic<unsigned> done{0};
+    for (unsigned i = 0; i < 100; ++i) {
+        pool.post([&] {
+            done++;
+        });
+    }
+    check(reaches(done, 100), "tasks run before idling");
+
+    std::clock_t before = std::clock();
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    double busy = double(std::clock() - before) / CLOCKS_PER_SEC;
+    std::cout << "idle: " << busy * 1000 << " ms of CPU in 300 ms" << std::endl;
+    check(busy < 0.05, "idle workers sleep");
+}
+
+}  // namespace
+
+int main() {
+    every_task_runs_once();
+    workers_steal();
+    idle_workers_sleep();
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+// Many more writes at once than the ring's submission queue holds, then a
+// write to a closed descriptor. Every handler must run exactly once, the
+// writes must all land, and the bad one must fail rather than vanish.
+
+#include <boost/asio/io_context.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "disk_io.hpp"
+
+namespace {
+
+constexpr unsigned kWrites = 4096;  // The queue has 256 entries by default
+constexpr std::size_t kBlock = 4096;
+
+bool failed = false;
+
+void check(bool ok, std::string const& what) {
+    if (!ok && !failed) {
+        failed = true;
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+}  // namespace
+
+int main() {
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "disk_io_test";
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "FAIL: open " << path << ": " << std::strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Block i is filled with the byte i % 251
+    std::vector<char> source(kWrites * kBlock);
+    for (unsigned i = 0; i < kWrites; ++i) {
+        std::memset(source.data() + i * kBlock, static_cast<int>(i % 251), kBlock);
+    }
+
+    boost::asio::io_context ioc;
+    {
+        DiskIo io(ioc, DiskIoOptions{});
+        std::cout << (io.uring() ? "io_uring" : "blocking fallback") << std::endl;
+
+        unsigned done = 0;
+        unsigned errors = 0;
+        for (unsigned i = 0; i < kWrites; ++i) {
+            DiskIo::Buffer buffer{source.data() + i * kBlock, DiskIo::kUnregistered};
+            io.write(ioc.get_executor(), fd, buffer, kBlock, i * kBlock,
+                     [&](boost::system::error_code ec, std::size_t size) {
+                         ++done;
+                         if (ec || size != kBlock) {
+                             ++errors;
+                         }
+                     });
+        }
+
+        int closed = ::dup(fd);
+        ::close(closed);
+        bool bad_done = false;
+        boost::system::error_code bad_error;
+        io.write(ioc.get_executor(), closed, DiskIo::Buffer{source.data(), DiskIo::kUnregistered}, kBlock, 0,
+                 [&](boost::system::error_code ec, std::size_t) {
+                     bad_done = true;
+                     bad_error = ec;
+                 });
+
+        while (done < kWrites || !bad_done) {
+            if (ioc.run_one() == 0) {
+                break;
+            }
+        }
+        check(done == kWrites, "every write completes");
+        check(errors == 0, "every write succeeds in full");
+        check(bad_done && bad_error, "a write to a closed descriptor fails");
+    }
+
+    std::vector<char> copy(source.size());
+    check(::pread(fd, copy.data(), copy.size(), 0) == static_cast<ssize_t>(copy.size()), "read back");
+    check(copy == source, "the file holds every write");
+    ::close(fd);
+    std::filesystem::remove(path);
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
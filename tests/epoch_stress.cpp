@@ -0,0 +1,158 @@
+// Readers following epoch-protected pointers while writers swap and retire
+// them. Best built with SANITIZE=thread or SANITIZE=address, which report a
+// read of a freed object that the canary check below could miss.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "epoch.hpp"
+#include "user_store.hpp"
+
+namespace {
+
+constexpr std::uint64_t kAlive = 0x600dcafe;
+constexpr std::uint64_t kFreed = 0xdeadbeef;
+constexpr int kSlots = 64;
+
+std::atomic<long> freed{0};
+std::atomic<bool> failed{false};
+
+struct Node {
+    std::uint64_t canary = kAlive;
+    std::uint64_t value;
+
+    explicit Node(std::uint64_t value) : value(value) {}
+
+    ~Node() {
+        canary = kFreed;
+        freed.fetch_add(1);
+    }
+};
+
+void check(bool ok, char const* what) {
+    if (!ok && !failed.exchange(true)) {
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+// Raw Epoch: no reader sees a node after it was freed
+long stress_epoch(unsigned readers, unsigned writers, std::chrono::milliseconds duration) {
+    std::vector<std::atomic<Node*>> slots(kSlots);
+    for (auto& slot : slots) {
+        slot.store(new Node(0));
+    }
+    std::atomic<bool> stop{false};
+    std::atomic<long> retired{0};
+    std::vector<std::thread> threads;
+
+    for (unsigned r = 0; r < readers; ++r) {
+        threads.emplace_back([&, r] {
+            for (std::uint64_t i = r; !stop.load(std::memory_order_relaxed); ++i) {
+                Epoch::Guard guard;
+                Node const* node = slots[i % kSlots].load(std::memory_order_acquire);
+                Epoch::Guard nested;
+                check(node->canary == kAlive, "reader saw a freed node");
+            }
+        });
+    }
+    for (unsigned w = 0; w < writers; ++w) {
+        threads.emplace_back([&, w] {
+            for (std::uint64_t i = w; !stop.load(std::memory_order_relaxed); ++i) {
+                Node* old;
+                {
+                    Epoch::Guard guard;
+                    old = slots[i % kSlots].exchange(new Node(i), std::memory_order_acq_rel);
+                    Epoch::retire(old);
+                }
+                retired.fetch_add(1);
+            }
+            Epoch::collect();
+        });
+    }
+
+    std::this_thread::sleep_for(duration);
+    stop.store(true);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (auto& slot : slots) {
+        delete slot.load();
+    }
+    return retired.load();
+}
+
+// The same through the store: reads, replaces and list rebuilds at once
+void stress_store(unsigned readers, unsigned writers, std::chrono::milliseconds duration) {
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "user_store_epoch_stress";
+    std::filesystem::remove_all(dir);
+    {
+        StoreOptions options;
+        options.data_dir = dir;
+        UserStore store(options);
+        std::vector<std::uint64_t> ids;
+        for (int i = 0; i < kSlots; ++i) {
+            Epoch::Guard guard;
+            ids.push_back(store.create({{"name", "user"}, {"n", i}})->id);
+        }
+
+        std::atomic<bool> stop{false};
+        std::vector<std::thread> threads;
+        for (unsigned r = 0; r < readers; ++r) {
+            threads.emplace_back([&, r] {
+                for (std::uint64_t i = r; !stop.load(std::memory_order_relaxed); ++i) {
+                    Epoch::Guard guard;
+                    if (i % 64 == 0) {
+                        check(store.list().starts_with("{\"users\":["), "list body");
+                        continue;
+                    }
+                    UserRecord const* record = store.find(ids[i % ids.size()]);
+                    check(record && record->body.find("\"name\"") != std::string::npos, "record body");
+                }
+            });
+        }
+        for (unsigned w = 0; w < writers; ++w) {
+            threads.emplace_back([&, w] {
+                for (std::uint64_t i = w; !stop.load(std::memory_order_relaxed); ++i) {
+                    Epoch::Guard guard;
+                    WriteResult result = store.replace(ids[i % ids.size()], {{"name", "user"}, {"n", i}}, std::nullopt);
+                    check(result.status == WriteStatus::ok, "replace");
+                }
+            });
+        }
+
+        std::this_thread::sleep_for(duration);
+        stop.store(true);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    std::filesystem::remove_all(dir);
+}
+
+}  // namespace
+
+int main() {
+    using namespace std::chrono_literals;
+
+    long retired = stress_epoch(4, 2, 1s);
+    Epoch::collect();
+    Epoch::barrier();
+    Epoch::collect();
+    std::cout << "epoch: " << retired << " retired, " << freed.load() - kSlots << " freed" << std::endl;
+    check(freed.load() > kSlots, "nothing was freed");
+
+    stress_store(4, 2, 1s);
+    std::cout << "store: done" << std::endl;
+
+    if (failed.load()) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
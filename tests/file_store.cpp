@@ -0,0 +1,158 @@
+// Content-addressed file storage: a second upload of the same content must
+// link to the one object instead of storing another, replacing a file must
+// drop the object it referenced once nothing else does, quotas must count
+// stored and reserved bytes, and reopening the store must rebuild the
+// counts and sweep what a crash leaves behind.
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_store.hpp"
+
+namespace {
+
+bool failed = false;
+
+void check(bool ok, std::string const& what) {
+    if (!ok && !failed) {
+        failed = true;
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+Digest digest_of(std::string const& content) {
+    Sha256 hash;
+    hash.update(content.data(), content.size());
+    return hash.finish();
+}
+
+// Uploads content as user's file name the way the server does: commit
+// unsynced first, which only succeeds if the content is already stored,
+// then sync and commit again. Returns whether the first commit did.
+bool upload(FileStore& store, std::uint64_t user, std::string const& name, std::string const& content) {
+    std::filesystem::path temp = store.begin();
+    int fd = ::open(temp.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool ok = fd >= 0 && ::write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size());
+    Digest digest = digest_of(content);
+    bool deduplicated = ok && store.commit(fd, temp, digest, user, name, false);
+    if (ok && !deduplicated) {
+        ok = ::fsync(fd) == 0 && store.commit(fd, temp, digest, user, name, true);
+    }
+    check(ok, "upload " + name);
+    ::close(fd);
+    return deduplicated;
+}
+
+std::size_t count_files(std::filesystem::path const& dir) {
+    std::size_t count = 0;
+    for (auto const& entry : std::filesystem::recursive_directory_iterator(dir)) {
+        count += entry.is_regular_file();
+    }
+    return count;
+}
+
+// Links to path, its own name included
+nlink_t links(std::filesystem::path const& path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 ? st.st_nlink : 0;
+}
+
+std::string read_file(FileStore const& store, std::uint64_t user, std::string const& name) {
+    int fd = store.open(user, name);
+    std::string content;
+    char buffer[256];
+    for (ssize_t n; fd >= 0 && (n = ::read(fd, buffer, sizeof(buffer))) > 0;) {
+        content.append(buffer, n);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    return content;
+}
+
+}  // namespace
+
+int main() {
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "file_store_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::path objects = dir / "objects";
+    std::string const a(100, 'a');
+    std::string const b(200, 'b');
+    std::string const c(300, 'c');
+    std::filesystem::path object_a = objects / to_hex(digest_of(a)).substr(0, 2) / to_hex(digest_of(a));
+    std::filesystem::path object_b = objects / to_hex(digest_of(b)).substr(0, 2) / to_hex(digest_of(b));
+
+    {
+        FileStore store(dir, 1000);
+
+        // The same content twice is one object with both files linked to it
+        check(!upload(store, 1, "a.txt", a), "new content is stored as a new object");
+        check(store.has_object(digest_of(a)) && !store.has_object(digest_of(b)), "has_object");
+        check(upload(store, 2, "copy.txt", a), "the same content is linked, unsynced");
+        check(count_files(objects) == 1 && links(object_a) == 3, "one object, linked by two files");
+        check(read_file(store, 2, "copy.txt") == a, "the copy reads back");
+        check(count_files(dir / "tmp") == 0, "no uploads left in tmp");
+
+        check(store.link_existing(digest_of(a), 1, "third.txt") && links(object_a) == 4, "link_existing");
+        check(!store.link_existing(digest_of(c), 1, "missing.txt") && !std::filesystem::exists(store.path(1, "missing.txt")),
+              "link_existing without an object");
+
+        // Replacing a file drops its object only with its last reference
+        upload(store, 1, "a.txt", b);
+        check(read_file(store, 1, "a.txt") == b && links(object_a) == 3, "a shared object survives a replace");
+        upload(store, 1, "third.txt", b);
+        upload(store, 2, "copy.txt", b);
+        check(!std::filesystem::exists(object_a), "an object is removed with its last reference");
+        check(count_files(objects) == 1 && links(object_b) == 4, "the new content has every reference");
+        upload(store, 2, "copy.txt", b);
+        check(links(object_b) == 4, "replacing a file with the same content");
+
+        // Quota: user 1 stores 400 bytes of 1000, counted per file even
+        // though both share an object
+        check(store.remaining(1) == 600 && store.remaining(2) == 800, "stored bytes count against the quota");
+        check(store.reserve(1, 400) && store.remaining(1) == 200, "a reservation");
+        check(!store.reserve(1, 201) && store.reserve(1, 200) && store.remaining(1) == 0, "reservations fill the quota");
+        store.unreserve(1, 600);
+        check(store.remaining(1) == 600, "unreserve gives the bytes back");
+        check(!store.reserve(3, 1001) && store.reserve(3, 1000), "a reservation larger than the quota");
+        store.unreserve(3, 5000);
+        check(store.remaining(3) == 1000, "unreserving more than reserved");
+        upload(store, 1, "a.txt", c);
+        check(store.remaining(1) == 500, "a replace counts the new size in place of the old");
+    }
+
+    {
+        FileStore unlimited(dir / "unlimited");
+        check(unlimited.reserve(1, ~std::uint64_t(0) / 2) && unlimited.remaining(1) == ~std::uint64_t(0), "no quota");
+    }
+
+    // What a crash leaves behind: a half-made link, an unreferenced object
+    // and an upload in tmp
+    std::filesystem::path orphan = objects / "00" / std::string(64, '0');
+    std::filesystem::create_directories(orphan.parent_path());
+    std::filesystem::copy_file(object_b, orphan);
+    std::filesystem::copy_file(object_b, dir / "files" / "1" / ".a.txt.7.link");
+    std::filesystem::copy_file(object_b, dir / "tmp" / "9.part");
+    {
+        FileStore store(dir, 1000);
+        check(store.remaining(1) == 500 && store.remaining(2) == 800, "usage rebuilt at startup");
+        check(!std::filesystem::exists(orphan) && std::filesystem::exists(object_b), "unreferenced objects are swept");
+        check(!std::filesystem::exists(dir / "files" / "1" / ".a.txt.7.link"), "staged links are removed");
+        check(count_files(dir / "tmp") == 0, "tmp is emptied");
+        check(read_file(store, 1, "a.txt") == c && read_file(store, 2, "copy.txt") == b, "files survive reopening");
+    }
+    std::filesystem::remove_all(dir);
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
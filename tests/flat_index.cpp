@@ -0,0 +1,138 @@
+// FlatIdIndex: ids inserted in several patterns must all be found with
+// their slots, through every growth of the table, ids never inserted must
+// not be, and for_each_key must visit each id once. Readers under an
+// Epoch::Guard must keep finding ids while the table grows under them.
+// Built with -fsanitize=thread the index probes without SSE2, so running
+// both builds covers the vector and the scalar group match.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "epoch.hpp"
+#include "flat_index.hpp"
+
+namespace {
+
+constexpr std::uint32_t kIds = 100000;
+
+bool failed = false;
+
+void check(bool ok, std::string const& what) {
+    if (!ok && !failed) {
+        failed = true;
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+bool finds(FlatIdIndex const& index, std::uint64_t id, std::uint32_t expected) {
+    Epoch::Guard guard;
+    std::uint32_t slot = ~0u;
+    return index.find(id, slot) && slot == expected;
+}
+
+bool absent(FlatIdIndex const& index, std::uint64_t id) {
+    Epoch::Guard guard;
+    std::uint32_t slot;
+    return !index.find(id, slot);
+}
+
+// Inserts id(0), id(1), ... with slot i, checking each one and an earlier
+// one as it goes, then all of them, what was never inserted, and the keys
+template <class Id>
+void inserts(Id id, std::string const& pattern) {
+    FlatIdIndex index;
+    for (std::uint32_t i = 0; i < kIds; ++i) {
+        index.insert(id(i), i);
+        if (!finds(index, id(i), i) || !finds(index, id(i / 2), i / 2)) {
+            check(false, pattern + ": id " + std::to_string(i) + " lost after insert");
+            return;
+        }
+    }
+    for (std::uint32_t i = 0; i < kIds; ++i) {
+        if (!finds(index, id(i), i)) {
+            check(false, pattern + ": id " + std::to_string(i) + " missing at the end");
+            return;
+        }
+    }
+    for (std::uint32_t i = kIds; i < 2 * kIds; ++i) {
+        if (!absent(index, id(i))) {
+            check(false, pattern + ": id " + std::to_string(i) + " found but never inserted");
+            return;
+        }
+    }
+
+    std::set<std::uint64_t> expected, seen;
+    for (std::uint32_t i = 0; i < kIds; ++i) {
+        expected.insert(id(i));
+    }
+    std::size_t visits = 0;
+    index.for_each_key([&](std::uint64_t key) {
+        seen.insert(key);
+        visits++;
+    });
+    check(visits == kIds && seen == expected, pattern + ": for_each_key visits each id once");
+}
+
+}  // namespace
+
+int main() {
+    {
+        FlatIdIndex index;
+        check(absent(index, 1) && absent(index, ~std::uint64_t(0)), "an empty index");
+        index.insert(7, 0);
+        index.insert(~std::uint64_t(0), 1);
+        check(finds(index, 7, 0) && finds(index, ~std::uint64_t(0), 1) && absent(index, 8), "two ids");
+    }
+
+    // The first table holds 64 entries and grows past 56; ids spaced by
+    // powers of two and ids differing only in their high bits must still
+    // spread over groups and control bytes
+    inserts([](std::uint64_t i) { return i + 1; }, "sequential");
+    inserts([](std::uint64_t i) { return (i + 1) << 20; }, "spaced by 2^20");
+    inserts([](std::uint64_t i) { return (i + 1) << 40 | 1; }, "high bits");
+    inserts([](std::uint64_t i) { return (i + 1) * 0x9e3779b97f4a7c15ULL; }, "scattered");
+
+    // Readers never miss an id that was inserted before they looked, while
+    // the writer grows and retires tables under them
+    {
+        FlatIdIndex index;
+        std::atomic<std::uint32_t> inserted{0};
+        std::atomic<bool> missed{false};
+        std::vector<std::thread> readers;
+        for (int r = 0; r < 3; ++r) {
+            readers.emplace_back([&, r] {
+                std::uint64_t probe = r + 1;
+                while (inserted.load() < kIds) {
+                    std::uint32_t high = inserted.load(std::memory_order_acquire);
+                    if (high) {
+                        std::uint32_t i = probe % high;
+                        if (!finds(index, i + 1, i)) {
+                            missed = true;
+                        }
+                    }
+                    probe = probe * 6364136223846793005ULL + 1442695040888963407ULL;
+                }
+            });
+        }
+        for (std::uint32_t i = 0; i < kIds; ++i) {
+            index.insert(i + 1, i);
+            inserted.store(i + 1, std::memory_order_release);
+        }
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        check(!missed, "a reader missed an inserted id during growth");
+    }
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
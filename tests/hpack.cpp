@@ -0,0 +1,248 @@
+// HPACK against the examples of RFC 7541 Appendix C: integers, and three
+// requests and three responses decoded in order on one connection, with
+// and without Huffman coding, the responses in a 256 byte table that has
+// to evict. The encoder must produce the same blocks where it makes the
+// same choices. Then table eviction, and blocks that must be refused.
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "hpack.hpp"
+
+namespace {
+
+using Fields = std::vector<std::pair<std::string, std::string>>;
+
+bool failed = false;
+
+void check(bool ok, std::string const& what) {
+    if (!ok && !failed) {
+        failed = true;
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+// Bytes from hex as the RFC prints them, spaces ignored
+std::string bytes(std::string_view hex) {
+    std::string out;
+    int high = -1;
+    for (char c : hex) {
+        if (c == ' ') {
+            continue;
+        }
+        int nibble = c <= '9' ? c - '0' : c - 'a' + 10;
+        if (high < 0) {
+            high = nibble;
+        } else {
+            out.push_back(static_cast<char>(high << 4 | nibble));
+            high = -1;
+        }
+    }
+    return out;
+}
+
+bool decodes_to(hpack::Decoder& decoder, std::string const& block, Fields const& expected) {
+    std::vector<hpack::Header> headers;
+    if (!decoder.decode(block, headers) || headers.size() != expected.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < headers.size(); ++i) {
+        if (headers[i].name != expected[i].first || headers[i].value != expected[i].second) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Fields with a name outside the static table, or a value other than its
+// own, are indexed, as the examples do
+std::string encode(hpack::Encoder& encoder, Fields const& fields) {
+    std::string out;
+    encoder.begin(out);
+    for (auto const& [name, value] : fields) {
+        encoder.encode(out, name, value, true);
+    }
+    return out;
+}
+
+bool refused(std::string const& block, std::size_t max_list = 65536) {
+    hpack::Decoder decoder(4096, max_list);
+    std::vector<hpack::Header> headers;
+    return !decoder.decode(block, headers);
+}
+
+Fields const kRequests[] = {
+    {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}},
+    {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},
+     {"cache-control", "no-cache"}},
+    {{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"}, {":authority", "www.example.com"},
+     {"custom-key", "custom-value"}},
+};
+
+Fields const kResponses[] = {
+    {{":status", "302"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+     {"location", "https://www.example.com"}},
+    {{":status", "307"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+     {"location", "https://www.example.com"}},
+    {{":status", "200"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+     {"location", "https://www.example.com"}, {"content-encoding", "gzip"},
+     {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}},
+};
+
+// C.3 and C.4
+std::string_view const kPlainRequests[] = {
+    "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+    "8286 84be 5808 6e6f 2d63 6163 6865",
+    "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+};
+std::string_view const kHuffmanRequests[] = {
+    "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+    "8286 84be 5886 a8eb 1064 9cbf",
+    "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+};
+
+// C.5 and C.6
+std::string_view const kPlainResponses[] = {
+    "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 "
+    "3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+    "4803 3330 37c1 c0bf",
+    "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 "
+    "7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 "
+    "6765 3d33 3630 303b 2076 6572 7369 6f6e 3d31",
+};
+std::string_view const kHuffmanResponses[] = {
+    "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad "
+    "1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+    "4883 640e ffc1 c0bf",
+    "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 "
+    "e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+};
+
+void integers() {
+    // C.1
+    std::string out;
+    hpack::detail::write_integer(out, 0, 5, 10);
+    check(out == bytes("0a"), "10 with a 5-bit prefix");
+    out.clear();
+    hpack::detail::write_integer(out, 0, 5, 1337);
+    check(out == bytes("1f9a0a"), "1337 with a 5-bit prefix");
+    out.clear();
+    hpack::detail::write_integer(out, 0, 8, 42);
+    check(out == bytes("2a"), "42 starting at an octet boundary");
+
+    std::string_view in = "\x1f\x9a\x0a";
+    std::uint64_t value = 0;
+    check(hpack::detail::read_integer(in, 5, value) && value == 1337 && in.empty(), "reads 1337");
+    in = "\x1f\x9a";
+    check(!hpack::detail::read_integer(in, 5, value), "a truncated integer");
+    std::string huge = "\x1f" + std::string(12, '\xff') + "\x01";
+    in = huge;
+    check(!hpack::detail::read_integer(in, 5, value), "an integer over 64 bits");
+}
+
+void examples() {
+    for (auto const* blocks : {kPlainRequests, kHuffmanRequests}) {
+        hpack::Decoder decoder;
+        for (int i = 0; i < 3; ++i) {
+            check(decodes_to(decoder, bytes(blocks[i]), kRequests[i]), "request example " + std::to_string(i + 1));
+        }
+    }
+    for (auto const* blocks : {kPlainResponses, kHuffmanResponses}) {
+        hpack::Decoder decoder(256);
+        for (int i = 0; i < 3; ++i) {
+            check(decodes_to(decoder, bytes(blocks[i]), kResponses[i]), "response example " + std::to_string(i + 1));
+        }
+    }
+
+    // The encoder never uses Huffman coding, so it matches C.3 and C.5;
+    // shrinking its table to 256 bytes first adds a size update
+    hpack::Encoder requests;
+    for (int i = 0; i < 3; ++i) {
+        check(encode(requests, kRequests[i]) == bytes(kPlainRequests[i]), "encodes request " + std::to_string(i + 1));
+    }
+    hpack::Encoder responses;
+    responses.set_max_size(256);
+    for (int i = 0; i < 3; ++i) {
+        std::string expected = (i == 0 ? bytes("3fe101") : "") + bytes(kPlainResponses[i]);
+        check(encode(responses, kResponses[i]) == expected, "encodes response " + std::to_string(i + 1));
+    }
+
+    // And what it encodes decodes back, against the same table
+    hpack::Decoder decoder(256);
+    hpack::Encoder encoder;
+    encoder.set_max_size(256);
+    for (int round = 0; round < 3; ++round) {
+        for (auto const& fields : kResponses) {
+            check(decodes_to(decoder, encode(encoder, fields), fields), "encoded responses decode");
+        }
+    }
+}
+
+void eviction() {
+    // C.5.1 leaves 222 bytes of 256 in four entries; C.5.2's :status 307
+    // needs 42, which evicts :status 302, the oldest
+    hpack::DynamicTable table(256);
+    for (auto const& [name, value] : kResponses[0]) {
+        table.add(name, value);
+    }
+    check(table.count() == 4 && table.at(3).value == "302", "four entries, oldest last");
+    table.add(":status", "307");
+    check(table.count() == 4 && table.at(0).value == "307" && table.at(3).name == "cache-control",
+          "the oldest entry is evicted");
+
+    table.resize(100);
+    check(table.count() == 1 && table.at(0).value == "307", "shrinking evicts down to the new size");
+    table.add("x", std::string(100, 'x'));
+    check(table.count() == 0, "an entry larger than the table empties it");
+    table.resize(0);
+    table.add("a", "b");
+    check(table.count() == 0, "a table of size 0 holds nothing");
+
+    // A size update clears a decoder's table, so a later index into it fails
+    hpack::Decoder decoder;
+    std::vector<hpack::Header> headers;
+    check(decoder.decode(bytes(kPlainRequests[0]), headers), "fills the table");
+    check(decoder.decode(bytes("20") + bytes("be"), headers) == false, "an index into a cleared table");
+}
+
+void refusals() {
+    check(refused(bytes("80")), "index 0");
+    check(refused(bytes("be")), "an index past the empty dynamic table");
+    check(refused(bytes("3fe21f")), "a size update over the advertised size");
+    check(refused(bytes("82 20")), "a size update after a field");
+    check(refused(bytes("4005 6e61")), "a string shorter than its length");
+    check(refused(bytes("0084 ffff ffff 00")), "a Huffman string that decodes to EOS");
+    check(refused(bytes("0081 18 00")), "Huffman padding that is not all ones");
+    check(refused(bytes("0082 1fff 00")), "Huffman padding of more than 7 bits");
+
+    // max_list counts decoded names and values plus 32 per field, so an
+    // indexed reference to a long entry costs its whole length
+    std::string literal = bytes("4001") + "a" + bytes("7f21") + std::string(160, 'v');
+    check(!refused(literal, 256), "a block under max_list");
+    check(refused(literal, 128), "a block over max_list");
+    std::string repeated = literal;
+    for (int i = 0; i < 8; ++i) {
+        repeated += bytes("be");
+    }
+    check(!refused(literal + bytes("be"), 512) && refused(repeated, 512), "indexed fields count in full");
+}
+
+}  // namespace
+
+int main() {
+    integers();
+    examples();
+    eviction();
+    refusals();
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
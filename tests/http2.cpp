@@ -0,0 +1,379 @@
+// HTTP/2 framing over loopback connections to Http2Session: the preface
+// and SETTINGS exchange, a request answered within the peer's flow control
+// windows and released by WINDOW_UPDATE, PING, streams reset by either
+// side, and the frames that must end the connection with GOAWAY.
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/beast/core.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "http2_session.hpp"
+#include "user_partitions.hpp"
+
+namespace {
+
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
+
+enum : std::uint8_t { kData, kHeaders, kPriority, kRstStream, kSettings, kPushPromise, kPing, kGoaway, kWindowUpdate };
+constexpr std::uint8_t kEndStream = 0x1;
+constexpr std::uint8_t kAck = 0x1;
+constexpr std::uint8_t kEndHeaders = 0x4;
+
+constexpr std::uint32_t kProtocolError = 0x1;
+constexpr std::uint32_t kFrameSizeError = 0x6;
+constexpr std::uint32_t kHttp11Required = 0xd;
+
+bool failed = false;
+
+void check(bool ok, std::string const& what) {
+    if (!ok && !failed) {
+        failed = true;
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+std::string u32(std::uint32_t value) {
+    return {static_cast<char>(value >> 24), static_cast<char>(value >> 16), static_cast<char>(value >> 8),
+            static_cast<char>(value)};
+}
+
+std::uint32_t read32(std::string_view bytes) {
+    return (std::uint32_t(std::uint8_t(bytes[0])) << 24) | (std::uint32_t(std::uint8_t(bytes[1])) << 16)
+           | (std::uint32_t(std::uint8_t(bytes[2])) << 8) | std::uint32_t(std::uint8_t(bytes[3]));
+}
+
+std::string frame(std::uint8_t type, std::uint8_t flags, std::uint32_t id, std::string_view payload = {}) {
+    std::string out = {static_cast<char>(payload.size() >> 16), static_cast<char>(payload.size() >> 8),
+                       static_cast<char>(payload.size()), static_cast<char>(type), static_cast<char>(flags)};
+    return out + u32(id) + std::string(payload);
+}
+
+std::string setting(std::uint16_t id, std::uint32_t value) {
+    return std::string{static_cast<char>(id >> 8), static_cast<char>(id)} + u32(value);
+}
+
+struct Frame {
+    std::uint8_t type;
+    std::uint8_t flags;
+    std::uint32_t id;
+    std::string payload;
+};
+
+// The server, on an io_context thread of its own, with a fresh store
+class Server {
+    private:
+        std::filesystem::path dir_ = std::filesystem::temp_directory_path() / "http2_test";
+        std::unique_ptr<UserPartitions> users_;
+        net::io_context ioc_;
+        tcp::acceptor acceptor_{ioc_, {net::ip::address_v4::loopback(), 0}};
+        net::executor_work_guard<net::io_context::executor_type> work_{ioc_.get_executor()};
+        std::thread thread_;
+
+    public:
+        Server() {
+            std::filesystem::remove_all(dir_);
+            StoreOptions options;
+            options.data_dir = dir_;
+            users_ = std::make_unique<UserPartitions>(options, CompactorOptions{}, 1, false);
+            thread_ = std::thread([this] {
+                ioc_.run();
+            });
+        }
+
+        ~Server() {
+            work_.reset();
+            ioc_.stop();
+            thread_.join();
+            users_.reset();
+            std::filesystem::remove_all(dir_);
+        }
+
+        // A connected client socket whose peer is a new Http2Session
+        // waiting for the preface
+        int connect() {
+            int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(acceptor_.local_endpoint().port());
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            timeval timeout{5, 0};
+            ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+                std::cerr << "FAIL: connect" << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            tcp::socket socket = acceptor_.accept();
+            auto session = std::make_shared<Http2Session<boost::beast::tcp_stream>>(
+                boost::beast::tcp_stream(std::move(socket)), boost::beast::flat_buffer(), *users_, 0, nullptr,
+                nullptr);
+            net::post(ioc_, [session] {
+                session->start();
+            });
+            return fd;
+        }
+};
+
+class Client {
+    private:
+        int fd_;
+        std::string received_;
+        hpack::Encoder encoder_;
+        hpack::Decoder decoder_;
+
+        bool fill(std::size_t size) {
+            while (received_.size() < size) {
+                char data[16384];
+                ssize_t read = ::recv(fd_, data, sizeof(data), 0);
+                if (read <= 0) {
+                    return false;
+                }
+                received_.append(data, static_cast<std::size_t>(read));
+            }
+            return true;
+        }
+
+    public:
+        explicit Client(Server& server) : fd_(server.connect()) {}
+
+        ~Client() {
+            ::close(fd_);
+        }
+
+        void send(std::string const& bytes) {
+            ::send(fd_, bytes.data(), bytes.size(), MSG_NOSIGNAL);
+        }
+
+        // The next frame, or nullopt once the server closes or goes quiet
+        std::optional<Frame> next() {
+            if (!fill(9)) {
+                return std::nullopt;
+            }
+            std::size_t length = (std::size_t(std::uint8_t(received_[0])) << 16)
+                                 | (std::size_t(std::uint8_t(received_[1])) << 8) | std::uint8_t(received_[2]);
+            if (!fill(9 + length)) {
+                return std::nullopt;
+            }
+            Frame f{std::uint8_t(received_[3]), std::uint8_t(received_[4]), read32(received_.substr(5)) & 0x7fffffff,
+                    received_.substr(9, length)};
+            received_.erase(0, 9 + length);
+            return f;
+        }
+
+        // The next frame that is not a SETTINGS acknowledgement
+        std::optional<Frame> next_reply() {
+            auto f = next();
+            while (f && f->type == kSettings && (f->flags & kAck)) {
+                f = next();
+            }
+            return f;
+        }
+
+        // Preface and SETTINGS; true if the server's SETTINGS and its
+        // acknowledgement of ours come back
+        bool open(std::string const& settings = {}) {
+            send(std::string(kHttp2Preface) + frame(kSettings, 0, 0, settings));
+            auto theirs = next();
+            auto ack = next();
+            return theirs && theirs->type == kSettings && !(theirs->flags & kAck) && theirs->payload.size() % 6 == 0
+                   && ack && ack->type == kSettings && (ack->flags & kAck) && ack->payload.empty();
+        }
+
+        void request(std::uint32_t id, std::string_view method, std::string_view path, bool end_stream = true) {
+            std::string block;
+            encoder_.begin(block);
+            encoder_.encode(block, ":method", method);
+            encoder_.encode(block, ":scheme", "http");
+            encoder_.encode(block, ":path", path);
+            encoder_.encode(block, ":authority", "localhost", true);
+            send(frame(kHeaders, kEndHeaders | (end_stream ? kEndStream : 0), id, block));
+        }
+
+        // The :status of a HEADERS frame
+        std::string status(Frame const& headers) {
+            std::vector<hpack::Header> fields;
+            if (!decoder_.decode(headers.payload, fields)) {
+                return "undecodable";
+            }
+            for (auto const& field : fields) {
+                if (field.name == ":status") {
+                    return field.value;
+                }
+            }
+            return "none";
+        }
+
+        // True if the server's next frame is GOAWAY with error, and then it
+        // closes the connection
+        bool goes_away(std::uint32_t error) {
+            auto f = next_reply();
+            bool goaway = f && f->type == kGoaway && f->payload.size() == 8 && read32(f->payload.substr(4)) == error;
+            return goaway && !next();
+        }
+};
+
+bool is_reset(std::optional<Frame> const& f, std::uint32_t id, std::uint32_t error) {
+    return f && f->type == kRstStream && f->id == id && f->payload.size() == 4 && read32(f->payload) == error;
+}
+
+void preface_and_settings(Server& server) {
+    {
+        Client client(server);
+        client.send(std::string(kHttp2Preface) + frame(kSettings, 0, 0));
+        auto settings = client.next();
+        check(settings && settings->type == kSettings && settings->flags == 0 && settings->id == 0,
+              "the server's SETTINGS come first");
+        bool concurrent = false;
+        for (std::string_view p = settings ? settings->payload : ""; p.size() >= 6; p.remove_prefix(6)) {
+            concurrent = concurrent || (p[0] == 0 && p[1] == 3 && read32(p.substr(2)) == 100);
+        }
+        check(concurrent, "SETTINGS_MAX_CONCURRENT_STREAMS is 100");
+        auto ack = client.next();
+        check(ack && ack->type == kSettings && ack->flags == kAck && ack->payload.empty(), "our SETTINGS are acked");
+    }
+    {
+        Client client(server);
+        client.send("PRI * HTTP/2.0\r\n\r\nXX\r\n\r\n");
+        auto settings = client.next();
+        check(settings && settings->type == kSettings && !client.next(), "a wrong preface closes the connection");
+    }
+    {
+        Client client(server);
+        check(client.open(), "SETTINGS exchange");
+        client.send(frame(kSettings, 0, 0, std::string(4, 3)));
+        check(client.goes_away(kFrameSizeError), "SETTINGS of a length not a multiple of 6");
+    }
+    {
+        Client client(server);
+        check(client.open(), "SETTINGS exchange");
+        client.send(frame(kSettings, 0, 1));
+        check(client.goes_away(kProtocolError), "SETTINGS on a stream");
+    }
+    {
+        Client client(server);
+        check(client.open(), "SETTINGS exchange");
+        client.send(frame(kSettings, 0, 0, setting(0x5, 1024)));
+        check(client.goes_away(kProtocolError), "SETTINGS_MAX_FRAME_SIZE under 16384");
+    }
+}
+
+void request_and_flow_control(Server& server) {
+    std::string list;
+    {
+        Client client(server);
+        check(client.open(), "SETTINGS exchange");
+        client.request(1, "GET", "/api/users");
+        auto headers = client.next_reply();
+        check(headers && headers->type == kHeaders && headers->id == 1 && (headers->flags & kEndHeaders)
+                  && client.status(*headers) == "200",
+              "200 for the list");
+        auto data = client.next_reply();
+        check(data && data->type == kData && data->id == 1 && (data->flags & kEndStream)
+                  && data->payload.starts_with("{\"users\":[") && data->payload.ends_with("]}"),
+              "the list in one DATA frame");
+        list = data ? data->payload : "";
+    }
+    {
+        // No stream window at first: the body waits for WINDOW_UPDATE and
+        // comes in as much as each one allows
+        Client client(server);
+        check(client.open(setting(0x4, 0)), "SETTINGS exchange with INITIAL_WINDOW_SIZE 0");
+        client.request(1, "GET", "/api/users");
+        auto headers = client.next_reply();
+        check(headers && headers->type == kHeaders && client.status(*headers) == "200", "headers with no window");
+        client.send(frame(kPing, 0, 0, "12345678"));
+        auto pong = client.next_reply();
+        check(pong && pong->type == kPing && pong->flags == kAck && pong->payload == "12345678",
+              "PING is answered and no DATA went out without window");
+        client.send(frame(kWindowUpdate, 0, 1, u32(5)));
+        auto first = client.next_reply();
+        check(first && first->type == kData && first->payload == list.substr(0, 5) && !(first->flags & kEndStream),
+              "DATA up to the window");
+        client.send(frame(kWindowUpdate, 0, 1, u32(1000)));
+        auto rest = client.next_reply();
+        check(rest && rest->type == kData && rest->payload == list.substr(5) && (rest->flags & kEndStream),
+              "the rest once the window opens");
+    }
+    {
+        Client client(server);
+        check(client.open(), "SETTINGS exchange");
+        client.send(frame(kWindowUpdate, 0, 0, u32(0)));
+        check(client.goes_away(kProtocolError), "a connection WINDOW_UPDATE of 0");
+    }
+    {
+        Client client(server);
+        check(client.open(), "SETTINGS exchange");
+        client.send(frame(kWindowUpdate, 0, 0, u32(0x7fffffff)));
+        auto f = client.next_reply();
+        check(f && f->type == kGoaway && read32(f->payload.substr(4)) == 0x3, "a connection window over 2^31-1");
+    }
+}
+
+void resets(Server& server) {
+    Client client(server);
+    check(client.open(), "SETTINGS exchange");
+
+    // The file routes need HTTP/1.1
+    client.request(1, "GET", "/api/users/1/files/a");
+    check(is_reset(client.next_reply(), 1, kHttp11Required), "a file route is reset with HTTP_1_1_REQUIRED");
+
+    // A stream the client resets is forgotten: its body is ignored and the
+    // connection carries on
+    client.request(3, "POST", "/api/users", false);
+    client.send(frame(kRstStream, 0, 3, u32(0x8)));
+    client.send(frame(kData, kEndStream, 3, "{}"));
+    client.request(5, "GET", "/api/users");
+    auto headers = client.next_reply();
+    check(headers && headers->type == kHeaders && headers->id == 5 && client.status(*headers) == "200",
+          "the connection goes on after RST_STREAM");
+    auto data = client.next_reply();
+    check(data && data->type == kData && data->id == 5, "and the next stream is answered");
+
+    client.send(frame(kPriority, 0, 7, std::string(3, 0)));
+    check(is_reset(client.next_reply(), 7, kFrameSizeError), "PRIORITY of the wrong size resets the stream");
+
+    client.send(frame(kRstStream, 0, 5, std::string(2, 0)));
+    check(client.goes_away(kFrameSizeError), "RST_STREAM of the wrong size");
+
+    Client idle(server);
+    check(idle.open(), "SETTINGS exchange");
+    idle.send(frame(kRstStream, 0, 9, u32(0x8)));
+    check(idle.goes_away(kProtocolError), "RST_STREAM on an idle stream");
+
+    Client even(server);
+    check(even.open(), "SETTINGS exchange");
+    even.request(2, "GET", "/api/users");
+    check(even.goes_away(kProtocolError), "a request on an even stream");
+}
+
+}  // namespace
+
+int main() {
+    Server server;
+    preface_and_settings(server);
+    request_and_flow_control(server);
+    resets(server);
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+// Range headers against a 1000 byte file: plain, open-ended and suffix
+// ranges, overlapping ranges kept as asked in request order, ranges that
+// cannot be satisfied dropped, and headers that must be ignored.
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "http_range.hpp"
+
+namespace {
+
+using Ranges = std::vector<std::pair<std::uint64_t, std::uint64_t>>;  // First, length
+
+constexpr std::uint64_t kSize = 1000;
+
+bool failed = false;
+
+void check(bool ok, std::string const& what) {
+    if (!ok && !failed) {
+        failed = true;
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+bool parses_to(std::string const& header, Ranges const& expected, std::uint64_t size = kSize) {
+    auto ranges = parse_byte_ranges(header, size);
+    if (!ranges || ranges->size() != expected.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+        if ((*ranges)[i].first != expected[i].first || (*ranges)[i].length != expected[i].second) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ignored(std::string const& header, std::size_t max_ranges = 16) {
+    return !parse_byte_ranges(header, kSize, max_ranges);
+}
+
+}  // namespace
+
+int main() {
+    // Satisfiable
+    check(parses_to("bytes=0-499", {{0, 500}}), "the first 500 bytes");
+    check(parses_to("bytes=500-999", {{500, 500}}), "the second 500 bytes");
+    check(parses_to("bytes=500-", {{500, 500}}), "from 500 to the end");
+    check(parses_to("bytes=0-0", {{0, 1}}), "the first byte");
+    check(parses_to("bytes=900-5000", {{900, 100}}), "a last byte past the end is clamped");
+    check(parses_to(" bytes=0-9 , 20-29 ", {{0, 10}, {20, 10}}), "whitespace around the header and ranges");
+    check(parses_to("bytes=0-9,,20-29", {{0, 10}, {20, 10}}), "empty list elements are skipped");
+
+    // Suffix
+    check(parses_to("bytes=-500", {{500, 500}}), "the last 500 bytes");
+    check(parses_to("bytes=-1", {{999, 1}}), "the last byte");
+    check(parses_to("bytes=-5000", {{0, 1000}}), "a suffix longer than the file is all of it");
+    check(parses_to("bytes=-0", {}), "a suffix of 0 bytes is unsatisfiable");
+    check(parses_to("bytes=-10", {}, 0), "a suffix of an empty file is unsatisfiable");
+
+    // Overlapping and out of order ranges are returned as asked
+    check(parses_to("bytes=0-499,250-749", {{0, 500}, {250, 500}}), "overlapping ranges");
+    check(parses_to("bytes=500-599,0-99", {{500, 100}, {0, 100}}), "ranges out of order");
+    check(parses_to("bytes=0-99,-100,0-", {{0, 100}, {900, 100}, {0, 1000}}), "plain, suffix and open ranges");
+
+    // Unsatisfiable ranges are dropped, leaving the rest
+    check(parses_to("bytes=1000-1999", {}), "a range starting at the end");
+    check(parses_to("bytes=5000-", {}), "an open range past the end");
+    check(parses_to("bytes=0-9,1000-1999,-0", {{0, 10}}), "only the satisfiable range is kept");
+    check(parses_to("bytes=0-9", {}, 0), "any range of an empty file");
+
+    // Ignored
+    check(ignored(""), "an empty header");
+    check(ignored("bytes="), "no ranges");
+    check(ignored("items=0-9"), "another unit");
+    check(ignored("Bytes=0-9"), "the unit is case sensitive");
+    check(ignored("bytes=9-0"), "last before first");
+    check(ignored("bytes=0-9,9-0"), "one bad range spoils the header");
+    check(ignored("bytes=10"), "no dash");
+    check(ignored("bytes=a-9"), "a first byte that is not a number");
+    check(ignored("bytes=0-9x"), "a last byte that is not a number");
+    check(ignored("bytes=-"), "neither first nor last");
+    check(ignored("bytes=+1-9"), "a sign");
+    check(ignored("bytes=0-99999999999999999999"), "a last byte over 64 bits");
+    check(ignored("bytes=0-0,1-1,2-2", 2), "more ranges than allowed");
+    check(!ignored("bytes=0-0,1-1", 2), "as many ranges as allowed");
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+// The in-place request head parser: well-formed requests with targets and
+// values long enough for the SSE2 scan, and every request line or header
+// it must hand to Beast instead, such as folded headers and bare LFs. A
+// stop byte is tried at each offset of a long target, to catch the
+// vector and scalar loops disagreeing.
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include "request_head.hpp"
+
+namespace {
+
+bool failed = false;
+
+void check(bool ok, std::string const& what) {
+    if (!ok && !failed) {
+        failed = true;
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+bool parses(std::string const& data) {
+    RequestHead head;
+    return parse_request_head(data, head);
+}
+
+}  // namespace
+
+int main() {
+    {
+        std::string data =
+            "PATCH /api/users/12345678901234567890 HTTP/1.1\r\n"
+            "Host: localhost:8080\r\n"
+            "content-type:application/json\r\n"
+            "X-Padded: \t  spaced out value with\ttabs inside \t \r\n"
+            "If-Match: \"42\"\r\n"
+            "\r\n"
+            "{\"name\":\"body\"}";
+        RequestHead head;
+        check(parse_request_head(data, head), "a PATCH with headers");
+        check(head.method == "PATCH" && head.target == "/api/users/12345678901234567890" && head.version == 11,
+              "request line");
+        check(head.header_count == 4 && head.size == data.find("{"), "headers and size");
+        check(head.find("CONTENT-TYPE") == "application/json", "names compare case-insensitively");
+        check(head.find("x-padded") == "spaced out value with\ttabs inside", "values are trimmed, inner tabs kept");
+        check(head.find("if-match") == "\"42\"" && !head.find("accept"), "find");
+    }
+    {
+        RequestHead head;
+        check(parse_request_head("GET / HTTP/1.0\r\n\r\n", head) && head.version == 10 && head.header_count == 0,
+              "HTTP/1.0 without headers");
+        check(parse_request_head("GET /?q=%20 HTTP/1.1\r\nEmpty:\r\n\r\n", head) && head.find("empty") == "",
+              "an empty header value");
+    }
+
+    // Incomplete
+    std::string full = "GET /api/users HTTP/1.1\r\nHost: x\r\n\r\n";
+    for (std::size_t size = 0; size < full.size(); ++size) {
+        check(!parses(full.substr(0, size)), "a head cut at " + std::to_string(size) + " bytes");
+    }
+    check(parses(full), "the whole head");
+
+    // Malformed request lines
+    check(!parses(" GET / HTTP/1.1\r\n\r\n"), "leading space");
+    check(!parses("GET  / HTTP/1.1\r\n\r\n"), "two spaces after the method");
+    check(!parses("GET / HTTP/1.1 \r\n\r\n"), "space after the version");
+    check(!parses("G(T / HTTP/1.1\r\n\r\n"), "a method that is not a token");
+    check(!parses("GET /\x01 HTTP/1.1\r\n\r\n"), "a control byte in the target");
+    check(!parses("GET /caf\xc3\xa9 HTTP/1.1\r\n\r\n"), "a non-ASCII target");
+    check(!parses("GET / HTTP/2.0\r\n\r\n"), "HTTP/2.0");
+    check(!parses("GET / http/1.1\r\n\r\n"), "a lower case version");
+    check(!parses("GET / HTTP/1.1\n\n"), "bare LF after the request line");
+    check(!parses("GET /\r\n\r\n"), "no version");
+
+    // Malformed or unusual headers
+    check(!parses("GET / HTTP/1.1\r\nX-Folded: a\r\n b\r\n\r\n"), "a header folded with a space");
+    check(!parses("GET / HTTP/1.1\r\nX-Folded: a\r\n\tb\r\n\r\n"), "a header folded with a tab");
+    check(!parses("GET / HTTP/1.1\r\nHost : x\r\n\r\n"), "space before the colon");
+    check(!parses("GET / HTTP/1.1\r\n: x\r\n\r\n"), "an empty name");
+    check(!parses("GET / HTTP/1.1\r\nHost x\r\n\r\n"), "no colon");
+    check(!parses("GET / HTTP/1.1\r\nHost: x\n\r\n"), "bare LF after a header");
+    check(!parses("GET / HTTP/1.1\r\nHost: x\r\n\r\r"), "CR without LF at the end");
+    check(!parses("GET / HTTP/1.1\r\nX: a\x7f b\r\n\r\n"), "DEL in a value");
+    check(!parses("GET / HTTP/1.1\r\nX: a\rb\r\n\r\n"), "CR inside a value");
+
+    std::string many = "GET / HTTP/1.1\r\n";
+    for (std::size_t i = 0; i < RequestHead::kMaxHeaders; ++i) {
+        many += "H" + std::to_string(i) + ": v\r\n";
+    }
+    check(parses(many + "\r\n"), "kMaxHeaders headers");
+    check(!parses(many + "One-More: v\r\n\r\n"), "more than kMaxHeaders headers");
+
+    // A bad byte at every offset of a long target and a long value
+    std::string target(40, 'a');
+    for (std::size_t at = 0; at < target.size(); ++at) {
+        for (char bad : {'\x01', '\x7f', '\x80', ' '}) {
+            std::string t = target;
+            t[at] = bad;
+            check(!parses("GET /" + t + " HTTP/1.1\r\n\r\n"), "a bad byte at offset " + std::to_string(at) + " of the target");
+        }
+        std::string v = target;
+        v[at] = '\x01';
+        check(!parses("GET / HTTP/1.1\r\nX: " + v + "\r\n\r\n"), "a control byte at offset " + std::to_string(at));
+        v[at] = '\x80';
+        check(parses("GET / HTTP/1.1\r\nX: " + v + "\r\n\r\n"), "obs-text at offset " + std::to_string(at));
+    }
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
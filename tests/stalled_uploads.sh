@@ -0,0 +1,33 @@
+#!/bin/sh
+# More uploads held open with no body than the server has DiskIo pool
+# buffers (USER_STORE_IO_BUFFERS, 32 by default), then one upload that
+# must still go through. Start the server first.
+#
+#   tests/stalled_uploads.sh [stalled uploads] [base URL]
+set -e
+
+count=${1:-40}
+base=${2:-http://localhost:8080}
+work=$(mktemp -d)
+stalled=""
+trap 'kill $stalled 2>/dev/null; rm -rf "$work"' EXIT
+
+user=$(curl -sf -X POST -H 'Content-Type: application/json' -d '{"name":"stalled"}' "$base/api/users" |
+       sed 's/.*"id":\([0-9]*\).*/\1/')
+
+# curl sends the headers of a chunked upload from stdin at once, and then
+# nothing until sleep exits
+for i in $(seq "$count"); do
+    sleep 60 | curl -s -T - "$base/api/users/$user/files/stalled$i" -o /dev/null &
+    stalled="$stalled $!"
+done
+sleep 1
+
+echo "after $count stalled uploads" > "$work/source"
+if ! curl -sf -m 10 -T "$work/source" "$base/api/users/$user/files/live" -o /dev/null; then
+    echo "FAIL: upload blocked by $count stalled uploads"
+    exit 1
+fi
+curl -sf "$base/api/users/$user/files/live" -o "$work/copy"
+cmp -s "$work/source" "$work/copy" || { echo "FAIL: copy differs"; exit 1; }
+echo PASS
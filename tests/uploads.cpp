@@ -0,0 +1,142 @@
+// Resumable upload bookkeeping: chunks received out of order, repeated or
+// overlapping must merge into the received prefix, the upload must finish
+// exactly once and only when no chunk is still being written, and the
+// running hash must follow the prefix and start over when a chunk feeding
+// it is cut short.
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <fcntl.h>
+
+#include "uploads.hpp"
+
+namespace {
+
+constexpr std::uint64_t kLength = 300;
+
+bool failed = false;
+
+void check(bool ok, std::string const& what) {
+    if (!ok && !failed) {
+        failed = true;
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+std::unique_ptr<Upload> make_upload() {
+    return std::make_unique<Upload>("token", 1, "name", kLength, "/dev/null", ::open("/dev/null", O_RDONLY));
+}
+
+// Begins and ends a chunk written in full, without the hash
+Upload::ChunkResult chunk(Upload& upload, std::uint64_t offset, std::uint64_t size) {
+    if (!upload.begin_chunk(offset, size)) {
+        return {~std::uint64_t(0), false};
+    }
+    return upload.end_chunk(offset, size, true, false);
+}
+
+bool is(Upload::ChunkResult result, std::uint64_t offset, bool finish) {
+    return result.offset == offset && result.finish == finish;
+}
+
+}  // namespace
+
+int main() {
+    // In order
+    {
+        auto upload = make_upload();
+        check(is(chunk(*upload, 0, 100), 100, false), "the first chunk");
+        check(is(chunk(*upload, 100, 100), 200, false), "the second chunk");
+        check(is(chunk(*upload, 200, 100), 300, true), "the last chunk finishes");
+        check(!upload->begin_chunk(0, 100), "chunks after the finish are refused");
+    }
+
+    // Out of order: the prefix only grows once the gap before a chunk fills
+    {
+        auto upload = make_upload();
+        check(is(chunk(*upload, 200, 100), 0, false), "the last chunk first");
+        check(is(chunk(*upload, 100, 50), 0, false), "a middle chunk");
+        check(is(chunk(*upload, 0, 100), 150, false), "the first chunk joins the middle one");
+        check(is(chunk(*upload, 150, 50), 300, true), "the gap filled last finishes");
+    }
+
+    // Duplicates and overlaps are merged, and count once
+    {
+        auto upload = make_upload();
+        check(is(chunk(*upload, 0, 100), 100, false), "a chunk");
+        check(is(chunk(*upload, 0, 100), 100, false), "the same chunk again");
+        check(is(chunk(*upload, 50, 100), 150, false), "a chunk overlapping the prefix");
+        check(is(chunk(*upload, 250, 50), 150, false), "a chunk past a gap");
+        check(is(chunk(*upload, 250, 50), 150, false), "that chunk again");
+        check(is(chunk(*upload, 140, 120), 300, true), "a chunk overlapping both sides finishes");
+        check(upload->offset() == kLength, "the received prefix");
+    }
+
+    // Chunks cut short, empty, or not fitting the upload are not received
+    {
+        auto upload = make_upload();
+        check(!upload->begin_chunk(200, 101) && !upload->begin_chunk(301, 0), "chunks past the end");
+        check(!upload->begin_chunk(1, ~std::uint64_t(0)), "a size that overflows the offset");
+        check(upload->begin_chunk(0, 300), "a chunk of the whole length");
+        check(is(upload->end_chunk(0, 120, false, false), 0, false), "cut short after 120 bytes");
+        check(is(chunk(*upload, 300, 0), 0, false), "an empty chunk at the end");
+        check(is(chunk(*upload, 0, 300), 300, true), "the whole length resent");
+    }
+
+    // Finishing waits for every chunk in flight, and happens once
+    {
+        auto upload = make_upload();
+        check(upload->begin_chunk(0, 300) && upload->begin_chunk(0, 300), "two copies of the whole upload");
+        check(is(upload->end_chunk(0, 300, true, false), 300, false), "one done while the other writes");
+        check(is(upload->end_chunk(0, 300, true, false), 300, true), "the second finishes");
+        check(!upload->begin_chunk(0, 0), "nothing begins after the finish");
+    }
+    {
+        auto upload = make_upload();
+        check(upload->begin_chunk(0, 300) && upload->begin_chunk(100, 100), "two overlapping chunks");
+        check(is(upload->end_chunk(0, 300, true, false), 300, false), "the whole upload while a chunk writes");
+        check(is(upload->end_chunk(100, 100, false, false), 300, true), "that chunk cut short still finishes");
+    }
+
+    // The hash follows the prefix, one chunk at a time
+    {
+        auto upload = make_upload();
+        std::string data(kLength, 'x');
+        check(upload->begin_chunk(0, 100) && upload->begin_chunk(0, 100), "two chunks at 0");
+        Sha256* hash = upload->hash_from(0);
+        check(hash && !upload->hash_from(0), "only one chunk feeds the hash");
+        hash->update(data.data(), 100);
+        upload->end_chunk(0, 100, true, true);
+        upload->end_chunk(0, 100, true, false);
+        check(upload->hashed() == 100, "the hash covers the first chunk");
+
+        check(upload->begin_chunk(200, 100) && !upload->hash_from(200), "no hash for a chunk past the prefix");
+        upload->end_chunk(200, 100, true, false);
+
+        check(upload->begin_chunk(100, 100), "the middle chunk");
+        hash = upload->hash_from(100);
+        check(hash != nullptr, "the chunk at the end of the hash feeds it");
+        hash->update(data.data(), 60);
+        upload->end_chunk(100, 100, false, true);
+        check(upload->hashed() == 0, "a hashing chunk cut short restarts the hash");
+
+        check(upload->begin_chunk(100, 100) && !upload->hash_from(100), "the hash is back at 0");
+        check(upload->end_chunk(100, 100, true, false).finish, "the middle chunk finishes");
+
+        // The finisher hashes what the chunks missed, from the file
+        upload->hash(data.data(), kLength);
+        Sha256 expected;
+        expected.update(data.data(), kLength);
+        check(upload->hashed() == kLength && upload->digest() == expected.finish(), "the digest of the whole upload");
+    }
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
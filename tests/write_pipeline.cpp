@@ -0,0 +1,121 @@
+// Batches of creates with several to a shard, applied directly and through
+// the WritePipeline from concurrent publishers. Every create must come back
+// with its own id and body, before and after reopening the store, including
+// in a store that hands out every fourth id as one partition of several.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "epoch.hpp"
+#include "user_store.hpp"
+#include "write_pipeline.hpp"
+
+namespace {
+
+constexpr unsigned kBatch = 64;  // Four creates per shard
+constexpr unsigned kPublishers = 4;
+constexpr unsigned kPerPublisher = 500;
+
+bool failed = false;
+
+void check(bool ok, std::string const& what) {
+    if (!ok && !failed) {
+        failed = true;
+        std::cerr << "FAIL: " << what << std::endl;
+    }
+}
+
+bool matches(UserStore& store, std::uint64_t id, std::uint64_t n) {
+    Epoch::Guard guard;
+    UserRecord const* record = store.find(id);
+    return record && store.body_of(*record).find("\"n\":" + std::to_string(n) + ",") != std::string_view::npos;
+}
+
+void run(StoreOptions const& options) {
+    std::filesystem::remove_all(options.data_dir);
+
+    // Created ids by n, the number put in the user's body
+    std::vector<std::uint64_t> ids(kBatch + kPublishers * kPerPublisher);
+    {
+        UserStore store(options);
+        std::vector<UserStore::Mutation> batch(kBatch);
+        for (unsigned n = 0; n < kBatch; ++n) {
+            batch[n].body = json::object{{"n", n}};
+        }
+        {
+            Epoch::Guard guard;
+            store.apply(batch);
+            for (unsigned n = 0; n < kBatch; ++n) {
+                check(batch[n].error.empty() && batch[n].result.record, "create in a batch");
+                ids[n] = batch[n].id;
+            }
+        }
+
+        {
+            WritePipeline writes(store);
+            std::atomic<unsigned> pending{kPublishers * kPerPublisher};
+            std::vector<std::thread> publishers;
+            for (unsigned p = 0; p < kPublishers; ++p) {
+                publishers.emplace_back([&, p] {
+                    for (unsigned i = 0; i < kPerPublisher; ++i) {
+                        unsigned n = kBatch + p * kPerPublisher + i;
+                        UserStore::Mutation mutation;
+                        mutation.body = json::object{{"n", n}};
+                        writes.publish(std::move(mutation), [&, n](UserStore::Mutation& written) {
+                            check(written.error.empty(), "create through the pipeline");
+                            ids[n] = written.id;
+                            pending.fetch_sub(1);
+                        });
+                    }
+                });
+            }
+            for (auto& thread : publishers) {
+                thread.join();
+            }
+            while (pending.load() > 0) {
+                std::this_thread::yield();
+            }
+        }
+
+        std::set<std::uint64_t> distinct(ids.begin(), ids.end());
+        check(distinct.size() == ids.size(), "ids handed out twice");
+        for (std::uint64_t id : ids) {
+            check(id % options.id_step == options.first_id % options.id_step, "id of another partition");
+        }
+        for (std::size_t n = 0; n < ids.size(); ++n) {
+            check(matches(store, ids[n], n), "read after creating");
+        }
+    }
+    {
+        UserStore store(options);
+        for (std::size_t n = 0; n < ids.size(); ++n) {
+            check(matches(store, ids[n], n), "read after reopening");
+        }
+    }
+    std::filesystem::remove_all(options.data_dir);
+}
+
+}  // namespace
+
+int main() {
+    StoreOptions options;
+    options.data_dir = std::filesystem::temp_directory_path() / "user_store_write_pipeline_test";
+    run(options);
+
+    options.first_id = 2;
+    options.id_step = 4;
+    run(options);
+
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS" << std::endl;
+    return EXIT_SUCCESS;
+}
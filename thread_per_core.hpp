@@ -0,0 +1,260 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Unbounded single-producer, single-consumer queue: a linked list whose
+// head only the consumer moves and whose tail only the producer moves, so
+// neither ever waits for the other
+template <class T>
+class SpscQueue {
+    private:
+        struct Node {
+            std::atomic<Node*> next{nullptr};
+            T value{};
+        };
+
+        alignas(64) Node* head_;  // Consumer's; its value is already taken
+        alignas(64) Node* tail_;  // Producer's
+
+    public:
+        SpscQueue() : head_(new Node), tail_(head_) {}
+
+        ~SpscQueue() {
+            while (head_) {
+                Node* next = head_->next.load(std::memory_order_relaxed);
+                delete head_;
+                head_ = next;
+            }
+        }
+
+        SpscQueue(SpscQueue const&) = delete;
+        SpscQueue& operator=(SpscQueue const&) = delete;
+
+        void push(T value) {
+            Node* node = new Node;
+            node->value = std::move(value);
+            tail_->next.store(node, std::memory_order_release);
+            tail_ = node;
+        }
+
+        bool pop(T& value) {
+            Node* next = head_->next.load(std::memory_order_acquire);
+            if (!next) {
+                return false;
+            }
+            value = std::move(next->value);
+            delete head_;
+            head_ = next;
+            return true;
+        }
+
+        // Consumer only
+        bool empty() const {
+            return !head_->next.load(std::memory_order_acquire);
+        }
+};
+
+// Thread-per-core runtime: one io_context per core, each run by a single
+// thread pinned to that core, and a queue from every core to every other.
+// Keys are split between the cores by owner(), and work on a key is handed
+// to the core that owns it. The server keys requests by user partition, so
+// a partition's store only sees writes from its own core (or its writer
+// thread); list rebuilds and file-route checks from other cores still read
+// it, which the store allows without locks.
+//
+// A core drains its queues between its other handlers. Once they are
+// empty it flags itself idle and waits on an eventfd, which senders only
+// write when they find the flag set, so under load messages pass without
+// system calls.
+class CoreSet {
+    public:
+        using Task = std::function<void()>;
+        static constexpr unsigned kNone = UINT_MAX;
+
+    private:
+        static constexpr std::size_t kBatch = 256;  // Tasks between looks at the sockets
+
+        struct Core {
+            boost::asio::io_context ioc{1};
+            boost::asio::posix::stream_descriptor wake{ioc};
+            std::uint64_t wake_count = 0;
+            alignas(64) std::atomic<bool> idle{true};
+            std::vector<std::unique_ptr<SpscQueue<Task>>> inbox;  // By sending core
+            std::thread thread;
+        };
+
+        std::vector<std::unique_ptr<Core>> cores_;
+        static inline thread_local unsigned current_ = kNone;
+
+        static void kick(Core& core) {
+            std::uint64_t one = 1;
+            ssize_t written = ::write(core.wake.native_handle(), &one, sizeof(one));
+            (void)written;  // A full counter is still readable
+        }
+
+        std::size_t run_inbox(Core& core, std::size_t limit) {
+            std::size_t ran = 0;
+            Task task;
+            for (auto& queue : core.inbox) {
+                while (ran < limit && queue->pop(task)) {
+                    task();
+                    ++ran;
+                }
+            }
+            return ran;
+        }
+
+        bool has_work(Core const& core) const {
+            for (auto const& queue : core.inbox) {
+                if (!queue->empty()) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void drain(unsigned index) {
+            Core& core = *cores_[index];
+            if (run_inbox(core, kBatch) == kBatch) {
+                boost::asio::post(core.ioc, [this, index] {
+                    drain(index);
+                });
+                return;
+            }
+            // Either a sender sees the flag, or this look sees its task
+            core.idle.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (has_work(core) && core.idle.exchange(false)) {
+                boost::asio::post(core.ioc, [this, index] {
+                    drain(index);
+                });
+                return;
+            }
+            wait(index);
+        }
+
+        void wait(unsigned index) {
+            Core& core = *cores_[index];
+            core.wake.async_read_some(boost::asio::buffer(&core.wake_count, sizeof(core.wake_count)),
+                [this, index](boost::system::error_code ec, std::size_t) {
+                    if (!ec) {
+                        drain(index);
+                    }
+                });
+        }
+
+        static void pin(unsigned index) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(index % std::max(1u, std::thread::hardware_concurrency()), &set);
+            ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+        }
+
+    public:
+        explicit CoreSet(unsigned count) {
+            for (unsigned i = 0; i < std::max(1u, count); ++i) {
+                auto core = std::make_unique<Core>();
+                int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (fd < 0) {
+                    throw std::system_error(errno, std::generic_category(), "eventfd");
+                }
+                core->wake.assign(fd);
+                cores_.push_back(std::move(core));
+            }
+            for (auto& core : cores_) {
+                for (std::size_t i = 0; i < cores_.size(); ++i) {
+                    core->inbox.push_back(std::make_unique<SpscQueue<Task>>());
+                }
+            }
+        }
+
+        CoreSet(CoreSet const&) = delete;
+        CoreSet& operator=(CoreSet const&) = delete;
+
+        ~CoreSet() {
+            join();
+        }
+
+        unsigned size() const {
+            return static_cast<unsigned>(cores_.size());
+        }
+
+        // The core running the caller, or kNone off the cores' threads
+        static unsigned current() {
+            return current_;
+        }
+
+        unsigned owner(std::uint64_t key) const {
+            return static_cast<unsigned>(key % cores_.size());
+        }
+
+        boost::asio::io_context& context(unsigned index) {
+            return cores_[index]->ioc;
+        }
+
+        // Runs task on core to. Only the cores' threads send.
+        void send(unsigned to, Task task) {
+            Core& core = *cores_[to];
+            core.inbox[current_]->push(std::move(task));
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (core.idle.load(std::memory_order_relaxed) && core.idle.exchange(false)) {
+                kick(core);
+            }
+        }
+
+        // Runs work on core owner, then done with its result back on the
+        // calling core. Both run right away if the caller owns the key.
+        // Whatever keeps the caller alive belongs in done, which is only
+        // released on the calling core; work may point at the caller.
+        template <class Work, class Done>
+        void call(unsigned owner, Work work, Done done) {
+            unsigned from = current_;
+            if (owner == from || from == kNone) {
+                done(work());
+                return;
+            }
+            send(owner, [this, from, work = std::move(work), done = std::move(done)]() mutable {
+                send(from, [done = std::move(done), result = work()]() mutable {
+                    done(std::move(result));
+                });
+            });
+        }
+
+        // Starts a thread per core, pinned to it
+        void start() {
+            for (unsigned i = 0; i < cores_.size(); ++i) {
+                cores_[i]->thread = std::thread([this, i] {
+                    pin(i);
+                    current_ = i;
+                    wait(i);
+                    cores_[i]->ioc.run();
+                });
+            }
+        }
+
+        void join() {
+            for (auto& core : cores_) {
+                if (core->thread.joinable()) {
+                    core->thread.join();
+                }
+            }
+        }
+};
@@ -0,0 +1,354 @@
+#pragma once
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/ssl.hpp>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+
+struct TlsOptions {
+    std::string cert_file;  // PEM, leaf first
+    std::string key_file;   // PEM
+    unsigned short port = 8443;
+    bool kernel = false;    // Hand record encryption to kTLS after the handshake
+};
+
+namespace tls_detail {
+
+// What the kernel needs to go on encrypting where OpenSSL left off
+struct KernelTx {
+    std::uint16_t version;  // TLS_1_2_VERSION or TLS_1_3_VERSION
+    std::uint16_t cipher;   // TLS_CIPHER_AES_GCM_128 or _256
+    std::array<unsigned char, 32> key;
+    std::size_t key_size;
+    std::array<unsigned char, 12> iv;  // Salt, then the rest
+    std::uint64_t sequence;            // Of the next record
+};
+
+// Gathered during the handshake, for KernelTx
+struct Secrets {
+    std::array<unsigned char, EVP_MAX_MD_SIZE> server_traffic{};  // TLS 1.3
+    std::size_t server_traffic_size = 0;
+    std::uint64_t tickets = 0;  // TLS 1.3 tickets sent, one record each
+};
+
+inline int secrets_index() {
+    static int const index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+inline Secrets* secrets_of(SSL const* ssl) {
+    return static_cast<Secrets*>(SSL_get_ex_data(ssl, secrets_index()));
+}
+
+// "SERVER_TRAFFIC_SECRET_0 <client random> <secret>", in hex
+inline void keylog(SSL const* ssl, char const* line) {
+    Secrets* secrets = secrets_of(ssl);
+    std::string_view text(line);
+    constexpr std::string_view kLabel = "SERVER_TRAFFIC_SECRET_0 ";
+    if (!secrets || !text.starts_with(kLabel)) {
+        return;
+    }
+    text = text.substr(text.rfind(' ') + 1);
+    std::size_t size = std::min(text.size() / 2, secrets->server_traffic.size());
+    for (std::size_t i = 0; i < size; ++i) {
+        auto nibble = [](char c) {
+            return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+        };
+        secrets->server_traffic[i] = static_cast<unsigned char>(nibble(text[2 * i]) << 4 | nibble(text[2 * i + 1]));
+    }
+    secrets->server_traffic_size = size;
+}
+
+inline int count_ticket(SSL* ssl, void*) {
+    if (Secrets* secrets = secrets_of(ssl)) {
+        secrets->tickets++;
+    }
+    return 1;
+}
+
+// HKDF-Expand-Label (RFC 8446 7.1) with an empty context, for outputs no
+// longer than the hash, which take a single HMAC
+inline void expand_label(EVP_MD const* md, Secrets const& secrets, std::string_view label, unsigned char* out,
+                         std::size_t size) {
+    std::string info;
+    info.push_back(static_cast<char>(size >> 8));
+    info.push_back(static_cast<char>(size & 0xff));
+    info.push_back(static_cast<char>(6 + label.size()));
+    info += "tls13 ";
+    info += label;
+    info.push_back(0);
+    info.push_back(1);
+    unsigned char block[EVP_MAX_MD_SIZE];
+    unsigned int block_size = 0;
+    HMAC(md, secrets.server_traffic.data(), static_cast<int>(secrets.server_traffic_size),
+         reinterpret_cast<unsigned char const*>(info.data()), info.size(), block, &block_size);
+    std::memcpy(out, block, size);
+}
+
+// The TLS 1.2 key block (RFC 5246 6.3): for AEAD ciphers, the client's
+// and then the server's write key, then their implicit IVs
+inline bool key_block(SSL* ssl, EVP_MD const* md, unsigned char* out, std::size_t size) {
+    unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+    std::size_t master_size = SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof(master));
+    std::string seed = "key expansion";
+    std::size_t offset = seed.size();
+    seed.resize(offset + 2 * SSL3_RANDOM_SIZE);
+    auto* random = reinterpret_cast<unsigned char*>(seed.data() + offset);
+    SSL_get_server_random(ssl, random, SSL3_RANDOM_SIZE);
+    SSL_get_client_random(ssl, random + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
+
+    EVP_KDF* kdf = EVP_KDF_fetch(nullptr, "TLS1-PRF", nullptr);
+    EVP_KDF_CTX* ctx = kdf ? EVP_KDF_CTX_new(kdf) : nullptr;
+    EVP_KDF_free(kdf);
+    if (!ctx) {
+        return false;
+    }
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, const_cast<char*>(EVP_MD_get0_name(md)), 0),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SECRET, master, master_size),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED, seed.data(), seed.size()),
+        OSSL_PARAM_construct_end()
+    };
+    bool derived = EVP_KDF_derive(ctx, out, size, params) == 1;
+    EVP_KDF_CTX_free(ctx);
+    OPENSSL_cleanse(master, sizeof(master));
+    return derived;
+}
+
+// The server's write state right after the handshake, for AES-GCM, which
+// every kernel with kTLS does; nullopt for anything else
+inline std::optional<KernelTx> kernel_tx(SSL* ssl) {
+    Secrets const* secrets = secrets_of(ssl);
+    SSL_CIPHER const* cipher = SSL_get_current_cipher(ssl);
+    if (!secrets || !cipher) {
+        return std::nullopt;
+    }
+    KernelTx tx{};
+    switch (SSL_CIPHER_get_cipher_nid(cipher)) {
+        case NID_aes_128_gcm:
+            tx.cipher = TLS_CIPHER_AES_GCM_128;
+            tx.key_size = 16;
+            break;
+        case NID_aes_256_gcm:
+            tx.cipher = TLS_CIPHER_AES_GCM_256;
+            tx.key_size = 32;
+            break;
+        default:
+            return std::nullopt;
+    }
+    EVP_MD const* md = SSL_CIPHER_get_handshake_digest(cipher);
+    if (!md) {
+        return std::nullopt;
+    }
+
+    if (SSL_version(ssl) == TLS1_3_VERSION) {
+        if (secrets->server_traffic_size != static_cast<std::size_t>(EVP_MD_get_size(md))) {
+            return std::nullopt;
+        }
+        tx.version = TLS_1_3_VERSION;
+        expand_label(md, *secrets, "key", tx.key.data(), tx.key_size);
+        expand_label(md, *secrets, "iv", tx.iv.data(), tx.iv.size());
+        // The application keys have so far sealed the session tickets
+        tx.sequence = secrets->tickets;
+        return tx;
+    }
+    if (SSL_version(ssl) == TLS1_2_VERSION) {
+        std::array<unsigned char, 2 * 32 + 2 * 4> block;
+        if (!key_block(ssl, md, block.data(), 2 * tx.key_size + 8)) {
+            return std::nullopt;
+        }
+        tx.version = TLS_1_2_VERSION;
+        std::memcpy(tx.key.data(), block.data() + tx.key_size, tx.key_size);
+        std::memcpy(tx.iv.data(), block.data() + 2 * tx.key_size + 4, 4);
+        // Finished went out as record 0. The explicit nonce only has to be
+        // unique, so it counts along with the sequence number.
+        tx.sequence = 1;
+        for (int i = 0; i < 8; ++i) {
+            tx.iv[4 + i] = static_cast<unsigned char>(tx.sequence >> (56 - 8 * i));
+        }
+        OPENSSL_cleanse(block.data(), block.size());
+        return tx;
+    }
+    return std::nullopt;
+}
+
+template <class Info>
+bool set_tx(int fd, KernelTx const& tx) {
+    Info info{};
+    info.info.version = tx.version;
+    info.info.cipher_type = tx.cipher;
+    std::memcpy(info.key, tx.key.data(), sizeof(info.key));
+    std::memcpy(info.salt, tx.iv.data(), sizeof(info.salt));
+    std::memcpy(info.iv, tx.iv.data() + sizeof(info.salt), sizeof(info.iv));
+    for (std::size_t i = 0; i < sizeof(info.rec_seq); ++i) {
+        info.rec_seq[i] = static_cast<unsigned char>(tx.sequence >> (56 - 8 * i));
+    }
+    bool set = ::setsockopt(fd, SOL_TLS, TLS_TX, &info, sizeof(info)) == 0;
+    OPENSSL_cleanse(&info, sizeof(info));
+    return set;
+}
+
+// False if the kernel has no kTLS, in which case the socket is as it was
+inline bool start_kernel_tx(int fd, KernelTx const& tx) {
+    if (::setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+        return false;
+    }
+    if (tx.cipher == TLS_CIPHER_AES_GCM_128) {
+        return set_tx<tls12_crypto_info_aes_gcm_128>(fd, tx);
+    }
+    return set_tx<tls12_crypto_info_aes_gcm_256>(fd, tx);
+}
+
+}  // namespace tls_detail
+
+// Server-side TLS settings shared by all connections: certificate, TLS 1.2
+// and up, ALPN ("h2", else "http/1.1") and resumption. Sessions resume
+// from stateless tickets, sealed with keys OpenSSL draws for this context,
+// so a returning client skips the key exchange and certificate and the
+// server keeps nothing per client. Connections end without close_notify,
+// which would evict them from a session ID cache anyway.
+class TlsContext {
+    private:
+        boost::asio::ssl::context ctx_{boost::asio::ssl::context::tls_server};
+        bool kernel_;
+
+        static constexpr unsigned char kProtocols[] = "\x02h2\x08http/1.1";
+
+        static int select_protocol(SSL*, unsigned char const** out, unsigned char* out_size,
+                                   unsigned char const* offered, unsigned int offered_size, void*) {
+            unsigned char* selected = nullptr;
+            if (SSL_select_next_proto(&selected, out_size, kProtocols, sizeof(kProtocols) - 1, offered, offered_size)
+                != OPENSSL_NPN_NEGOTIATED) {
+                return SSL_TLSEXT_ERR_NOACK;
+            }
+            *out = selected;
+            return SSL_TLSEXT_ERR_OK;
+        }
+
+    public:
+        explicit TlsContext(TlsOptions const& options) : kernel_(options.kernel) {
+            ctx_.use_certificate_chain_file(options.cert_file);
+            ctx_.use_private_key_file(options.key_file, boost::asio::ssl::context::pem);
+
+            SSL_CTX* ctx = ctx_.native_handle();
+            SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+            // Renegotiation would change keys the kernel may hold by then
+            SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+            SSL_CTX_set_alpn_select_cb(ctx, &TlsContext::select_protocol, nullptr);
+
+            static constexpr unsigned char kSessionContext[] = "user-store";
+            SSL_CTX_set_session_id_context(ctx, kSessionContext, sizeof(kSessionContext) - 1);
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+            SSL_CTX_set_timeout(ctx, 2 * 60 * 60);
+            SSL_CTX_set_num_tickets(ctx, 1);  // One per connection is enough to come back with
+
+            if (kernel_) {
+                SSL_CTX_set_keylog_callback(ctx, &tls_detail::keylog);
+                SSL_CTX_set_session_ticket_cb(ctx, &tls_detail::count_ticket, nullptr, nullptr);
+            }
+        }
+
+        TlsContext(TlsContext const&) = delete;
+        TlsContext& operator=(TlsContext const&) = delete;
+
+        boost::asio::ssl::context& get() {
+            return ctx_;
+        }
+
+        bool kernel() const {
+            return kernel_;
+        }
+};
+
+// A server-side TLS connection. After the handshake, with kernel set in
+// TlsContext and a kernel that has kTLS, the socket itself encrypts what
+// is written to it: writes then bypass OpenSSL, and so can sendfile,
+// while reads are still decrypted by OpenSSL. Otherwise everything goes
+// through OpenSSL.
+//
+// OpenSSL must write nothing once the kernel has taken over, which rules
+// out renegotiation (disabled) and answering a TLS 1.3 KeyUpdate, which
+// clients only send after many gigabytes.
+class TlsStream {
+    public:
+        using next_layer_type = boost::beast::ssl_stream<boost::beast::tcp_stream>;
+        using executor_type = next_layer_type::executor_type;
+
+    private:
+        next_layer_type tls_;
+        std::unique_ptr<tls_detail::Secrets> secrets_;  // While the handshake needs them
+        bool kernel_tx_ = false;
+
+    public:
+        TlsStream(boost::asio::ip::tcp::socket&& socket, TlsContext& context) : tls_(std::move(socket), context.get()) {
+            if (context.kernel()) {
+                secrets_ = std::make_unique<tls_detail::Secrets>();
+                SSL_set_ex_data(tls_.native_handle(), tls_detail::secrets_index(), secrets_.get());
+            }
+        }
+
+        executor_type get_executor() {
+            return tls_.get_executor();
+        }
+
+        next_layer_type& next_layer() {
+            return tls_;
+        }
+
+        // True once writes to the socket are encrypted by the kernel
+        bool kernel_tx() const {
+            return kernel_tx_;
+        }
+
+        template <class Handler>
+        void async_handshake(Handler&& handler) {
+            tls_.async_handshake(boost::asio::ssl::stream_base::server,
+                [this, handler = std::forward<Handler>(handler)](boost::beast::error_code ec) mutable {
+                    if (!ec && secrets_) {
+                        if (auto tx = tls_detail::kernel_tx(tls_.native_handle())) {
+                            kernel_tx_ = tls_detail::start_kernel_tx(
+                                boost::beast::get_lowest_layer(tls_).socket().native_handle(), *tx);
+                            OPENSSL_cleanse(&*tx, sizeof(*tx));
+                        }
+                        SSL_set_ex_data(tls_.native_handle(), tls_detail::secrets_index(), nullptr);
+                        OPENSSL_cleanse(secrets_.get(), sizeof(*secrets_));
+                        secrets_.reset();
+                    }
+                    handler(ec);
+                });
+        }
+
+        template <class Buffers, class Handler>
+        void async_read_some(Buffers const& buffers, Handler&& handler) {
+            tls_.async_read_some(buffers, std::forward<Handler>(handler));
+        }
+
+        template <class Buffers, class Handler>
+        void async_write_some(Buffers const& buffers, Handler&& handler) {
+            if (kernel_tx_) {
+                boost::beast::get_lowest_layer(tls_).async_write_some(buffers, std::forward<Handler>(handler));
+            } else {
+                tls_.async_write_some(buffers, std::forward<Handler>(handler));
+            }
+        }
+};
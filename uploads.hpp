@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <openssl/rand.h>
+#include <unistd.h>
+
+#include "file_store.hpp"
+
+// A resumable upload: a temporary file of the final length that chunks
+// are written into at their offsets, in any order and from any number of
+// connections at once, and the set of byte ranges received so far.
+//
+// The content hash follows the received prefix: the chunk that starts
+// where it ends is hashed as it arrives, so uploads sent in order are
+// hashed by the time they finish. Whatever it missed is hashed from the
+// file at the end.
+class Upload {
+    private:
+        std::mutex mutex_;
+        std::map<std::uint64_t, std::uint64_t> received_;  // first -> end of each received range
+        unsigned active_ = 0;
+        bool finished_ = false;
+        Sha256 hash_;              // Of bytes [0, hashed_)
+        std::uint64_t hashed_ = 0;
+        bool hashing_ = false;     // A chunk at hashed_ feeds hash_
+        std::chrono::steady_clock::time_point touched_ = std::chrono::steady_clock::now();
+
+        // Bytes received from offset 0 without a gap
+        std::uint64_t prefix() const {
+            auto it = received_.find(0);
+            return it == received_.end() ? 0 : it->second;
+        }
+
+    public:
+        std::string const token;
+        std::uint64_t const user;
+        std::string const name;
+        std::uint64_t const length;
+        std::filesystem::path const temp;
+        int const fd;
+
+        Upload(std::string token, std::uint64_t user, std::string name, std::uint64_t length,
+               std::filesystem::path temp, int fd)
+            : token(std::move(token)), user(user), name(std::move(name)), length(length), temp(std::move(temp)), fd(fd) {}
+
+        ~Upload() {
+            ::close(fd);
+        }
+
+        Upload(Upload const&) = delete;
+        Upload& operator=(Upload const&) = delete;
+
+        // Registers a chunk about to be written at [offset, offset + size);
+        // false if it does not fit or the upload is already finished
+        bool begin_chunk(std::uint64_t offset, std::uint64_t size) {
+            std::lock_guard lock(mutex_);
+            if (finished_ || offset > length || size > length - offset) {
+                return false;
+            }
+            active_++;
+            touched_ = std::chrono::steady_clock::now();
+            return true;
+        }
+
+        // The hash for a chunk just begun at offset to feed as it arrives,
+        // or null if offset is not where the hash ends or another chunk is
+        // there. end_chunk must then be told whether it got the hash.
+        Sha256* hash_from(std::uint64_t offset) {
+            std::lock_guard lock(mutex_);
+            if (hashing_ || offset != hashed_) {
+                return nullptr;
+            }
+            hashing_ = true;
+            return &hash_;
+        }
+
+        struct ChunkResult {
+            std::uint64_t offset;  // Bytes received from 0 without a gap
+            bool finish;           // This chunk completed the upload
+        };
+
+        // Records a chunk that was written in full (complete) or not. The
+        // caller that gets finish must commit the file; later chunks are
+        // refused.
+        ChunkResult end_chunk(std::uint64_t offset, std::uint64_t size, bool complete, bool hashed) {
+            std::lock_guard lock(mutex_);
+            active_--;
+            if (hashed) {
+                // A chunk cut short fed bytes that may never reach the file
+                hashing_ = false;
+                if (complete) {
+                    hashed_ = offset + size;
+                } else {
+                    hash_ = Sha256();
+                    hashed_ = 0;
+                }
+            }
+            if (complete && size > 0) {
+                std::uint64_t first = offset;
+                std::uint64_t end = offset + size;
+
+                // Merge with every range it overlaps or touches
+                auto it = received_.upper_bound(first);
+                if (it != received_.begin() && std::prev(it)->second >= first) {
+                    --it;
+                }
+                while (it != received_.end() && it->first <= end) {
+                    first = std::min(first, it->first);
+                    end = std::max(end, it->second);
+                    it = received_.erase(it);
+                }
+                received_.emplace(first, end);
+            }
+
+            bool finish = !finished_ && active_ == 0 && prefix() == length;
+            finished_ = finished_ || finish;
+            return {prefix(), finish};
+        }
+
+        std::uint64_t offset() {
+            std::lock_guard lock(mutex_);
+            return prefix();
+        }
+
+        // For the caller that finished the upload, which alone may touch
+        // the hash from then on: the bytes hashed so far, and more of them
+        std::uint64_t hashed() const {
+            return hashed_;
+        }
+
+        void hash(char const* data, std::size_t size) {
+            hash_.update(data, size);
+            hashed_ += size;
+        }
+
+        Digest digest() {
+            return hash_.finish();
+        }
+
+        bool idle_since(std::chrono::steady_clock::time_point when) {
+            std::lock_guard lock(mutex_);
+            return active_ == 0 && touched_ < when;
+        }
+};
+
+// Open resumable uploads by token. Uploads live in memory only; their
+// temporary files are removed by FileStore at the next startup. Uploads
+// idle for longer than the expiry are dropped when new ones are created.
+// Each upload holds a FileStore reservation for its length until it ends.
+class UploadRegistry {
+    private:
+        FileStore& files_;
+        std::chrono::steady_clock::duration expiry_;
+        std::mutex mutex_;
+        std::unordered_map<std::string, std::shared_ptr<Upload>> uploads_;
+
+        // 128 bits from OpenSSL's CSPRNG, as a token is all it takes to
+        // write to someone's upload
+        static std::string make_token() {
+            unsigned char bytes[16];
+            if (RAND_bytes(bytes, sizeof(bytes)) != 1) {
+                throw std::runtime_error("No randomness for an upload token");
+            }
+            static constexpr char kHex[] = "0123456789abcdef";
+            std::string token;
+            token.reserve(sizeof(bytes) * 2);
+            for (unsigned char byte : bytes) {
+                token += kHex[byte >> 4];
+                token += kHex[byte & 15];
+            }
+            return token;
+        }
+
+        void expire() {
+            auto cutoff = std::chrono::steady_clock::now() - expiry_;
+            for (auto it = uploads_.begin(); it != uploads_.end();) {
+                if (it->second->idle_since(cutoff)) {
+                    files_.abort(it->second->temp);
+                    files_.unreserve(it->second->user, it->second->length);
+                    it = uploads_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+    public:
+        explicit UploadRegistry(FileStore& files, std::chrono::steady_clock::duration expiry = std::chrono::hours(24))
+            : files_(files), expiry_(expiry) {}
+
+        UploadRegistry(UploadRegistry const&) = delete;
+        UploadRegistry& operator=(UploadRegistry const&) = delete;
+
+        // Null if length does not fit in user's quota
+        std::shared_ptr<Upload> create(std::uint64_t user, std::string_view name, std::uint64_t length) {
+            if (!files_.reserve(user, length)) {
+                return nullptr;
+            }
+            std::filesystem::path temp = files_.begin();
+            int fd = ::open(temp.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                int error = errno;
+                files_.unreserve(user, length);
+                throw std::system_error(error, std::generic_category(), "open " + temp.string());
+            }
+            if (::ftruncate(fd, static_cast<off_t>(length)) != 0) {
+                int error = errno;
+                ::close(fd);
+                files_.abort(temp);
+                files_.unreserve(user, length);
+                throw std::system_error(error, std::generic_category(), "ftruncate " + temp.string());
+            }
+
+            auto upload = std::make_shared<Upload>(make_token(), user, std::string(name), length, std::move(temp), fd);
+            std::lock_guard lock(mutex_);
+            expire();
+            uploads_.emplace(upload->token, upload);
+            return upload;
+        }
+
+        std::shared_ptr<Upload> find(std::string_view token) {
+            std::lock_guard lock(mutex_);
+            auto it = uploads_.find(std::string(token));
+            return it == uploads_.end() ? nullptr : it->second;
+        }
+
+        // Forgets a finished upload
+        void remove(std::string const& token) {
+            std::lock_guard lock(mutex_);
+            auto it = uploads_.find(token);
+            if (it != uploads_.end()) {
+                files_.unreserve(it->second->user, it->second->length);
+                uploads_.erase(it);
+            }
+        }
+
+        // Cancels an upload and deletes what it received
+        bool cancel(std::string_view token) {
+            std::shared_ptr<Upload> upload;
+            {
+                std::lock_guard lock(mutex_);
+                auto it = uploads_.find(std::string(token));
+                if (it == uploads_.end()) {
+                    return false;
+                }
+                upload = std::move(it->second);
+                uploads_.erase(it);
+            }
+            files_.abort(upload->temp);
+            files_.unreserve(upload->user, upload->length);
+            return true;
+        }
+};
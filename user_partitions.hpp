@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "compactor.hpp"
+#include "cpu_pool.hpp"
+#include "epoch.hpp"
+#include "user_store.hpp"
+#include "write_pipeline.hpp"
+
+// The users split between partitions, each a UserStore with its own log,
+// compactor and, if asked for, writer thread. Partition p of n hands out
+// ids p + 1, p + 1 + n, ..., so an id names its partition and no two
+// partitions ever share a record, a lock or a segment. With
+// thread-per-core, each core owns the partitions p with p % cores == core.
+//
+// The count is fixed the first time a data directory is used and written
+// to its "partitions" file. One partition keeps its log in the data
+// directory itself, as a lone UserStore does; several keep theirs in
+// partition-N subdirectories.
+class UserPartitions {
+    private:
+        struct ListCache {
+            std::uint64_t generation;
+            std::string body;
+        };
+
+        std::vector<std::unique_ptr<UserStore>> stores_;
+        std::vector<std::unique_ptr<Compactor>> compactors_;
+        std::vector<std::unique_ptr<WritePipeline>> writes_;  // Empty without the write pipeline
+        std::atomic<ListCache const*> list_cache_{nullptr};  // With several partitions
+        std::mutex rebuild_mutex_;
+        bool rebuilding_ = false;
+        std::vector<CpuPool::Task> rebuild_waiters_;  // For the rebuild in flight
+
+        // The recorded count, else 1 for a log left by a lone UserStore,
+        // else wanted, which is then recorded
+        static unsigned partition_count(std::filesystem::path const& data_dir, unsigned wanted) {
+            std::filesystem::create_directories(data_dir);
+            std::filesystem::path file = data_dir / "partitions";
+            if (std::ifstream in(file); in) {
+                unsigned count = 0;
+                if (!(in >> count) || count == 0) {
+                    throw std::runtime_error("Bad partition count in " + file.string());
+                }
+                return count;
+            }
+            for (auto const& entry : std::filesystem::directory_iterator(data_dir)) {
+                if (entry.path().extension() == ".seg") {
+                    return 1;
+                }
+            }
+            wanted = std::max(1u, wanted);
+            if (wanted > 1) {
+                std::ofstream out(file);
+                out << wanted << '\n';
+                if (!out.flush()) {
+                    throw std::runtime_error("Cannot write " + file.string());
+                }
+            }
+            return wanted;
+        }
+
+        // Sum of the partitions' generations, which grows with every write
+        std::uint64_t generation() const {
+            std::uint64_t sum = 0;
+            for (auto const& store : stores_) {
+                sum += store->generation();
+            }
+            return sum;
+        }
+
+    public:
+        UserPartitions(StoreOptions const& options, CompactorOptions const& compaction, unsigned partitions,
+                       bool write_pipeline) {
+            unsigned count = partition_count(options.data_dir, partitions);
+            for (unsigned p = 0; p < count; ++p) {
+                StoreOptions partition = options;
+                if (count > 1) {
+                    partition.data_dir = options.data_dir / ("partition-" + std::to_string(p));
+                    partition.memory_budget = options.memory_budget / count;
+                }
+                partition.first_id = p + 1;
+                partition.id_step = count;
+                stores_.push_back(std::make_unique<UserStore>(partition));
+                compactors_.push_back(std::make_unique<Compactor>(*stores_.back(), compaction));
+                if (write_pipeline) {
+                    writes_.push_back(std::make_unique<WritePipeline>(*stores_.back()));
+                }
+            }
+        }
+
+        ~UserPartitions() {
+            delete list_cache_.load();
+        }
+
+        UserPartitions(UserPartitions const&) = delete;
+        UserPartitions& operator=(UserPartitions const&) = delete;
+
+        unsigned size() const {
+            return static_cast<unsigned>(stores_.size());
+        }
+
+        unsigned partition_of(std::uint64_t id) const {
+            return static_cast<unsigned>((id - 1) % stores_.size());
+        }
+
+        UserStore& at(unsigned partition) {
+            return *stores_[partition];
+        }
+
+        // The partition id would live in; ids that were never handed out
+        // simply are not found there
+        UserStore& of(std::uint64_t id) {
+            return *stores_[partition_of(id)];
+        }
+
+        // The partition's writer thread, or null without the write pipeline
+        WritePipeline* writes(unsigned partition) {
+            return writes_.empty() ? nullptr : writes_[partition].get();
+        }
+
+        // Whether every partition has replayed its whole log
+        bool ready() const {
+            return std::all_of(stores_.begin(), stores_.end(), [](auto const& store) {
+                return store->ready();
+            });
+        }
+
+        bool list_cached() const {
+            if (stores_.size() == 1) {
+                return stores_[0]->list_cached();
+            }
+            Epoch::Guard guard;
+            ListCache const* cache = list_cache_.load(std::memory_order_acquire);
+            return cache && cache->generation == generation();
+        }
+
+        // Rebuilds the list on pool and then posts then there. A caller that
+        // finds a rebuild in flight waits for that one instead of starting
+        // its own, so a burst of lists after a write costs one rebuild.
+        void rebuild_list(CpuPool& pool, CpuPool::Task then) {
+            {
+                std::lock_guard lock(rebuild_mutex_);
+                rebuild_waiters_.push_back(std::move(then));
+                if (rebuilding_) {
+                    return;
+                }
+                rebuilding_ = true;
+            }
+            pool.post([this, &pool] {
+                {
+                    Epoch::Guard guard;
+                    list();
+                }
+                std::vector<CpuPool::Task> waiters;
+                {
+                    std::lock_guard lock(rebuild_mutex_);
+                    waiters.swap(rebuild_waiters_);
+                    rebuilding_ = false;
+                }
+                for (auto& waiter : waiters) {
+                    pool.post(std::move(waiter));
+                }
+            });
+        }
+
+        // {"users":[...]} over every partition, by id. Several partitions
+        // are merged from a snapshot of each, which the partitions' writers
+        // do not wait for. The caller must hold an Epoch::Guard.
+        std::string const& list() {
+            if (stores_.size() == 1) {
+                return stores_[0]->list();
+            }
+            std::uint64_t generation = this->generation();
+            ListCache const* cache = list_cache_.load(std::memory_order_acquire);
+            if (cache && cache->generation == generation) {
+                return cache->body;
+            }
+
+            auto* fresh = new ListCache{generation, "{\"users\":["};
+            {
+                std::vector<std::unique_ptr<UserStore::Snapshot>> snapshots;
+                std::vector<std::pair<UserRecord const*, UserStore const*>> records;
+                for (auto& store : stores_) {
+                    snapshots.push_back(std::make_unique<UserStore::Snapshot>(*store));
+                    snapshots.back()->for_each([&](UserRecord const& record) {
+                        records.emplace_back(&record, store.get());
+                    });
+                }
+                std::sort(records.begin(), records.end(), [](auto const& a, auto const& b) {
+                    return a.first->id < b.first->id;
+                });
+
+                bool first = true;
+                for (auto const& [record, store] : records) {
+                    if (!first) {
+                        fresh->body += ',';
+                    }
+                    fresh->body += store->body_of(*record);
+                    first = false;
+                }
+            }
+            fresh->body += "]}";
+
+            if (ListCache const* old = list_cache_.exchange(fresh, std::memory_order_acq_rel)) {
+                Epoch::retire(old);
+            }
+            return fresh->body;
+        }
+};
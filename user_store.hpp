@@ -0,0 +1,969 @@
+#pragma once
+
+#include <boost/json.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "bloom_filter.hpp"
+#include "epoch.hpp"
+#include "flat_index.hpp"
+#include "segment_log.hpp"
+
+namespace json = boost::json;
+
+// A stored user version. Records are kept in serialized form: the body is
+// the cached JSON of that version and is only rebuilt when the record
+// changes. Cold versions have been paged out and keep only their log
+// location; read their body through UserStore::body_of.
+struct UserRecord {
+    std::uint64_t id;
+    std::uint64_t version;
+    std::uint64_t seq;  // Commit sequence number, orders versions for snapshots
+    bool deleted;       // Tombstone left behind by DELETE
+    bool cold;
+    std::string body;
+
+    // Where this version was written in the segment log, 0 until then
+    mutable std::atomic<LogLocation> location{0};
+
+    // Next older version, kept only while a snapshot may still read it
+    mutable std::atomic<UserRecord const*> prev{nullptr};
+
+    UserRecord(std::uint64_t id, std::uint64_t version, std::uint64_t seq, bool deleted, std::string body,
+               bool cold = false)
+        : id(id), version(version), seq(seq), deleted(deleted), cold(cold), body(std::move(body)) {}
+};
+
+struct StoreOptions {
+    std::filesystem::path data_dir = "data";
+
+    // Bytes of record bodies kept in memory before cold records are paged out
+    std::size_t memory_budget = std::size_t(256) << 20;
+
+    // Threads used to replay the log at startup
+    unsigned recovery_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // Return from construction once the compacted segments are loaded and
+    // replay the rest of the log in the background. Reads may see stale
+    // versions and writes must wait for ready() meanwhile.
+    bool early_reads = false;
+
+    // Ids this store hands out: first_id, first_id + id_step, ... Stores
+    // that partition the users between them each take every id_step-th id.
+    std::uint64_t first_id = 1;
+    std::uint64_t id_step = 1;
+};
+
+// RFC 7396 JSON Merge Patch
+inline void apply_merge_patch(json::value& target, json::value const& patch) {
+    if (!patch.is_object()) {
+        target = patch;
+        return;
+    }
+    if (!target.is_object()) {
+        target = json::object();
+    }
+
+    json::object& obj = target.as_object();
+    for (auto const& [key, value] : patch.as_object()) {
+        if (value.is_null()) {
+            obj.erase(key);
+        } else {
+            apply_merge_patch(obj[key], value);
+        }
+    }
+}
+
+enum class WriteStatus {
+    ok,
+    not_found,
+    precondition_failed
+};
+
+// Records handed out by the store stay valid while the caller holds an
+// Epoch::Guard taken before the call
+struct WriteResult {
+    WriteStatus status;
+    UserRecord const* record;
+};
+
+// In-memory user store with per-record versions. Records are immutable;
+// an update builds the next version and compare-and-swaps it into the
+// record's slot, so writers to different records never wait on each other
+// and an If-Match precondition is checked against the exact version that
+// gets replaced.
+//
+// Every version is stamped with a global commit sequence and links to the
+// version it replaced, which gives multi-version snapshot reads: a scan
+// pinned at sequence S sees, per record, the newest version stamped <= S.
+// Scans walk append-only slot logs and never take a lock that writers use.
+//
+// Reads are lock-free and touch no shared counters: readers pin an epoch,
+// and versions or index tables that writers unlink are retired through
+// Epoch instead of being freed in place. Each shard maps ids to slot
+// numbers through a FlatIdIndex, fronted by a BloomFilter over all ids,
+// hot or paged out, that turns away unknown ids without probing the index.
+//
+// Every committed version is also appended to a SegmentLog, which makes the
+// store persistent and gives it a disk tier: when the bodies held in memory
+// exceed the memory budget, a CLOCK sweep swaps unreferenced records for
+// cold versions that read from the mmap'ed log, and a read of a cold record
+// brings it back into memory.
+//
+// At startup the log is replayed on several threads: segments are parsed in
+// parallel into per-thread maps, which are then merged and installed shard
+// by shard, also in parallel.
+class UserStore {
+    private:
+        static constexpr std::size_t kShardCount = 16;
+        static constexpr std::size_t kChunkSize = 1024;
+        static constexpr std::size_t kMaxChunks = 1 << 16;
+
+        struct Slot {
+            std::atomic<UserRecord const*> current{nullptr};
+            std::atomic<bool> referenced{false};  // CLOCK bit, set by reads
+        };
+
+        // Append-only slot storage. Chunks are never moved or freed while
+        // the store lives, so scanners can index published slots lock-free.
+        class SlotLog {
+            private:
+                std::unique_ptr<std::atomic<Slot*>[]> chunks_{new std::atomic<Slot*>[kMaxChunks]()};
+                std::atomic<std::size_t> size_{0};
+
+            public:
+                ~SlotLog() {
+                    for (std::size_t i = 0; i < kMaxChunks && chunks_[i].load(); ++i) {
+                        delete[] chunks_[i].load();
+                    }
+                }
+
+                // Callers serialize appends (the shard lock). Returns the
+                // new slot's number; it becomes visible on publish().
+                std::uint32_t append() {
+                    std::size_t index = size_.load(std::memory_order_relaxed);
+                    if (index / kChunkSize >= kMaxChunks) {
+                        throw std::length_error("User store is full");
+                    }
+                    std::atomic<Slot*>& chunk = chunks_[index / kChunkSize];
+                    if (!chunk.load(std::memory_order_relaxed)) {
+                        chunk.store(new Slot[kChunkSize], std::memory_order_release);
+                    }
+                    return static_cast<std::uint32_t>(index);
+                }
+
+                Slot& at(std::uint32_t index) const {
+                    return chunks_[index / kChunkSize].load(std::memory_order_acquire)[index % kChunkSize];
+                }
+
+                void publish() {
+                    size_.fetch_add(1, std::memory_order_release);
+                }
+
+                std::size_t size() const {
+                    return size_.load(std::memory_order_acquire);
+                }
+
+                template <class F>
+                void for_each(F f) const {
+                    std::size_t size = size_.load(std::memory_order_acquire);
+                    for (std::size_t i = 0; i < size; ++i) {
+                        f(chunks_[i / kChunkSize].load(std::memory_order_acquire)[i % kChunkSize]);
+                    }
+                }
+        };
+
+        // The shard lock serializes creates (slot append and index insert);
+        // updates, lookups and scans never take it. The filter holds every
+        // id in the index, so most lookups of unknown ids stop there.
+        struct Shard {
+            std::mutex mutex;
+            BloomFilter filter;
+            FlatIdIndex index;
+            SlotLog slots;
+        };
+
+        struct ListCache {
+            std::uint64_t generation;
+            std::string body;
+        };
+
+        std::array<Shard, kShardCount> shards_;
+        SegmentLog log_;
+        std::atomic<std::uint64_t> next_id_{1};
+        std::atomic<std::uint64_t> commit_seq_{0};
+
+        // Sequences of the open snapshots. Writers only read oldest_snapshot_
+        // to decide how much history the versions they touch still need.
+        std::mutex snapshots_mutex_;
+        std::multiset<std::uint64_t> snapshots_;
+        std::atomic<std::uint64_t> oldest_snapshot_{UINT64_MAX};
+
+        // Bumped after every committed write; the list cache is valid while
+        // its generation matches
+        std::atomic<std::uint64_t> generation_{0};
+        std::atomic<ListCache const*> list_cache_{nullptr};
+
+        // Bytes of bodies held by hot head versions, and the CLOCK hand
+        std::size_t memory_budget_;
+        std::uint64_t id_step_;
+        std::atomic<std::int64_t> hot_bytes_{0};
+        std::mutex evict_mutex_;
+        std::size_t hand_shard_ = 0;
+        std::size_t hand_slot_ = 0;
+
+        // Set once the whole log has been replayed
+        std::atomic<bool> ready_{false};
+        std::thread recovery_;
+
+        // Consecutive ids of this store go to consecutive shards
+        std::size_t shard_index(std::uint64_t id) const {
+            return id / id_step_ % kShardCount;
+        }
+
+        Shard& shard_for(std::uint64_t id) {
+            return shards_[shard_index(id)];
+        }
+
+        Shard const& shard_for(std::uint64_t id) const {
+            return shards_[shard_index(id)];
+        }
+
+        // Caller holds an Epoch::Guard
+        Slot* find_slot(std::uint64_t id) const {
+            Shard const& shard = shard_for(id);
+            std::uint32_t slot;
+            if (!shard.filter.may_contain(id)) {
+                return nullptr;
+            }
+            return shard.index.find(id, slot) ? &shard.slots.at(slot) : nullptr;
+        }
+
+        // Makes a new id findable. Caller holds the shard lock.
+        static void index_id(Shard& shard, std::uint64_t id, std::uint32_t slot) {
+            shard.filter.add(id, [&](auto add) {
+                shard.index.for_each_key(add);
+            });
+            shard.index.insert(id, slot);
+        }
+
+        static std::string serialize_user(std::uint64_t id, json::object user) {
+            user["id"] = id;
+            return json::serialize(user);
+        }
+
+        static std::int64_t hot_size(UserRecord const* record) {
+            return record && !record->cold ? static_cast<std::int64_t>(record->body.size()) : 0;
+        }
+
+        void log_version(UserRecord const& record) {
+            log_.append(record.id, record.version, record.deleted ? SegmentLog::kTombstone : 0, record.body,
+                        record.location);
+        }
+
+        // Swaps a hot head version without history for a cold one. Only
+        // versions already in the log can go; losing the CAS to a writer
+        // just leaves the record alone.
+        bool page_out(Slot& slot) {
+            UserRecord const* current = slot.current.load(std::memory_order_acquire);
+            if (!current || current->cold || current->deleted || current->prev.load()) {
+                return false;
+            }
+            LogLocation location = current->location.load(std::memory_order_acquire);
+            if (!location) {
+                return false;
+            }
+
+            auto* cold = new UserRecord(current->id, current->version, current->seq, false, std::string(), true);
+            cold->location.store(location, std::memory_order_relaxed);
+            if (!slot.current.compare_exchange_strong(current, cold, std::memory_order_acq_rel)) {
+                delete cold;
+                return false;
+            }
+            // The compactor may have moved the record after it was copied;
+            // it either saw this cold version or left the move on current
+            if (LogLocation moved = current->location.load(); moved != location) {
+                cold->location.store(moved);
+            }
+            hot_bytes_.fetch_sub(hot_size(current));
+            Epoch::retire(current);
+            return true;
+        }
+
+        // Reloads a cold head version into memory. Cold versions never have
+        // history (see page_out and recover), so nothing needs relinking. On
+        // a lost race the caller keeps using the cold version it has.
+        UserRecord const* promote(Slot& slot, UserRecord const* cold) {
+            LogLocation location = cold->location.load();
+            auto* hot = new UserRecord(cold->id, cold->version, cold->seq, false, std::string(log_.read(location)));
+            hot->location.store(location, std::memory_order_relaxed);
+
+            UserRecord const* expected = cold;
+            if (!slot.current.compare_exchange_strong(expected, hot, std::memory_order_acq_rel)) {
+                delete hot;
+                return cold;
+            }
+            if (LogLocation moved = cold->location.load(); moved != location) {
+                hot->location.store(moved);
+            }
+            hot_bytes_.fetch_add(hot_size(hot));
+            Epoch::retire(cold);
+            evict_if_needed();
+            return hot;
+        }
+
+        // Advances the CLOCK hand, clearing reference bits and paging out
+        // unreferenced records, until the hot set fits the budget again or
+        // two full sweeps found nothing to evict. Only one thread sweeps at
+        // a time; the others carry on.
+        void evict_if_needed() {
+            if (hot_bytes_.load(std::memory_order_relaxed) <= static_cast<std::int64_t>(memory_budget_)) {
+                return;
+            }
+            std::unique_lock lock(evict_mutex_, std::try_to_lock);
+            if (!lock.owns_lock()) {
+                return;
+            }
+
+            Epoch::Guard guard;
+            std::size_t steps = kShardCount;
+            for (Shard const& shard : shards_) {
+                steps += 2 * shard.slots.size();
+            }
+            while (steps-- > 0 && hot_bytes_.load(std::memory_order_relaxed) > static_cast<std::int64_t>(memory_budget_)) {
+                Shard& shard = shards_[hand_shard_];
+                if (hand_slot_ >= shard.slots.size()) {
+                    hand_shard_ = (hand_shard_ + 1) % kShardCount;
+                    hand_slot_ = 0;
+                    continue;
+                }
+                Slot& slot = shard.slots.at(static_cast<std::uint32_t>(hand_slot_++));
+                if (!slot.referenced.exchange(false, std::memory_order_relaxed)) {
+                    page_out(slot);
+                }
+            }
+        }
+
+        // Newest logged version of an id seen so far during recovery
+        struct Latest {
+            std::uint64_t version;
+            std::uint32_t flags;
+            LogLocation location;
+        };
+        using LatestMap = std::unordered_map<std::uint64_t, Latest>;
+
+        // Runs f(0) .. f(count - 1) on up to threads threads and rethrows
+        // the first exception once all of them are done
+        template <class F>
+        static void parallel_for(std::size_t count, unsigned threads, F f) {
+            std::atomic<std::size_t> next{0};
+            std::exception_ptr error;
+            std::mutex error_mutex;
+            auto work = [&] {
+                for (std::size_t i; (i = next.fetch_add(1)) < count;) {
+                    try {
+                        f(i);
+                    } catch (...) {
+                        std::lock_guard lock(error_mutex);
+                        if (!error) {
+                            error = std::current_exception();
+                        }
+                    }
+                }
+            };
+
+            std::vector<std::thread> workers;
+            for (std::size_t i = 1; i < std::min<std::size_t>(threads, count); ++i) {
+                workers.emplace_back(work);
+            }
+            work();
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        // Keeps the higher of two versions of an id and releases the other
+        void keep_latest(LatestMap& latest, std::uint64_t id, Latest const& entry) {
+            auto [it, inserted] = latest.try_emplace(id, entry);
+            if (inserted) {
+                return;
+            }
+            if (entry.version > it->second.version) {
+                log_.release(it->second.location);
+                it->second = entry;
+            } else {
+                log_.release(entry.location);
+            }
+        }
+
+        // Replays segments on up to threads threads, each into maps of its
+        // own split by shard, then merges the maps shard by shard in
+        // parallel. Returns the newest version of every id, by shard.
+        std::array<LatestMap, kShardCount> read_latest(std::vector<std::uint32_t> const& segments, unsigned threads) {
+            threads = std::max(1u, std::min<unsigned>(threads, static_cast<unsigned>(segments.size())));
+            std::vector<std::array<LatestMap, kShardCount>> partial(threads);
+            std::atomic<std::size_t> next{0};
+            parallel_for(threads, threads, [&](std::size_t worker) {
+                std::array<LatestMap, kShardCount>& maps = partial[worker];
+                for (std::size_t i; (i = next.fetch_add(1)) < segments.size();) {
+                    log_.replay(segments[i], [&](LogRecordHeader const& header, std::string_view, LogLocation location) {
+                        keep_latest(maps[shard_index(header.id)], header.id, {header.version, header.flags, location});
+                    });
+                }
+            });
+
+            std::array<LatestMap, kShardCount> latest;
+            parallel_for(kShardCount, threads, [&](std::size_t shard) {
+                latest[shard] = std::move(partial[0][shard]);
+                for (std::size_t i = 1; i < partial.size(); ++i) {
+                    for (auto const& [id, entry] : partial[i][shard]) {
+                        keep_latest(latest[shard], id, entry);
+                    }
+                    partial[i][shard] = LatestMap();
+                }
+            });
+            return latest;
+        }
+
+        // Installs recovered versions into one shard as cold records, in id
+        // order. An id the shard already holds is replaced if the recovered
+        // version is newer; readers may be running, but writers may not.
+        void install(Shard& shard, LatestMap const& latest) {
+            std::vector<std::uint64_t> ids;
+            ids.reserve(latest.size());
+            for (auto const& [id, entry] : latest) {
+                ids.push_back(id);
+            }
+            std::sort(ids.begin(), ids.end());
+
+            Epoch::Guard guard;
+            for (std::uint64_t id : ids) {
+                Latest const& entry = latest.at(id);
+                auto* record = new UserRecord(id, entry.version, commit_seq_.fetch_add(1) + 1,
+                                              entry.flags & SegmentLog::kTombstone, std::string(), true);
+                record->location.store(entry.location, std::memory_order_relaxed);
+
+                if (Slot* slot = find_slot(id)) {
+                    UserRecord const* current = slot->current.load(std::memory_order_acquire);
+                    while (current->version < entry.version
+                           && !slot->current.compare_exchange_weak(current, record, std::memory_order_acq_rel,
+                                                                   std::memory_order_acquire)) {
+                    }
+                    if (current->version >= entry.version) {
+                        log_.release(entry.location);
+                        delete record;
+                        continue;
+                    }
+                    hot_bytes_.fetch_sub(hot_size(current));
+                    log_.release(current->location.load());
+                    Epoch::retire(current);
+                } else {
+                    std::lock_guard lock(shard.mutex);
+                    std::uint32_t index = shard.slots.append();
+                    shard.slots.at(index).current.store(record, std::memory_order_release);
+                    index_id(shard, id, index);
+                    shard.slots.publish();
+                }
+
+                std::uint64_t next_id = next_id_.load();
+                while (next_id <= id && !next_id_.compare_exchange_weak(next_id, id + id_step_)) {
+                }
+            }
+        }
+
+        // Rebuilds the store from the given log segments on up to threads
+        // threads: the highest version of each id wins, and every record
+        // starts out cold
+        void recover(std::vector<std::uint32_t> const& segments, unsigned threads) {
+            std::array<LatestMap, kShardCount> latest = read_latest(segments, threads);
+            parallel_for(kShardCount, threads, [&](std::size_t shard) {
+                install(shards_[shard], latest[shard]);
+                latest[shard] = LatestMap();
+            });
+            generation_.fetch_add(1);
+        }
+
+        // Seeds an empty store with the example user
+        void finish_recovery() {
+            if (next_id_.load() == 1) {  // Only the store that hands out id 1
+                create(json::object{{"echo", "HelloWorld"}});
+            }
+            ready_.store(true, std::memory_order_release);
+        }
+
+        // Retires a detached chain of versions. Each link is claimed with an
+        // exchange, so racing trims never retire the same version twice.
+        static void retire_chain(UserRecord const* record) {
+            while (record) {
+                UserRecord const* prev = record->prev.exchange(nullptr);
+                Epoch::retire(record);
+                record = prev;
+            }
+        }
+
+        // Unlinks the history no open snapshot can reach any more: all of it
+        // behind next when no snapshot predates next, otherwise whatever is
+        // behind the version next replaced
+        void trim(UserRecord const* next, UserRecord const* replaced) {
+            std::uint64_t oldest = oldest_snapshot_.load();
+            if (oldest >= next->seq) {
+                retire_chain(next->prev.exchange(nullptr));
+            } else if (oldest >= replaced->seq) {
+                retire_chain(replaced->prev.exchange(nullptr));
+            }
+        }
+
+        // CAS loop shared by all updates. make_body builds the next body
+        // from the current version, or returns nullopt to delete it. The
+        // new version is not logged yet; a deletion is returned as well.
+        // Caller holds an Epoch::Guard.
+        template <class MakeBody>
+        WriteResult swap_version(std::uint64_t id, std::optional<std::uint64_t> expected_version, MakeBody make_body) {
+            Slot* slot = find_slot(id);
+            if (!slot) {
+                return {WriteStatus::not_found, nullptr};
+            }
+
+            UserRecord const* current = slot->current.load(std::memory_order_acquire);
+            for (;;) {
+                if (!current || current->deleted) {
+                    return {WriteStatus::not_found, nullptr};
+                }
+                if (expected_version && current->version != *expected_version) {
+                    return {WriteStatus::precondition_failed, current};
+                }
+
+                std::optional<std::string> body = make_body(*current);
+                auto* next = new UserRecord(
+                    id, current->version + 1, commit_seq_.fetch_add(1) + 1, !body, body ? std::move(*body) : std::string());
+                next->prev.store(current, std::memory_order_relaxed);
+
+                if (slot->current.compare_exchange_weak(current, next, std::memory_order_acq_rel,
+                                                        std::memory_order_acquire)) {
+                    hot_bytes_.fetch_add(hot_size(next) - hot_size(current));
+                    if (LogLocation superseded = current->location.load()) {
+                        log_.release(superseded);
+                    }
+                    trim(next, current);
+                    return {WriteStatus::ok, next};
+                }
+                delete next;
+            }
+        }
+
+        template <class MakeBody>
+        WriteResult update(std::uint64_t id, std::optional<std::uint64_t> expected_version, MakeBody make_body) {
+            Epoch::Guard guard;
+            WriteResult result = swap_version(id, expected_version, make_body);
+            if (result.status == WriteStatus::ok) {
+                generation_.fetch_add(1);
+                log_version(*result.record);
+                evict_if_needed();
+                if (result.record->deleted) {
+                    result.record = nullptr;
+                }
+            }
+            return result;
+        }
+
+        std::optional<std::string> patched_body(std::uint64_t id, UserRecord const& current, json::value const& patch) {
+            json::value user = json::parse(body_of(current));
+            apply_merge_patch(user, patch);
+            if (!user.is_object()) {
+                throw std::invalid_argument("Patched user must be a JSON object");
+            }
+            return serialize_user(id, std::move(user.as_object()));
+        }
+
+    public:
+        // A consistent read view of the whole store. The snapshot pins an
+        // epoch for its lifetime, so keep it short-lived.
+        class Snapshot {
+            private:
+                Epoch::Guard guard_;
+                UserStore& store_;
+                std::uint64_t registered_;
+                std::uint64_t seq_;
+
+            public:
+                explicit Snapshot(UserStore& store)
+                    : store_(store) {
+                    // Publish a lower bound before choosing the sequence, so
+                    // a writer that misses the registration has already
+                    // stamped every version this snapshot could need
+                    {
+                        std::lock_guard lock(store_.snapshots_mutex_);
+                        registered_ = store_.commit_seq_.load();
+                        store_.snapshots_.insert(registered_);
+                        store_.oldest_snapshot_.store(*store_.snapshots_.begin());
+                    }
+                    seq_ = store_.commit_seq_.load();
+                }
+
+                ~Snapshot() {
+                    std::lock_guard lock(store_.snapshots_mutex_);
+                    store_.snapshots_.erase(store_.snapshots_.find(registered_));
+                    store_.oldest_snapshot_.store(store_.snapshots_.empty() ? UINT64_MAX : *store_.snapshots_.begin());
+                }
+
+                Snapshot(Snapshot const&) = delete;
+                Snapshot& operator=(Snapshot const&) = delete;
+
+                std::uint64_t seq() const {
+                    return seq_;
+                }
+
+                // Calls f with every live record visible at this snapshot
+                template <class F>
+                void for_each(F f) const {
+                    for (Shard const& shard : store_.shards_) {
+                        shard.slots.for_each([&](Slot const& slot) {
+                            UserRecord const* record = slot.current.load(std::memory_order_acquire);
+                            while (record && record->seq > seq_) {
+                                record = record->prev.load(std::memory_order_acquire);
+                            }
+                            if (record && !record->deleted) {
+                                f(*record);
+                            }
+                        });
+                    }
+                }
+        };
+
+        explicit UserStore(StoreOptions const& options)
+            : log_(options.data_dir), memory_budget_(options.memory_budget),
+              id_step_(std::max<std::uint64_t>(1, options.id_step)) {
+            next_id_.store(options.first_id);
+            unsigned threads = options.recovery_threads;
+            if (!options.early_reads) {
+                std::vector<std::uint32_t> segments = log_.recovered_segments(true);
+                std::vector<std::uint32_t> wal = log_.recovered_segments(false);
+                segments.insert(segments.end(), wal.begin(), wal.end());
+                recover(segments, threads);
+                finish_recovery();
+                return;
+            }
+
+            recover(log_.recovered_segments(true), threads);
+            recovery_ = std::thread([this, threads] {
+                try {
+                    recover(log_.recovered_segments(false), threads);
+                    finish_recovery();
+                } catch (std::exception const& e) {
+                    std::cerr << "Recovery failed: " << e.what() << std::endl;
+                    std::abort();
+                }
+            });
+        }
+
+        ~UserStore() {
+            if (recovery_.joinable()) {
+                recovery_.join();
+            }
+            for (Shard& shard : shards_) {
+                shard.slots.for_each([](Slot const& slot) {
+                    for (UserRecord const* record = slot.current.load(); record;) {
+                        UserRecord const* prev = record->prev.load();
+                        delete record;
+                        record = prev;
+                    }
+                });
+            }
+            delete list_cache_.load();
+        }
+
+        // Whether startup recovery has replayed the whole log. Until then
+        // the store only serves reads.
+        bool ready() const {
+            return ready_.load(std::memory_order_acquire);
+        }
+
+        SegmentLog& log() {
+            return log_;
+        }
+
+        // Whether the log record at location still backs a version that a
+        // reader can reach, either the current one or history kept for a
+        // snapshot. Heads not yet written to the log keep everything.
+        bool is_live(std::uint64_t id, LogLocation location) {
+            Epoch::Guard guard;
+            Slot* slot = find_slot(id);
+            if (!slot) {
+                return false;
+            }
+            UserRecord const* head = slot->current.load(std::memory_order_acquire);
+            if (head && head->location.load() == 0) {
+                return true;
+            }
+            for (UserRecord const* record = head; record; record = record->prev.load(std::memory_order_acquire)) {
+                if (record->location.load() == location) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Points the version backed by from at its copy at to. Fails if that
+        // version is gone, in which case the copy is garbage.
+        bool relocate(std::uint64_t id, LogLocation from, LogLocation to) {
+            Epoch::Guard guard;
+            Slot* slot = find_slot(id);
+            if (!slot) {
+                return false;
+            }
+            UserRecord const* record = slot->current.load(std::memory_order_acquire);
+            for (; record; record = record->prev.load(std::memory_order_acquire)) {
+                LogLocation expected = from;
+                if (record->location.compare_exchange_strong(expected, to)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Body of a hot or cold version. The view is valid while the
+        // caller holds an Epoch::Guard.
+        std::string_view body_of(UserRecord const& record) const {
+            return record.cold ? log_.read(record.location.load(std::memory_order_acquire)) : record.body;
+        }
+
+        // Lock-free for hot records; the caller must hold an Epoch::Guard
+        UserRecord const* find(std::uint64_t id) {
+            Slot* slot = find_slot(id);
+            if (!slot) {
+                return nullptr;
+            }
+            if (!slot->referenced.load(std::memory_order_relaxed)) {
+                slot->referenced.store(true, std::memory_order_relaxed);
+            }
+            UserRecord const* record = slot->current.load(std::memory_order_acquire);
+            if (record && record->cold && !record->deleted) {
+                record = promote(*slot, record);
+            }
+            return record && !record->deleted ? record : nullptr;
+        }
+
+        UserRecord const* create(json::object user) {
+            std::uint64_t id = next_id_.fetch_add(id_step_);
+            std::string body = serialize_user(id, std::move(user));
+
+            Shard& shard = shard_for(id);
+            auto* record = new UserRecord(id, 1, 0, false, std::move(body));
+            log_version(*record);
+            {
+                std::lock_guard lock(shard.mutex);
+                std::uint32_t slot = shard.slots.append();
+                record->seq = commit_seq_.fetch_add(1) + 1;
+                shard.slots.at(slot).current.store(record, std::memory_order_release);
+                index_id(shard, id, slot);
+                shard.slots.publish();
+            }
+            hot_bytes_.fetch_add(hot_size(record));
+            generation_.fetch_add(1);
+            evict_if_needed();
+            return record;
+        }
+
+        // PUT: replace the whole user, keeping its id
+        WriteResult replace(std::uint64_t id, json::object user, std::optional<std::uint64_t> expected_version) {
+            std::string body = serialize_user(id, std::move(user));
+            return update(id, expected_version, [&](UserRecord const&) {
+                return std::optional<std::string>(body);
+            });
+        }
+
+        // PATCH: merge the patch into whichever version the CAS replaces
+        WriteResult patch(std::uint64_t id, json::value const& patch, std::optional<std::uint64_t> expected_version) {
+            return update(id, expected_version, [&](UserRecord const& current) {
+                return patched_body(id, current, patch);
+            });
+        }
+
+        // DELETE leaves a tombstone version; ids are never reused
+        WriteResult erase(std::uint64_t id, std::optional<std::uint64_t> expected_version) {
+            return update(id, expected_version, [](UserRecord const&) {
+                return std::optional<std::string>();
+            });
+        }
+
+        // A write for apply: a create, or a replace, patch or erase of id
+        struct Mutation {
+            enum class Kind {
+                create,
+                replace,
+                patch,
+                erase
+            };
+
+            Kind kind = Kind::create;
+            std::uint64_t id = 0;  // Assigned by apply for creates
+            json::value body;      // The user for create and replace, the merge patch for patch
+            std::optional<std::uint64_t> expected_version;
+            WriteResult result{WriteStatus::not_found, nullptr};
+            std::string error;  // Why the store rejected the write, if it did
+        };
+
+        // Applies a batch of writes in order, for a single writer that
+        // batches them: creates draw their ids with one fetch_add and take
+        // each shard lock once, every new version goes to the log in one
+        // append_batch, and the list cache and eviction are seen to once.
+        // Creates become findable as the batch ends. Results are valid
+        // while the caller holds an Epoch::Guard.
+        void apply(std::vector<Mutation>& batch) {
+            Epoch::Guard guard;
+            std::size_t creates = std::count_if(batch.begin(), batch.end(), [](Mutation const& mutation) {
+                return mutation.kind == Mutation::Kind::create;
+            });
+            std::uint64_t next_id = creates ? next_id_.fetch_add(creates * id_step_) : 0;
+
+            std::vector<UserRecord const*> written;
+            std::array<std::vector<UserRecord*>, kShardCount> created;
+            std::int64_t created_bytes = 0;
+            for (Mutation& mutation : batch) {
+                try {
+                    switch (mutation.kind) {
+                        case Mutation::Kind::create: {
+                            mutation.id = next_id;
+                            next_id += id_step_;
+                            auto* record = new UserRecord(mutation.id, 1, 0, false,
+                                                          serialize_user(mutation.id, std::move(mutation.body.as_object())));
+                            created[shard_index(mutation.id)].push_back(record);
+                            created_bytes += hot_size(record);
+                            mutation.result = {WriteStatus::ok, record};
+                            break;
+                        }
+                        case Mutation::Kind::replace: {
+                            std::string body = serialize_user(mutation.id, std::move(mutation.body.as_object()));
+                            mutation.result = swap_version(mutation.id, mutation.expected_version, [&](UserRecord const&) {
+                                return std::optional<std::string>(body);
+                            });
+                            break;
+                        }
+                        case Mutation::Kind::patch:
+                            mutation.result = swap_version(mutation.id, mutation.expected_version,
+                                                           [&](UserRecord const& current) {
+                                                               return patched_body(mutation.id, current, mutation.body);
+                                                           });
+                            break;
+                        case Mutation::Kind::erase:
+                            mutation.result = swap_version(mutation.id, mutation.expected_version, [](UserRecord const&) {
+                                return std::optional<std::string>();
+                            });
+                            break;
+                    }
+                } catch (std::exception const& e) {
+                    mutation.error = e.what();
+                    continue;
+                }
+                if (mutation.result.status == WriteStatus::ok) {
+                    written.push_back(mutation.result.record);
+                }
+            }
+
+            std::vector<SegmentLog::Append> appends;
+            appends.reserve(written.size());
+            for (UserRecord const* record : written) {
+                appends.push_back({record->id, record->version, record->deleted ? SegmentLog::kTombstone : 0, record->body,
+                                   &record->location});
+            }
+            log_.append_batch(appends);
+
+            for (std::size_t i = 0; i < kShardCount; ++i) {
+                if (created[i].empty()) {
+                    continue;
+                }
+                Shard& shard = shards_[i];
+                std::lock_guard lock(shard.mutex);
+                std::uint64_t seq = commit_seq_.fetch_add(created[i].size());
+                for (UserRecord* record : created[i]) {
+                    std::uint32_t slot = shard.slots.append();
+                    record->seq = ++seq;
+                    shard.slots.at(slot).current.store(record, std::memory_order_release);
+                    index_id(shard, record->id, slot);
+                    shard.slots.publish();  // The next append takes the next slot
+                }
+            }
+
+            for (Mutation& mutation : batch) {
+                if (mutation.result.record && mutation.result.record->deleted) {
+                    mutation.result.record = nullptr;
+                }
+            }
+            hot_bytes_.fetch_add(created_bytes);
+            if (!written.empty()) {
+                generation_.fetch_add(1);
+                evict_if_needed();
+            }
+        }
+
+        // Bumped after every committed write
+        std::uint64_t generation() const {
+            return generation_.load();
+        }
+
+        // Whether list() would return its cached body without a rebuild
+        bool list_cached() const {
+            Epoch::Guard guard;
+            ListCache const* cache = list_cache_.load(std::memory_order_acquire);
+            return cache && cache->generation == generation_.load();
+        }
+
+        // {"users":[...]} assembled from the cached record bodies, so a
+        // rebuild never re-serializes records that did not change. The scan
+        // reads a snapshot and does not hold up concurrent writers. The
+        // caller must hold an Epoch::Guard.
+        std::string const& list() {
+            std::uint64_t generation = generation_.load();
+            ListCache const* cache = list_cache_.load(std::memory_order_acquire);
+            if (cache && cache->generation == generation) {
+                return cache->body;
+            }
+
+            auto* fresh = new ListCache{generation, "{\"users\":["};
+            {
+                Snapshot snapshot(*this);
+                std::vector<UserRecord const*> records;
+                snapshot.for_each([&](UserRecord const& record) {
+                    records.push_back(&record);
+                });
+                std::sort(records.begin(), records.end(), [](UserRecord const* a, UserRecord const* b) {
+                    return a->id < b->id;
+                });
+
+                bool first = true;
+                for (UserRecord const* record : records) {
+                    if (!first) {
+                        fresh->body += ',';
+                    }
+                    fresh->body += body_of(*record);
+                    first = false;
+                }
+            }
+            fresh->body += "]}";
+
+            if (ListCache const* old = list_cache_.exchange(fresh, std::memory_order_acq_rel)) {
+                Epoch::retire(old);
+            }
+            return fresh->body;
+        }
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "epoch.hpp"
+#include "user_store.hpp"
+
+// Single-writer path for store mutations, after the LMAX disruptor. Writers
+// claim a slot of a preallocated ring with one fetch_add, fill it in and
+// publish it by stamping the slot's sequence. One writer thread takes
+// every published slot in order as a batch, applies the batch with
+// UserStore::apply and then completes each write, so shard locks, the log
+// and the list cache see one writer and one batch at a time instead of
+// every session at once.
+class WritePipeline {
+    public:
+        // Called on the writer thread, under an Epoch::Guard, once the
+        // write's batch is applied and logged
+        using Done = std::function<void(UserStore::Mutation&)>;
+
+        static constexpr std::size_t kRingSize = 4096;
+
+    private:
+        // A slot's sequence is its claim number while free and one more once
+        // published; freeing it adds kRingSize for the next lap
+        struct alignas(64) Entry {
+            std::atomic<std::uint64_t> sequence{0};
+            UserStore::Mutation mutation;
+            Done done;  // Empty for the stop marker
+        };
+
+        UserStore& store_;
+        std::unique_ptr<Entry[]> ring_{new Entry[kRingSize]};
+        alignas(64) std::atomic<std::uint64_t> claimed_{0};
+        std::thread writer_;
+
+        void run() {
+            std::vector<UserStore::Mutation> batch;
+            std::vector<Done> done;
+            for (std::uint64_t next = 0;;) {
+                Entry& head = ring_[next % kRingSize];
+                head.sequence.wait(next, std::memory_order_acquire);
+
+                // Everything published by now, up to the stop marker
+                std::uint64_t end = next;
+                bool stop = false;
+                while (end - next < kRingSize) {
+                    Entry& entry = ring_[end % kRingSize];
+                    if (entry.sequence.load(std::memory_order_acquire) != end + 1) {
+                        break;
+                    }
+                    if (!entry.done) {
+                        stop = true;
+                        break;
+                    }
+                    batch.push_back(std::move(entry.mutation));
+                    done.push_back(std::move(entry.done));
+                    entry.mutation = {};
+                    entry.done = nullptr;
+                    entry.sequence.store(end + kRingSize, std::memory_order_release);
+                    entry.sequence.notify_all();
+                    ++end;
+                }
+
+                if (!batch.empty()) {
+                    Epoch::Guard guard;
+                    try {
+                        store_.apply(batch);
+                    } catch (std::exception const& e) {
+                        // The log failed; the batch's writes may or may not stay
+                        for (UserStore::Mutation& mutation : batch) {
+                            mutation.error = e.what();
+                        }
+                    }
+                    for (std::size_t i = 0; i < batch.size(); ++i) {
+                        done[i](batch[i]);
+                    }
+                    batch.clear();
+                    done.clear();
+                }
+                if (stop) {
+                    return;
+                }
+                next = end;
+            }
+        }
+
+    public:
+        explicit WritePipeline(UserStore& store) : store_(store) {
+            for (std::size_t i = 0; i < kRingSize; ++i) {
+                ring_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+            writer_ = std::thread([this] {
+                run();
+            });
+        }
+
+        ~WritePipeline() {
+            publish({}, nullptr);
+            writer_.join();
+        }
+
+        WritePipeline(WritePipeline const&) = delete;
+        WritePipeline& operator=(WritePipeline const&) = delete;
+
+        // Queues a write; waits for a free slot while the ring is full
+        void publish(UserStore::Mutation mutation, Done done) {
+            std::uint64_t claim = claimed_.fetch_add(1, std::memory_order_relaxed);
+            Entry& entry = ring_[claim % kRingSize];
+            for (std::uint64_t seen; (seen = entry.sequence.load(std::memory_order_acquire)) != claim;) {
+                entry.sequence.wait(seen, std::memory_order_acquire);
+            }
+            entry.mutation = std::move(mutation);
+            entry.done = std::move(done);
+            entry.sequence.store(claim + 1, std::memory_order_release);
+            entry.sequence.notify_all();
+        }
+};